@@ -30,129 +30,1631 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
+
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "ae.h"
 #include "zmalloc.h"
+#include "config.h"
+
+#include <signal.h>
+#include <poll.h>
+
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SIGNALFD
+#include <sys/signalfd.h>
+#endif
+#ifdef HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif
+
+/* Include the best multiplexing layer supported by this system.
+ * The following should be ordered by performances, descending. */
+#ifdef HAVE_EPOLL
+#include "ae_epoll.c"
+#else
+#ifdef HAVE_POLL
+#include "ae_poll.c"
+#else
+#include "ae_select.c"
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include "ae_uring.c"
+#endif
+
+/* ----------------------------------------------------------------------------
+ * Clock
+ *
+ * The loop measures time with a monotonic clock in microseconds, so that
+ * timers are not affected by changes of the system time. The clock is read
+ * once at the start of every iteration and once after the multiplexing
+ * layer returns, and cached in eventLoop->now: timers and deadlines are
+ * computed from the cached value, and handlers can use aeGetTime() instead
+ * of calling the kernel themselves.
+ *
+ * On Linux clock_gettime(CLOCK_MONOTONIC) is served by the vDSO without
+ * entering the kernel. Building with USE_PROCESSOR_CLOCK on x86_64 reads the
+ * TSC directly instead, when the CPU advertises an invariant TSC.
+ * ------------------------------------------------------------------------- */
+
+static long long aeMonotonicClock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+#if defined(USE_PROCESSOR_CLOCK) && defined(__x86_64__) && defined(__linux__)
+static double aeTicksPerUs = 0; /* 0 if the TSC can't be used */
+static long long aeTscBase; /* monotonic clock at calibration time */
+static unsigned long long aeTscStart;
+
+static inline unsigned long long aeReadTsc(void) {
+    unsigned int lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+/* The TSC is only usable if it runs at a constant rate in every power
+ * state. Its frequency is measured against the monotonic clock. */
+static void aeMonotonicInit(void) {
+    FILE *fp = fopen("/proc/cpuinfo","r");
+    char buf[4096];
+    int invariant = 0;
+    unsigned long long tsc;
+    long long start;
+
+    if (aeTicksPerUs != 0 || fp == NULL) {
+        if (fp) fclose(fp);
+        return;
+    }
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        if (strncmp(buf,"flags",5) != 0) continue;
+        invariant = strstr(buf," constant_tsc") && strstr(buf," nonstop_tsc");
+        break;
+    }
+    fclose(fp);
+    if (!invariant) return;
+
+    aeTscBase = start = aeMonotonicClock();
+    aeTscStart = tsc = aeReadTsc();
+    while (aeMonotonicClock() - start < 10000); /* 10 milliseconds */
+    aeTicksPerUs = (double)(aeReadTsc()-tsc) / (aeMonotonicClock()-start);
+}
+
+static long long aeMonotonicUs(void) {
+    if (aeTicksPerUs == 0) return aeMonotonicClock();
+    return aeTscBase + (long long)((aeReadTsc()-aeTscStart)/aeTicksPerUs);
+}
+#else
+static void aeMonotonicInit(void) {
+}
+
+static long long aeMonotonicUs(void) {
+    return aeMonotonicClock();
+}
+#endif
+
+//更新 eventLoop 缓存的当前时间
+static void aeUpdateTime(aeEventLoop *eventLoop) {
+    eventLoop->now = aeMonotonicUs();
+}
+
+/* Time new timers and deadlines are relative to. Handlers use the cached
+ * clock, code running outside aeProcessEvents() (like the initialization
+ * of the program) may have been running for a while, so read it again. */
+static long long aeSchedulingTime(aeEventLoop *eventLoop) {
+    if (!eventLoop->processing) aeUpdateTime(eventLoop);
+    return eventLoop->now;
+}
+
+/**
+ * 得到当前时间，单位为微秒，只能用来计算时间间隔
+ * 在事件处理函数中返回的是本次循环缓存的时间，不会进行系统调用
+ */
+long long aeGetTime(aeEventLoop *eventLoop) {
+    return aeSchedulingTime(eventLoop);
+}
+
+/* ----------------------------------------------------------------------------
+ * Statistics
+ *
+ * Once enabled with aeEnableStats() the loop measures every iteration (the
+ * time blocked in the multiplexing layer and the time spent out of it) and
+ * every handler call, keeping them in latency histograms together with the
+ * number of handlers called. A handler call that takes longer than the
+ * stall threshold is logged with the address of the handler, to find out
+ * what blocks the loop.
+ *
+ * Only the thread running the loop writes the statistics, with relaxed
+ * atomic stores, so aeGetStats() can read them from any thread without
+ * locks. When disabled the cost is a NULL test per handler call.
+ * ------------------------------------------------------------------------- */
+
+#define aeStatIncr(var) __atomic_store_n(&(var), (var)+1, __ATOMIC_RELAXED)
+#define aeStatSet(var,val) __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+#define aeStatGet(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+static int aeHistBucket(long long value) {
+    int pow;
+
+    if (value < (1<<AE_HIST_SUB_BITS)) return value < 0 ? 0 : (int)value;
+    pow = 63 - __builtin_clzll((unsigned long long)value);
+    if (pow > 31) return AE_HIST_BUCKETS-1;
+    return ((pow-AE_HIST_SUB_BITS+1)<<AE_HIST_SUB_BITS) +
+        (int)((value >> (pow-AE_HIST_SUB_BITS)) & ((1<<AE_HIST_SUB_BITS)-1));
+}
+
+/* Highest value that goes into the bucket */
+static long long aeHistBucketMax(int bucket) {
+    int pow, sub;
+
+    if (bucket < (1<<AE_HIST_SUB_BITS)) return bucket;
+    pow = (bucket>>AE_HIST_SUB_BITS) + AE_HIST_SUB_BITS-1;
+    sub = bucket & ((1<<AE_HIST_SUB_BITS)-1);
+    return ((long long)((1<<AE_HIST_SUB_BITS)+sub+1) << (pow-AE_HIST_SUB_BITS)) - 1;
+}
+
+static void aeStatsRecord(aeEventLoop *eventLoop, int hist, long long us) {
+    aeStatIncr(eventLoop->stats->hist[hist][aeHistBucket(us)]);
+}
+
+//开启统计时返回当前时间，作为 aeStatsHandler 的 start 参数
+static long long aeStatsStart(aeEventLoop *eventLoop) {
+    return eventLoop->stats ? aeMonotonicUs() : 0;
+}
+
+/* Account a handler call that started at 'start'. The handler itself may
+ * have enabled or disabled the statistics. */
+static void aeStatsHandler(aeEventLoop *eventLoop, int kind, void *proc,
+        long long id, long long start)
+{
+    aeLoopStats *st = eventLoop->stats;
+    long long end, duration;
+    aeStall *stall;
+
+    if (st == NULL || start == 0) return;
+    end = aeMonotonicUs();
+    duration = end - start;
+    aeStatsRecord(eventLoop, kind, duration);
+    if (kind == AE_STAT_FILE) aeStatIncr(st->fileEvents);
+    else if (kind == AE_STAT_TIMER) aeStatIncr(st->timeEvents);
+    else aeStatIncr(st->deadlines);
+    if (st->stallThreshold == 0 || duration < st->stallThreshold) return;
+    stall = &st->stallLog[st->stalls % AE_STALL_LOG];
+    aeStatSet(stall->proc, proc);
+    aeStatSet(stall->kind, kind);
+    aeStatSet(stall->id, id);
+    aeStatSet(stall->duration, duration);
+    aeStatSet(stall->when, end);
+    __atomic_store_n(&st->stalls, st->stalls+1, __ATOMIC_RELEASE);
+}
+
+/**
+ * 开启 eventLoop 的统计，如果已经开启了则清空之前的统计
+ * @param stallThreshold : 单次调用处理函数超过这个时间(微秒)会被记录下来，0 表示不记录
+ */
+int aeEnableStats(aeEventLoop *eventLoop, long long stallThreshold) {
+    if (eventLoop->stats == NULL &&
+        (eventLoop->stats = zmalloc(sizeof(aeLoopStats))) == NULL)
+        return AE_ERR;
+    memset(eventLoop->stats,0,sizeof(aeLoopStats));
+    eventLoop->stats->stallThreshold = stallThreshold;
+    return AE_OK;
+}
+
+//关闭统计，调用时其它线程不能再调用 aeGetStats
+void aeDisableStats(aeEventLoop *eventLoop) {
+    zfree(eventLoop->stats);
+    eventLoop->stats = NULL;
+}
+
+/**
+ * 把 eventLoop 的统计复制到 stats 中，可以在任意线程中调用
+ * 没有开启统计时返回 AE_ERR
+ */
+int aeGetStats(aeEventLoop *eventLoop, aeLoopStats *stats) {
+    aeLoopStats *st = eventLoop->stats;
+    int j, k;
+
+    if (st == NULL) return AE_ERR;
+    stats->iterations = aeStatGet(st->iterations);
+    stats->fileEvents = aeStatGet(st->fileEvents);
+    stats->timeEvents = aeStatGet(st->timeEvents);
+    stats->deadlines = aeStatGet(st->deadlines);
+    stats->stallThreshold = aeStatGet(st->stallThreshold);
+    stats->stalls = __atomic_load_n(&st->stalls, __ATOMIC_ACQUIRE);
+    for (j = 0; j < AE_STALL_LOG; j++) {
+        stats->stallLog[j].proc = aeStatGet(st->stallLog[j].proc);
+        stats->stallLog[j].kind = aeStatGet(st->stallLog[j].kind);
+        stats->stallLog[j].id = aeStatGet(st->stallLog[j].id);
+        stats->stallLog[j].duration = aeStatGet(st->stallLog[j].duration);
+        stats->stallLog[j].when = aeStatGet(st->stallLog[j].when);
+    }
+    for (j = 0; j < AE_STAT_HISTS; j++)
+        for (k = 0; k < AE_HIST_BUCKETS; k++)
+            stats->hist[j][k] = aeStatGet(st->hist[j][k]);
+    return AE_OK;
+}
+
+/**
+ * 返回 stats 中 hist 这个直方图的百分位数，单位为微秒
+ * @param hist : AE_STAT_* 中的一个
+ * @param percentile : 0 到 100，例如 99.9
+ */
+long long aeStatsPercentile(aeLoopStats *stats, int hist, double percentile) {
+    unsigned long long total = 0, count = 0;
+    double target;
+    int j;
+
+    for (j = 0; j < AE_HIST_BUCKETS; j++) total += stats->hist[hist][j];
+    if (total == 0) return 0;
+    target = total * percentile / 100;
+    for (j = 0; j < AE_HIST_BUCKETS; j++) {
+        count += stats->hist[hist][j];
+        if (count && count >= target) break;
+    }
+    return aeHistBucketMax(j < AE_HIST_BUCKETS ? j : AE_HIST_BUCKETS-1);
+}
+
+/* ----------------------------------------------------------------------------
+ * Tracing
+ *
+ * Between aeStartTrace() and aeStopTrace() the loop appends a record to a
+ * binary file for every handler it calls: file events with the fd and the
+ * mask fired, time events with their id, deadlines with their fd, all with
+ * the time of the loop clock. aeReplayTraceLive() feeds a trace back to
+ * the handlers of a loop, with a virtual clock, to benchmark them offline
+ * against the interleaving of events seen in production.
+ *
+ * A trace records when every handler ran, not the data it read: replaying
+ * calls the handlers registered in the loop at replay time on the same fd
+ * numbers, and they do real I/O on whatever those fds are. So the fds have
+ * to be live, set up by the caller (pipes or socket pairs fed with the
+ * data to serve, for instance), and the records of fds without a matching
+ * event are skipped.
+ *
+ * Records go through stdio buffering, so the cost is a NULL test per
+ * handler call when disabled, and a memcpy when enabled.
+ * ------------------------------------------------------------------------- */
+
+static void aeTraceEvent(aeEventLoop *eventLoop, int type, int fd, int mask,
+        long long id)
+{
+    aeTraceRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.when = eventLoop->now;
+    rec.id = id;
+    rec.fd = fd;
+    rec.type = type;
+    rec.mask = mask;
+    /* A trace can't stop the loop: give up tracing on write errors */
+    if (fwrite(&rec, sizeof(rec), 1, eventLoop->trace) != 1)
+        aeStopTrace(eventLoop);
+}
+
+/**
+ * 开始把 eventLoop 调用的事件处理函数记录到文件 filename 中
+ * 文件已经存在时会被覆盖，成功返回 AE_OK，失败返回 AE_ERR
+ */
+int aeStartTrace(aeEventLoop *eventLoop, const char *filename) {
+    FILE *fp;
+
+    aeStopTrace(eventLoop);
+    if ((fp = fopen(filename, "wb")) == NULL) return AE_ERR;
+    if (fwrite(AE_TRACE_MAGIC, 8, 1, fp) != 1) {
+        fclose(fp);
+        return AE_ERR;
+    }
+    eventLoop->trace = fp;
+    return AE_OK;
+}
+
+//停止记录，把缓冲中的记录写入文件
+void aeStopTrace(aeEventLoop *eventLoop) {
+    if (eventLoop->trace == NULL) return;
+    fclose(eventLoop->trace);
+    eventLoop->trace = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Tasks
+ *
+ * Only the thread running the loop may touch it, but other threads can post
+ * it a task with aePostTask(): the task runs later in the thread of the
+ * loop, for instance to deliver the result of some work done in background.
+ *
+ * Tasks go into an intrusive multi producer single consumer queue (the one
+ * by Dmitry Vyukov): posting costs an atomic exchange on the head, and the
+ * loop pops from the tail without locks. The loop is woken up by an eventfd
+ * (a pipe where it's not available) registered as a readable event, and
+ * taskWakeup makes sure that only the first task posted while the loop is
+ * busy pays for the write(2).
+ * ------------------------------------------------------------------------- */
+
+static void aeTaskPush(aeEventLoop *eventLoop, aeTask *task) {
+    aeTask *prev;
+
+    __atomic_store_n(&task->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&eventLoop->taskHead, task, __ATOMIC_ACQ_REL);
+    /* Until this store the task can't be reached from the tail */
+    __atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+/* Pop the oldest task. Returns NULL if the queue is empty, or if a producer
+ * is still in the middle of aeTaskPush(): the next call will get it. */
+static aeTask *aeTaskPop(aeEventLoop *eventLoop) {
+    aeTask *tail = eventLoop->taskTail;
+    aeTask *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &eventLoop->taskStub) {
+        if (next == NULL) return NULL;
+        eventLoop->taskTail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next == NULL) {
+        if (tail != __atomic_load_n(&eventLoop->taskHead, __ATOMIC_ACQUIRE))
+            return NULL;
+        /* The last task can't leave the queue empty: queue the stub again */
+        aeTaskPush(eventLoop, &eventLoop->taskStub);
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (next == NULL) return NULL;
+    }
+    eventLoop->taskTail = next;
+    return tail;
+}
+
+static void aeTaskWakeup(aeEventLoop *eventLoop) {
+    unsigned long long one = 1; /* eventfd counters are 64 bit */
+
+    if (__atomic_exchange_n(&eventLoop->taskWakeup, 1, __ATOMIC_SEQ_CST))
+        return;
+    /* A full pipe (EAGAIN) is fine: the loop is going to wake up anyway */
+    if (write(eventLoop->taskfd[1], &one, sizeof(one)) == -1) return;
+}
+
+static void aeTaskHandler(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    char buf[64];
+    aeTask *task;
+    int j;
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+
+    /* Clear the flag before draining the queue: whoever posts a task we
+     * don't see from now on will write again, and wake up the next
+     * iteration. */
+    __atomic_store_n(&eventLoop->taskWakeup, 0, __ATOMIC_SEQ_CST);
+    while (read(fd, buf, sizeof(buf)) == sizeof(buf));
+    for (j = 0; j < AE_TASK_BATCH; j++) {
+        if ((task = aeTaskPop(eventLoop)) == NULL) return;
+        task->proc(eventLoop, task->arg);
+        zfree(task);
+    }
+    /* Still tasks to run: serve the other events first */
+    aeTaskWakeup(eventLoop);
+}
+
+static void aeTaskClose(aeEventLoop *eventLoop) {
+    aeTask *task;
+
+    while ((task = aeTaskPop(eventLoop)) != NULL) zfree(task);
+    if (eventLoop->taskfd[0] != -1) close(eventLoop->taskfd[0]);
+    if (eventLoop->taskfd[1] != eventLoop->taskfd[0]) close(eventLoop->taskfd[1]);
+}
+
+static int aeTaskInit(aeEventLoop *eventLoop) {
+    eventLoop->taskStub.next = NULL;
+    eventLoop->taskHead = eventLoop->taskTail = &eventLoop->taskStub;
+    eventLoop->taskWakeup = 0;
+#ifdef HAVE_EVENTFD
+    eventLoop->taskfd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    eventLoop->taskfd[1] = eventLoop->taskfd[0];
+    if (eventLoop->taskfd[0] == -1) return AE_ERR;
+#else
+    if (pipe(eventLoop->taskfd) == -1) {
+        eventLoop->taskfd[0] = eventLoop->taskfd[1] = -1;
+        return AE_ERR;
+    }
+    /* Posting a task must never block the thread posting it */
+    fcntl(eventLoop->taskfd[0], F_SETFL, fcntl(eventLoop->taskfd[0], F_GETFL)|O_NONBLOCK);
+    fcntl(eventLoop->taskfd[1], F_SETFL, fcntl(eventLoop->taskfd[1], F_GETFL)|O_NONBLOCK);
+    fcntl(eventLoop->taskfd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(eventLoop->taskfd[1], F_SETFD, FD_CLOEXEC);
+#endif
+    if (aeCreateFileEvent(eventLoop, eventLoop->taskfd[0], AE_READABLE,
+            aeTaskHandler, NULL, NULL) == AE_ERR) {
+        aeTaskClose(eventLoop);
+        return AE_ERR;
+    }
+    return AE_OK;
+}
+
+/**
+ * 让 eventLoop 所在的线程执行 proc(eventLoop, arg)，可以在任意线程中调用
+ * 任务按照提交的顺序执行，每次循环最多执行 AE_TASK_BATCH 个
+ * 在其它线程中调用之前需要先调用 zmalloc_enable_thread_safeness()
+ * eventLoop 被释放时还没有执行的任务会被直接丢弃
+ */
+int aePostTask(aeEventLoop *eventLoop, aeTaskProc *proc, void *arg) {
+    aeTask *task = zmalloc(sizeof(*task));
+
+    if (!task) return AE_ERR;
+    task->proc = proc;
+    task->arg = arg;
+    aeTaskPush(eventLoop, task);
+    aeTaskWakeup(eventLoop);
+    return AE_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Signals
+ *
+ * aeCreateSignalEvent() turns a signal into an ordinary readable event: the
+ * handler runs in the loop like any other, so it can do everything a file
+ * event handler does, and no system call is ever interrupted by EINTR.
+ *
+ * On Linux the signals are blocked and read from a signalfd. Signals are
+ * only queued to the signalfd if every thread blocks them, so the loop
+ * must register them before other threads are created (they inherit the
+ * signal mask). Elsewhere the classic self pipe trick is used: a sigaction()
+ * handler writes the signal number into a pipe the loop is reading from.
+ * Either way a signal can be handled by a single loop of the process.
+ *
+ * aeEnableTimerfd() makes the loop sleep on a timerfd armed for the next
+ * timer instead of passing a timeout to the multiplexing layer, for a
+ * resolution the latter may not have (epoll_wait() counts milliseconds).
+ * ------------------------------------------------------------------------- */
+
+#ifndef HAVE_SIGNALFD
+/* Write end of the self pipe of the loop handling every signal */
+static int aeSignalPipe[AE_NSIG];
+
+static void aeSignalCatch(int signo) {
+    int saved_errno = errno;
+    unsigned char c = signo;
+
+    /* A full pipe is fine: the loop will wake up anyway */
+    if (write(aeSignalPipe[signo], &c, 1) == -1) {}
+    errno = saved_errno;
+}
+#endif
+
+static void aeSignalFire(aeEventLoop *eventLoop, int signo) {
+    aeSignalHandler *sh;
+
+    if (signo <= 0 || signo >= AE_NSIG) return;
+    sh = &eventLoop->signals[signo];
+    if (sh->proc) sh->proc(eventLoop, signo, sh->clientData);
+}
+
+static void aeSignalHandlerProc(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask)
+{
+    ssize_t nread;
+    int j;
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+
+#ifdef HAVE_SIGNALFD
+    struct signalfd_siginfo info[16];
+
+    while ((nread = read(fd, info, sizeof(info))) > 0) {
+        for (j = 0; j < nread/(ssize_t)sizeof(info[0]); j++)
+            aeSignalFire(eventLoop, info[j].ssi_signo);
+    }
+#else
+    unsigned char sig[64];
+
+    while ((nread = read(fd, sig, sizeof(sig))) > 0) {
+        for (j = 0; j < nread; j++) aeSignalFire(eventLoop, sig[j]);
+    }
+#endif
+}
+
+#ifdef HAVE_SIGNALFD
+/* Create the signalfd, or update its mask with the handled signals */
+static int aeSignalUpdate(aeEventLoop *eventLoop) {
+    sigset_t mask;
+    int j, fd;
+
+    sigemptyset(&mask);
+    for (j = 1; j < AE_NSIG; j++)
+        if (eventLoop->signals[j].proc) sigaddset(&mask, j);
+    fd = signalfd(eventLoop->sigfd[0], &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    if (fd == -1) return AE_ERR;
+    if (eventLoop->sigfd[0] == -1) {
+        if (aeCreateFileEvent(eventLoop, fd, AE_READABLE,
+                aeSignalHandlerProc, NULL, NULL) == AE_ERR) {
+            close(fd);
+            return AE_ERR;
+        }
+        eventLoop->sigfd[0] = eventLoop->sigfd[1] = fd;
+    }
+    return AE_OK;
+}
+#else
+static int aeSignalPipeInit(aeEventLoop *eventLoop) {
+    int fds[2];
+
+    if (eventLoop->sigfd[0] != -1) return AE_OK;
+    if (pipe(fds) == -1) return AE_ERR;
+    /* The signal handler must never block */
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL)|O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL)|O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    if (aeCreateFileEvent(eventLoop, fds[0], AE_READABLE,
+            aeSignalHandlerProc, NULL, NULL) == AE_ERR) {
+        close(fds[0]);
+        close(fds[1]);
+        return AE_ERR;
+    }
+    eventLoop->sigfd[0] = fds[0];
+    eventLoop->sigfd[1] = fds[1];
+    return AE_OK;
+}
+#endif
+
+/**
+ * 让 eventLoop 在收到信号 signo 时调用 proc(eventLoop, signo, clientData)
+ * 同一个信号在处理之前收到多次时只会调用一次 proc
+ * 使用 signalfd 时需要在创建其它线程之前调用，否则信号可能会被其它线程处理
+ * 成功返回 AE_OK，signo 不合法或者失败时返回 AE_ERR
+ */
+int aeCreateSignalEvent(aeEventLoop *eventLoop, int signo,
+        aeSignalProc *proc, void *clientData)
+{
+    aeSignalHandler *sh;
+
+    if (signo <= 0 || signo >= AE_NSIG || signo >= NSIG || proc == NULL) {
+        errno = EINVAL;
+        return AE_ERR;
+    }
+    if (eventLoop->signals == NULL) {
+        eventLoop->signals = zmalloc(sizeof(aeSignalHandler)*AE_NSIG);
+        if (eventLoop->signals == NULL) return AE_ERR;
+        memset(eventLoop->signals, 0, sizeof(aeSignalHandler)*AE_NSIG);
+    }
+    sh = &eventLoop->signals[signo];
+#ifdef HAVE_SIGNALFD
+    {
+        aeSignalHandler old = *sh;
+        sigset_t set;
+
+        sh->proc = proc;
+        sh->clientData = clientData;
+        if (aeSignalUpdate(eventLoop) == AE_ERR) {
+            *sh = old;
+            return AE_ERR;
+        }
+        /* Blocked signals stay pending until read from the signalfd */
+        sigemptyset(&set);
+        sigaddset(&set, signo);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+#else
+    {
+        struct sigaction act;
+
+        if (aeSignalPipeInit(eventLoop) == AE_ERR) return AE_ERR;
+        aeSignalPipe[signo] = eventLoop->sigfd[1];
+        sh->proc = proc;
+        sh->clientData = clientData;
+        memset(&act, 0, sizeof(act));
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_RESTART;
+        act.sa_handler = aeSignalCatch;
+        if (sigaction(signo, &act, NULL) == -1) {
+            sh->proc = NULL;
+            return AE_ERR;
+        }
+    }
+#endif
+    return AE_OK;
+}
+
+/* Stop handling signo: the default disposition of the signal is restored. */
+void aeDeleteSignalEvent(aeEventLoop *eventLoop, int signo) {
+    if (signo <= 0 || signo >= AE_NSIG || eventLoop->signals == NULL ||
+        eventLoop->signals[signo].proc == NULL) return;
+    eventLoop->signals[signo].proc = NULL;
+#ifdef HAVE_SIGNALFD
+    {
+        sigset_t set;
+
+        aeSignalUpdate(eventLoop);
+        sigemptyset(&set);
+        sigaddset(&set, signo);
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    }
+#else
+    signal(signo, SIG_DFL);
+#endif
+}
+
+static void aeSignalClose(aeEventLoop *eventLoop) {
+    int j;
+
+    if (eventLoop->signals) {
+        for (j = 1; j < AE_NSIG; j++) aeDeleteSignalEvent(eventLoop, j);
+        zfree(eventLoop->signals);
+    }
+    if (eventLoop->sigfd[0] != -1) close(eventLoop->sigfd[0]);
+    if (eventLoop->sigfd[1] != eventLoop->sigfd[0]) close(eventLoop->sigfd[1]);
+    if (eventLoop->timerfd != -1) close(eventLoop->timerfd);
+}
+
+#ifdef HAVE_TIMERFD
+static void aeTimerfdHandler(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    unsigned long long expirations;
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+
+    /* The timers themselves run right after the file events */
+    if (read(fd, &expirations, sizeof(expirations)) == -1) {}
+    eventLoop->timerfdWhen = 0;
+}
+#endif
+
+/**
+ * 让 eventLoop 使用 timerfd 等待最近的定时器，而不是把超时时间传给多路复用层
+ * 不支持 timerfd 的系统上返回 AE_ERR，这时继续使用原来的超时时间
+ */
+int aeEnableTimerfd(aeEventLoop *eventLoop) {
+#ifdef HAVE_TIMERFD
+    int fd;
+
+    if (eventLoop->timerfd != -1) return AE_OK;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (fd == -1) return AE_ERR;
+    if (aeCreateFileEvent(eventLoop, fd, AE_READABLE,
+            aeTimerfdHandler, NULL, NULL) == AE_ERR) {
+        close(fd);
+        return AE_ERR;
+    }
+    eventLoop->timerfd = fd;
+    eventLoop->timerfdWhen = 0;
+    return AE_OK;
+#else
+    AE_NOTUSED(eventLoop);
+    errno = ENOSYS;
+    return AE_ERR;
+#endif
+}
+
+/* Arm the timerfd for the timeout 'tvp' and return the timeout to pass to
+ * the multiplexing layer: NULL, as the timerfd is going to wake it up. The
+ * timer is only reprogrammed when the time of the next timer changes. */
+static struct timeval *aeTimerfdArm(aeEventLoop *eventLoop,
+        struct timeval *tvp)
+{
+#ifdef HAVE_TIMERFD
+    struct itimerspec its;
+    long long wait, when;
+
+    memset(&its, 0, sizeof(its));
+    if (tvp == NULL) {
+        /* Nothing to wait for: a stale expiration is just a wakeup more */
+        if (eventLoop->timerfdWhen &&
+            timerfd_settime(eventLoop->timerfd, 0, &its, NULL) == 0)
+            eventLoop->timerfdWhen = 0;
+        return NULL;
+    }
+    wait = (long long)tvp->tv_sec*1000000 + tvp->tv_usec;
+    if (wait == 0) return tvp;
+    when = eventLoop->now + wait;
+    if (when != eventLoop->timerfdWhen) {
+        its.it_value.tv_sec = wait/1000000;
+        its.it_value.tv_nsec = (wait%1000000)*1000;
+        if (timerfd_settime(eventLoop->timerfd, 0, &its, NULL) == -1)
+            return tvp;
+        eventLoop->timerfdWhen = when;
+    }
+    return NULL;
+#else
+    AE_NOTUSED(eventLoop);
+    return tvp;
+#endif
+}
+
+/* ----------------------------------------------------------------------------
+ * Completion I/O
+ *
+ * aeSubmitRead() and aeSubmitWrite() start a read into (or a write from) a
+ * buffer owned by the caller, and call it back once done with the result
+ * of the system call: the bytes transferred, that may be less than asked
+ * (0 at EOF), or -errno. The buffer must stay valid until then. Requests
+ * on the same fd and direction run one after the other, in order.
+ * aeCancelIo() cancels them, and must be called before the fd is closed:
+ * otherwise they would go on with whatever reuses the fd number.
+ *
+ * Where io_uring is available the reads and writes are queued in its ring
+ * and the whole batch is submitted with a single system call right before
+ * the loop sleeps; completions are reaped from shared memory when the ring
+ * fd (registered as a readable event) signals them. Elsewhere every request
+ * waits for its fd to be ready and then calls read(2) or write(2): in that
+ * case an fd with requests in progress can't also have a handler of its own
+ * for the same direction. Either way, like any fd served by the event loop,
+ * the fd must be in non blocking mode (see anetNonBlock()).
+ * ------------------------------------------------------------------------- */
+
+static int aeGrowSetSize(aeEventLoop *eventLoop, int fd);
+
+#define aeIoKind(req) ((req)->mask == AE_READABLE ? AE_KIND_READABLE : \
+                                                    AE_KIND_WRITABLE)
+
+static void aeIoDone(aeEventLoop *eventLoop, aeIoRequest *req, int res);
+
+static void aeIoReadyHandler(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    aeIoRequest *req = clientData;
+    ssize_t nbytes;
+    AE_NOTUSED(mask);
+
+    if (req->mask == AE_READABLE)
+        nbytes = read(fd, req->buf, req->len);
+    else
+        nbytes = write(fd, req->buf, req->len);
+    if (nbytes == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    aeIoDone(eventLoop, req, nbytes == -1 ? -errno : (int)nbytes);
+}
+
+#ifdef HAVE_IO_URING
+static void aeIoRingHandler(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    void *req;
+    int res, j;
+    AE_NOTUSED(fd);
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+
+    /* What's left is reaped in the next iteration, the ring fd stays
+     * readable until the completion ring is empty. */
+    for (j = 0; j < AE_RING_ENTRIES*2; j++) {
+        if (!aeRingReap(eventLoop->ioRing, &req, &res)) break;
+        /* The completions of the cancellations carry no request */
+        if (req) aeIoDone(eventLoop, req, res);
+    }
+}
+#endif
+
+/* Look for io_uring the first time the loop does completion I/O */
+static void aeIoProbe(aeEventLoop *eventLoop) {
+    eventLoop->ioProbed = 1;
+#ifdef HAVE_IO_URING
+    if ((eventLoop->ioRing = aeRingCreate()) == NULL) return;
+    if (aeCreateFileEvent(eventLoop, ((aeRing*)eventLoop->ioRing)->fd,
+            AE_READABLE, aeIoRingHandler, NULL, NULL) == AE_ERR) {
+        aeRingFree(eventLoop->ioRing);
+        eventLoop->ioRing = NULL;
+    }
+#endif
+}
+
+/* Start the request at the head of the queue of its fd. A request the ring
+ * has no room for waits for readiness instead, and fails with EBUSY if the
+ * fd has a handler of its own for that direction. */
+static int aeIoStart(aeEventLoop *eventLoop, aeIoRequest *req) {
+    aeFileEvent *fe = &eventLoop->events[req->fd];
+    int kind = aeIoKind(req);
+
+#ifdef HAVE_IO_URING
+    if (eventLoop->ioRing &&
+        aeRingQueue(eventLoop->ioRing,
+            req->mask == AE_READABLE ? IORING_OP_READ : IORING_OP_WRITE,
+            req->fd, req->buf, req->len, req) == 0) {
+        req->ready = 0;
+        return AE_OK;
+    }
+#endif
+    req->ready = 1;
+    /* The previous request of the fd was waiting for readiness too: don't
+     * touch the multiplexing layer, just switch request. */
+    if (fe->mask & req->mask &&
+        fe->handlers[kind].fileProc == aeIoReadyHandler) {
+        fe->handlers[kind].clientData = req;
+        return AE_OK;
+    }
+    /* Don't replace the handler the fd already has for this direction */
+    if (fe->mask & req->mask) {
+        errno = EBUSY;
+        return AE_ERR;
+    }
+    return aeCreateFileEvent(eventLoop, req->fd, req->mask,
+            aeIoReadyHandler, req, NULL);
+}
+
+static void aeIoUnlink(aeEventLoop *eventLoop, aeIoRequest *req) {
+    if (req->prev) req->prev->next = req->next;
+    else eventLoop->ioRequests = req->next;
+    if (req->next) req->next->prev = req->prev;
+}
+
+/* Complete the request and start the next one of its fd. If that can't
+ * start it is completed as well, with the error. */
+static void aeIoDone(aeEventLoop *eventLoop, aeIoRequest *req, int res) {
+    int fd = req->fd, kind = aeIoKind(req);
+
+    /* Already detached from the fd by aeCancelIo() */
+    if (req->cancelled) {
+        aeIoUnlink(eventLoop, req);
+        req->proc(eventLoop, fd, req->clientData, res);
+        zfree(req);
+        return;
+    }
+    while (req) {
+        aeIoRequest *next = req->queued;
+        aeFileEvent *fe = &eventLoop->events[fd];
+        int nextres = 0;
+
+        fe->ioQueue[kind] = next;
+        aeIoUnlink(eventLoop, req);
+        if (next && aeIoStart(eventLoop, next) == AE_ERR)
+            nextres = errno ? -errno : -EIO;
+        fe = &eventLoop->events[fd];
+        if (req->ready && (next == NULL || !next->ready || nextres) &&
+            fe->mask & req->mask &&
+            fe->handlers[kind].fileProc == aeIoReadyHandler) {
+            /* Not the last event of a closing fd: keep the requests */
+            eventLoop->ioKeep++;
+            aeDeleteFileEvent(eventLoop, fd, req->mask);
+            eventLoop->ioKeep--;
+        }
+        req->proc(eventLoop, fd, req->clientData, res);
+        zfree(req);
+        /* The callback may have cancelled the next one already */
+        if (nextres == 0 || eventLoop->events[fd].ioQueue[kind] != next) break;
+        req = next;
+        res = nextres;
+    }
+}
+
+static int aeSubmitIo(aeEventLoop *eventLoop, int fd, int mask, void *buf,
+        unsigned int len, aeIoProc *proc, void *clientData)
+{
+    aeIoRequest *req, **tail;
+
+    if (fd < 0 || aeGrowSetSize(eventLoop, fd) == AE_ERR) return AE_ERR;
+    if (!eventLoop->ioProbed) aeIoProbe(eventLoop);
+    if ((req = zmalloc(sizeof(*req))) == NULL) return AE_ERR;
+    req->fd = fd;
+    req->mask = mask;
+    req->buf = buf;
+    req->len = len;
+    req->proc = proc;
+    req->clientData = clientData;
+    req->ready = 0;
+    req->cancelled = 0;
+    req->queued = NULL;
+    tail = &eventLoop->events[fd].ioQueue[aeIoKind(req)];
+    if (*tail == NULL && aeIoStart(eventLoop, req) == AE_ERR) {
+        zfree(req);
+        return AE_ERR;
+    }
+    while (*tail) tail = &(*tail)->queued;
+    *tail = req;
+    req->prev = NULL;
+    req->next = eventLoop->ioRequests;
+    if (req->next) req->next->prev = req;
+    eventLoop->ioRequests = req;
+    return AE_OK;
+}
+
+/**
+ * 从 fd 读取最多 len 个字节到 buf 中，读取完成后调用 proc
+ * proc 的参数 res 为读到的字节数，0 表示 EOF，负数为 -errno
+ * 在 proc 被调用之前 buf 必须一直有效
+ * 没有 io_uring 的时候如果 fd 已经注册了同一方向的文件事件，返回 AE_ERR 并且 errno 为 EBUSY
+ */
+int aeSubmitRead(aeEventLoop *eventLoop, int fd, void *buf, unsigned int len,
+        aeIoProc *proc, void *clientData)
+{
+    return aeSubmitIo(eventLoop, fd, AE_READABLE, buf, len, proc, clientData);
+}
+
+//把 buf 中的 len 个字节写到 fd，写完之后调用 proc，res 为写入的字节数或者 -errno
+int aeSubmitWrite(aeEventLoop *eventLoop, int fd, const void *buf,
+        unsigned int len, aeIoProc *proc, void *clientData)
+{
+    return aeSubmitIo(eventLoop, fd, AE_WRITABLE, (void*)buf, len, proc,
+            clientData);
+}
+
+/**
+ * 取消 fd 上 mask (AE_READABLE 为读，AE_WRITABLE 为写) 方向还没有完成的请求
+ * 还在排队或者在等待 fd 就绪的请求立即以 -ECANCELED 回调；
+ * 已经交给 io_uring 的请求会提交一个 IORING_OP_ASYNC_CANCEL，
+ * 之后以 -ECANCELED (或者来不及取消时的结果) 回调，所以 buf 必须保持有效直到回调被调用
+ * 关闭 fd 之前必须调用，fd 上最后一个文件事件被删除的时候也会自动调用
+ */
+void aeCancelIo(aeEventLoop *eventLoop, int fd, int mask) {
+    int kind;
+
+    if (fd < 0 || fd >= eventLoop->setsize) return;
+    for (kind = AE_KIND_READABLE; kind <= AE_KIND_WRITABLE; kind++) {
+        aeFileEvent *fe = &eventLoop->events[fd];
+        aeIoRequest *req = fe->ioQueue[kind], *next;
+        int head = 1;
+
+        if (!(mask & (1<<kind)) || req == NULL) continue;
+        /* Detach the queue first: the callbacks may submit new requests */
+        fe->ioQueue[kind] = NULL;
+        if (req->ready && fe->mask & req->mask &&
+            fe->handlers[kind].fileProc == aeIoReadyHandler) {
+            eventLoop->ioKeep++;
+            aeDeleteFileEvent(eventLoop, fd, req->mask);
+            eventLoop->ioKeep--;
+        }
+        for (; req; req = next, head = 0) {
+            next = req->queued;
+#ifdef HAVE_IO_URING
+            /* Only the head is in the ring, the others are not started */
+            if (head && !req->ready) {
+                req->cancelled = 1;
+                req->queued = NULL;
+                aeRingQueue(eventLoop->ioRing, IORING_OP_ASYNC_CANCEL, -1,
+                        req, 0, NULL);
+                continue;
+            }
+#else
+            AE_NOTUSED(head);
+#endif
+            aeIoUnlink(eventLoop, req);
+            req->proc(eventLoop, fd, req->clientData, -ECANCELED);
+            zfree(req);
+        }
+    }
+}
+
+//把本次循环中积累的 io_uring 请求一次性提交给内核
+static void aeIoFlush(aeEventLoop *eventLoop) {
+#ifdef HAVE_IO_URING
+    if (eventLoop->ioRing) aeRingFlush(eventLoop->ioRing);
+#else
+    AE_NOTUSED(eventLoop);
+#endif
+}
+
+/* Requests still in progress are dropped without calling them back */
+static void aeIoClose(aeEventLoop *eventLoop) {
+    while (eventLoop->ioRequests) {
+        aeIoRequest *req = eventLoop->ioRequests;
+
+        eventLoop->ioRequests = req->next;
+        zfree(req);
+    }
+#ifdef HAVE_IO_URING
+    if (eventLoop->ioRing) aeRingFree(eventLoop->ioRing);
+#endif
+}
 
 /**
  * 创建一个 aeEventLoop 对象
  */
 aeEventLoop *aeCreateEventLoop(void) {
     aeEventLoop *eventLoop;
+    int j;
 
     eventLoop = zmalloc(sizeof(*eventLoop));
 	//如果分配内存失败
     if (!eventLoop) return NULL;
 	//初始化成员变量
-    eventLoop->fileEventHead = NULL;
-    eventLoop->timeEventHead = NULL;
+    eventLoop->maxfd = -1;
+    eventLoop->registered = 0;
+    eventLoop->setsize = AE_SETSIZE_INIT;
+    eventLoop->events = zmalloc(sizeof(aeFileEvent)*eventLoop->setsize);
+    eventLoop->fired = zmalloc(sizeof(aeFiredEvent)*eventLoop->setsize);
+    eventLoop->requeued = zmalloc(sizeof(int)*eventLoop->setsize);
+    if (!eventLoop->events || !eventLoop->fired || !eventLoop->requeued)
+        goto err;
+    //所有的 fd 槽位初始时都没有注册事件
+    memset(eventLoop->events,0,sizeof(aeFileEvent)*eventLoop->setsize);
+    eventLoop->timeEventHeapSize = AE_TIMERS_INIT;
+    eventLoop->timeEventTableSize = AE_TIMERS_INIT*2;
+    eventLoop->timeEventHeap =
+        zmalloc(sizeof(aeTimeEvent*)*eventLoop->timeEventHeapSize);
+    eventLoop->timeEventTable =
+        zmalloc(sizeof(aeTimeEvent*)*eventLoop->timeEventTableSize);
+    if (!eventLoop->timeEventHeap || !eventLoop->timeEventTable) goto err;
+    memset(eventLoop->timeEventTable,0,
+           sizeof(aeTimeEvent*)*eventLoop->timeEventTableSize);
+    eventLoop->timeEventCount = 0;
     eventLoop->timeEventNextId = 0;
+    eventLoop->iteration = 0;
+    eventLoop->processing = 0;
+    aeMonotonicInit();
+    aeUpdateTime(eventLoop);
+    //时间轮在第一次设置 deadline 时才会对齐到当前时间
+    eventLoop->wheelTick = 0;
+    eventLoop->wheelCount = 0;
+    for (j = 0; j < AE_WHEEL_SLOTS; j++) eventLoop->wheel[j] = -1;
+    eventLoop->wheelExpiring = -1;
+    memset(eventLoop->wheelBits,0,sizeof(eventLoop->wheelBits));
     eventLoop->stop = 0;
+    eventLoop->beforesleep = NULL;
+    eventLoop->aftersleep = NULL;
+    eventLoop->ioRequests = NULL;
+    eventLoop->ioProbed = 0;
+    eventLoop->ioKeep = 0;
+    eventLoop->ioRing = NULL;
+    eventLoop->stats = NULL;
+    eventLoop->requeuedCount = 0;
+    eventLoop->priorityFds = 0;
+    eventLoop->eventBudget = 0;
+    eventLoop->signals = NULL;
+    eventLoop->sigfd[0] = eventLoop->sigfd[1] = -1;
+    eventLoop->timerfd = -1;
+    eventLoop->timerfdWhen = 0;
+    eventLoop->trace = NULL;
+    eventLoop->coroutines = NULL;
+    eventLoop->coFree = NULL;
+    //初始化多路复用层 (epoll/select)
+    if (aeApiCreate(eventLoop) == -1) goto err;
+    //注册用来唤醒 eventLoop 执行其它线程提交的任务的 fd
+    if (aeTaskInit(eventLoop) == AE_ERR) {
+        aeApiFree(eventLoop);
+        goto err;
+    }
     return eventLoop;
+
+err:
+    zfree(eventLoop->events);
+    zfree(eventLoop->fired);
+    zfree(eventLoop->requeued);
+    zfree(eventLoop->timeEventHeap);
+    zfree(eventLoop->timeEventTable);
+    zfree(eventLoop);
+    return NULL;
 }
 //释放一个 aeEventLoop 对象
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
+    //释放还挂起在这个 eventLoop 上的协程的栈
+    if (eventLoop->coFree) eventLoop->coFree(eventLoop);
+    aeIoClose(eventLoop);
+    aeTaskClose(eventLoop);
+    aeSignalClose(eventLoop);
+    aeStopTrace(eventLoop);
+    zfree(eventLoop->stats);
+    aeApiFree(eventLoop);
+    for (j = 0; j < eventLoop->timeEventCount; j++)
+        zfree(eventLoop->timeEventHeap[j]);
+    zfree(eventLoop->events);
+    zfree(eventLoop->fired);
+    zfree(eventLoop->requeued);
+    zfree(eventLoop->timeEventHeap);
+    zfree(eventLoop->timeEventTable);
     zfree(eventLoop);
 }
-//设置 eventLoop 的成员变量 stop 为1，表示该 eventLoop 不在进行处理
-void aeStop(aeEventLoop *eventLoop) {
-    eventLoop->stop = 1;
+//设置 eventLoop 的成员变量 stop 为1，表示该 eventLoop 不在进行处理
+void aeStop(aeEventLoop *eventLoop) {
+    eventLoop->stop = 1;
+}
+
+/* Make sure the events table, the fired array and the multiplexing layer
+ * have a slot for 'fd', doubling the set size as needed. */
+static int aeGrowSetSize(aeEventLoop *eventLoop, int fd) {
+    aeFileEvent *events;
+    aeFiredEvent *fired;
+    int *requeued, setsize = eventLoop->setsize;
+
+    if (fd < setsize) return AE_OK;
+    while (setsize <= fd) setsize *= 2;
+    if (aeApiResize(eventLoop,setsize) == -1) return AE_ERR;
+    fired = zrealloc(eventLoop->fired,sizeof(aeFiredEvent)*setsize);
+    if (!fired) return AE_ERR;
+    eventLoop->fired = fired;
+    requeued = zrealloc(eventLoop->requeued,sizeof(int)*setsize);
+    if (!requeued) return AE_ERR;
+    eventLoop->requeued = requeued;
+    events = zrealloc(eventLoop->events,sizeof(aeFileEvent)*setsize);
+    if (!events) return AE_ERR;
+    memset(events+eventLoop->setsize,0,
+           sizeof(aeFileEvent)*(setsize-eventLoop->setsize));
+    eventLoop->events = events;
+    eventLoop->setsize = setsize;
+    return AE_OK;
+}
+/**
+ * 为 fd 注册 mask 中的事件，添加到 eventLoop 中
+ * 每个 fd 对应 events 数组中的一个槽位，mask 中的每种事件各自保存一组处理函数，
+ * 同一种事件重复注册会覆盖之前的处理函数
+ * mask 中带有 AE_EDGE 时 fd 的所有事件都变为边缘触发（直到 fd 的事件全部删除）：
+ * 处理函数必须一直读写到 EAGAIN（见 anetReadToEagain/anetWriteToEagain），
+ * 或者用 aeRequeueFileEvent 在下一次循环中继续处理，否则不会再被通知
+ * 多路复用层不支持边缘触发时 (poll/select) AE_EDGE 被忽略
+ * @param eventLoop: 事件将要添加到的事件结构体
+ * @param fd : 将要注册事件的 fd
+ * @param mask: fd 的 mask
+ * @param proc : 当该时间发生时，调用的函数，由用户编写
+ * @param clientData: 用户数据
+ * @param finalizerProc : 销毁该事件时调用的函数，由用户编写
+ */
+int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
+        aeFileProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc)
+{
+    aeFileEvent *fe;
+    int kind, oldedge, edge = mask & AE_EDGE;
+
+    mask &= ~AE_EDGE;
+    if (fd < 0 || aeGrowSetSize(eventLoop, fd) == AE_ERR) return AE_ERR;
+    fe = &eventLoop->events[fd];
+    //多路复用层需要先知道 fd 的触发方式，失败的时候要恢复原来的方式
+    oldedge = fe->edge;
+    if (edge) fe->edge = 1;
+    //通知多路复用层 (epoll/select) 监听新的事件
+    if (aeApiAddEvent(eventLoop, fd, mask) == -1) {
+        fe->edge = oldedge;
+        return AE_ERR;
+    }
+    /* Read by other threads to balance a loop group, see
+     * aeLoopGroupDispatch(). Only this thread writes it. */
+    if (fe->mask == AE_NONE)
+        __atomic_store_n(&eventLoop->registered, eventLoop->registered+1,
+                __ATOMIC_RELAXED);
+    fe->mask |= mask;
+    for (kind = 0; kind < AE_FILE_KINDS; kind++) {
+        if (!(mask & (1<<kind))) continue;
+        fe->handlers[kind].fileProc = proc;
+        fe->handlers[kind].finalizerProc = finalizerProc;
+        fe->handlers[kind].clientData = clientData;
+    }
+    if (fd > eventLoop->maxfd) eventLoop->maxfd = fd;
+    return AE_OK;
+}
+//返回 fd 上注册了的事件
+int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
+    if (fd < 0 || fd >= eventLoop->setsize) return AE_NONE;
+    return eventLoop->events[fd].mask;
+}
+
+/**
+ * 删除 fd 上 mask 中的事件
+ * 同一次注册的所有事件都被删除之后才会调用 finalizerProc
+ * @param eventLoop : 事件所在的事件结构体
+ * @param fd : 将要删除事件的文件描述符
+ * @param mask : 将要删除的事件
+ */
+void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+    aeFileEvent *fe;
+    aeFileHandler removed[AE_FILE_KINDS];
+    int kind, j, gone, numremoved = 0;
+
+    if (fd < 0 || fd >= eventLoop->setsize) return;
+    fe = &eventLoop->events[fd];
+    mask &= fe->mask;
+    if (mask == AE_NONE) return;
+
+    aeApiDelEvent(eventLoop, fd, mask);
+    fe->mask &= ~mask;
+    gone = fe->mask == AE_NONE;
+    if (gone) {
+        __atomic_store_n(&eventLoop->registered, eventLoop->registered-1,
+                __ATOMIC_RELAXED);
+        /* The fd number will be reused by some other connection */
+        if (fe->priority != AE_PRIO_NORMAL) eventLoop->priorityFds--;
+        fe->priority = AE_PRIO_NORMAL;
+        fe->budget = 0;
+        fe->edge = 0;
+        /* Nor inherit the deadline or the readiness requeued for the old
+         * one */
+        aeDeleteDeadline(eventLoop, fd);
+        if (fe->requeued != AE_NONE) {
+            for (j = 0; j < eventLoop->requeuedCount; j++) {
+                if (eventLoop->requeued[j] != fd) continue;
+                memmove(eventLoop->requeued+j, eventLoop->requeued+j+1,
+                        sizeof(int)*(eventLoop->requeuedCount-j-1));
+                eventLoop->requeuedCount--;
+                break;
+            }
+            fe->requeued = AE_NONE;
+            fe->deferred = 0;
+        }
+    }
+    for (kind = 0; kind < AE_FILE_KINDS; kind++) {
+        if (!(mask & (1<<kind))) continue;
+        removed[numremoved++] = fe->handlers[kind];
+        memset(&fe->handlers[kind],0,sizeof(aeFileHandler));
+    }
+    //如果 fd 是最大的那个，需要找到新的 maxfd
+    if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
+        while (eventLoop->maxfd >= 0 &&
+               eventLoop->events[eventLoop->maxfd].mask == AE_NONE)
+            eventLoop->maxfd--;
+    }
+
+    /* Call every finalizer once, and only when no kind of event still
+     * registered for this fd refers to the same client data. */
+    for (j = 0; j < numremoved; j++) {
+        aeFileHandler *h = removed+j;
+        int k, inuse = 0;
+
+        if (h->finalizerProc == NULL) continue;
+        for (k = 0; k < j; k++) {
+            if (removed[k].finalizerProc == h->finalizerProc &&
+                removed[k].clientData == h->clientData) inuse = 1;
+        }
+        for (kind = 0; kind < AE_FILE_KINDS; kind++) {
+            if (fe->mask & (1<<kind) &&
+                fe->handlers[kind].finalizerProc == h->finalizerProc &&
+                fe->handlers[kind].clientData == h->clientData) inuse = 1;
+        }
+        if (!inuse) h->finalizerProc(eventLoop, h->clientData);
+    }
+    /* The fd is most likely going to be closed: its reads and writes
+     * would go on with the next user of the fd number */
+    if (gone && !eventLoop->ioKeep)
+        aeCancelIo(eventLoop, fd, AE_READABLE|AE_WRITABLE);
+}
+/* ----------------------------------------------------------------------------
+ * Fairness
+ *
+ * A connection flooding the server with pipelined requests must not keep
+ * the loop busy while the others, the listening socket and the timers
+ * wait. So:
+ *
+ * 1) Every fd can have a budget (aeSetFileEventBudget()), the bytes its
+ *    handler should move in one call. A handler that stops at its budget
+ *    with more data pending calls aeRequeueFileEvent(): the event fires
+ *    again in the next iteration, after the other fds and the timers had
+ *    their turn, even if the kernel has nothing new to report.
+ * 2) The loop serves at most eventBudget fds per iteration (see
+ *    aeSetEventBudget()), the readiness of the others is requeued.
+ * 3) Fds with a higher priority (aeSetFileEventPriority()) are served
+ *    before the others in every iteration, and so before the budget runs
+ *    out.
+ * ------------------------------------------------------------------------- */
+
+/**
+ * 设置 fd 的优先级，同一次循环中优先级高的 fd 先被处理
+ * fd 的所有事件都被删除之后优先级恢复为 AE_PRIO_NORMAL
+ * @param priority : AE_PRIO_HIGH, AE_PRIO_NORMAL 或者 AE_PRIO_LOW
+ */
+int aeSetFileEventPriority(aeEventLoop *eventLoop, int fd, int priority) {
+    aeFileEvent *fe;
+
+    if (fd < 0 || fd >= eventLoop->setsize) return AE_ERR;
+    if (priority < AE_PRIO_LOW || priority > AE_PRIO_HIGH) return AE_ERR;
+    fe = &eventLoop->events[fd];
+    if (fe->mask == AE_NONE) return AE_ERR;
+    if (fe->priority == AE_PRIO_NORMAL) eventLoop->priorityFds++;
+    if (priority == AE_PRIO_NORMAL) eventLoop->priorityFds--;
+    fe->priority = priority;
+    return AE_OK;
+}
+
+//设置 fd 的处理函数每次调用最多读写的字节数，0 表示不限制
+int aeSetFileEventBudget(aeEventLoop *eventLoop, int fd, int budget) {
+    if (fd < 0 || fd >= eventLoop->setsize) return AE_ERR;
+    if (eventLoop->events[fd].mask == AE_NONE || budget < 0) return AE_ERR;
+    eventLoop->events[fd].budget = budget;
+    return AE_OK;
+}
+
+//返回 fd 的处理函数每次调用最多读写的字节数，0 表示不限制
+int aeGetFileEventBudget(aeEventLoop *eventLoop, int fd) {
+    if (fd < 0 || fd >= eventLoop->setsize) return 0;
+    return eventLoop->events[fd].budget;
+}
+
+/**
+ * 处理函数用完了预算但还有数据没有处理的时候调用
+ * 下一次循环会再次触发 fd 的 mask 事件，不管多路复用层有没有报告
+ */
+void aeRequeueFileEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeFileEvent *fe;
+
+    if (fd < 0 || fd >= eventLoop->setsize) return;
+    fe = &eventLoop->events[fd];
+    mask &= fe->mask;
+    if (mask == AE_NONE) return;
+    if (fe->requeued == AE_NONE)
+        eventLoop->requeued[eventLoop->requeuedCount++] = fd;
+    fe->requeued |= mask;
+}
+
+//设置每次循环最多处理多少个 fd 的事件，0 表示不限制
+void aeSetEventBudget(aeEventLoop *eventLoop, int maxfds) {
+    eventLoop->eventBudget = maxfds > 0 ? maxfds : 0;
+}
+
+/* Add the readiness requeued in the previous iteration to the fired
+ * events. The list starts over, as handlers may requeue again. Fds left
+ * out by the event budget go first, in the order they were deferred:
+ * otherwise the fd the backend reports first would win every iteration
+ * and the others would starve. */
+static int aeMergeRequeued(aeEventLoop *eventLoop, int numevents) {
+    aeFiredEvent *fired = eventLoop->fired;
+    int j, polled = 0, deferred = 0, count = eventLoop->requeuedCount;
+
+    eventLoop->requeuedCount = 0;
+    for (j = 0; j < numevents; j++) {
+        aeFileEvent *fe = &eventLoop->events[fired[j].fd];
+
+        if (fe->deferred) {
+            fe->requeued |= fired[j].mask; /* moved to the front below */
+            continue;
+        }
+        fired[polled].fd = fired[j].fd;
+        fired[polled].mask = fired[j].mask | fe->requeued;
+        fe->requeued = AE_NONE;
+        polled++;
+    }
+    for (j = 0; j < count; j++) {
+        aeFileEvent *fe = &eventLoop->events[eventLoop->requeued[j]];
+
+        if (fe->deferred && fe->requeued & fe->mask) deferred++;
+    }
+    memmove(fired+deferred, fired, sizeof(aeFiredEvent)*polled);
+    numevents = deferred+polled;
+    deferred = 0;
+    for (j = 0; j < count; j++) {
+        int fd = eventLoop->requeued[j];
+        aeFileEvent *fe = &eventLoop->events[fd];
+        int mask = fe->requeued & fe->mask; /* events may be deleted */
+        int slot;
+
+        fe->requeued = AE_NONE;
+        if (mask == AE_NONE) {
+            fe->deferred = 0;
+            continue;
+        }
+        slot = fe->deferred ? deferred++ : numevents++;
+        fe->deferred = 0;
+        fired[slot].fd = fd;
+        fired[slot].mask = mask;
+    }
+    return numevents;
+}
+
+/* Call the handlers of a fired fd, returns how many were called. Handlers
+ * may add or delete events (even growing the events table), so the slot
+ * is looked up again before every call. Kinds registered together with
+ * the same handler are served by a single call with the combined mask. */
+static int aeFireFileEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    int kind, processed = 0;
+
+    for (kind = 0; kind < AE_FILE_KINDS; kind++) {
+        aeFileEvent *fe = &eventLoop->events[fd];
+        aeFileHandler h;
+        int k, rmask = 0;
+        long long callstart;
+
+        if (!(fe->mask & mask & (1<<kind))) continue;
+        h = fe->handlers[kind];
+        for (k = kind; k < AE_FILE_KINDS; k++) {
+            if (fe->mask & mask & (1<<k) &&
+                fe->handlers[k].fileProc == h.fileProc &&
+                fe->handlers[k].clientData == h.clientData)
+                rmask |= 1<<k;
+        }
+        mask &= ~rmask;
+        callstart = aeStatsStart(eventLoop);
+        h.fileProc(eventLoop, fd, h.clientData, rmask);
+        aeStatsHandler(eventLoop, AE_STAT_FILE, (void*)h.fileProc, fd,
+                callstart);
+        processed++;
+    }
+    return processed;
+}
+/* ----------------------------------------------------------------------------
+ * Time events bookkeeping
+ *
+ * Time events are kept in a binary min-heap ordered by expire time (ties
+ * broken by id, so timers created first fire first), giving O(1) access to
+ * the nearest timer and O(log N) insertion and removal. Since ids are
+ * assigned sequentially an open addressing table indexed by 'id & mask'
+ * maps ids to events almost without collisions, so that aeDeleteTimeEvent()
+ * does not need to scan the heap.
+ * ------------------------------------------------------------------------- */
+
+//比较两个 aeTimeEvent 的触发时间，a 先于 b 触发时返回非 0
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    if (a->when != b->when) return a->when < b->when;
+    return a->id < b->id;
+}
+
+static void aeHeapSet(aeEventLoop *eventLoop, int i, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[i] = te;
+    te->heapIndex = i;
+}
+
+static void aeHeapSiftUp(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent **heap = eventLoop->timeEventHeap;
+    aeTimeEvent *te = heap[i];
+
+    while (i > 0) {
+        int parent = (i-1)/2;
+
+        if (!aeTimeEventBefore(te,heap[parent])) break;
+        aeHeapSet(eventLoop,i,heap[parent]);
+        i = parent;
+    }
+    aeHeapSet(eventLoop,i,te);
+}
+
+static void aeHeapSiftDown(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent **heap = eventLoop->timeEventHeap;
+    aeTimeEvent *te = heap[i];
+    int count = eventLoop->timeEventCount;
+
+    while (1) {
+        int child = i*2+1;
+
+        if (child >= count) break;
+        if (child+1 < count && aeTimeEventBefore(heap[child+1],heap[child]))
+            child++;
+        if (!aeTimeEventBefore(heap[child],te)) break;
+        aeHeapSet(eventLoop,i,heap[child]);
+        i = child;
+    }
+    aeHeapSet(eventLoop,i,te);
+}
+
+/* Restore the heap property after te->when changed. */
+static void aeHeapUpdate(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeHeapSiftUp(eventLoop,te->heapIndex);
+    aeHeapSiftDown(eventLoop,te->heapIndex);
+}
+
+static void aeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int i = te->heapIndex;
+    aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEventCount];
+
+    if (last == te) return;
+    aeHeapSet(eventLoop,i,last);
+    aeHeapUpdate(eventLoop,last);
+}
+
+static aeTimeEvent *aeTableFind(aeEventLoop *eventLoop, long long id) {
+    int mask = eventLoop->timeEventTableSize-1;
+    int i = (int)(id & mask);
+    aeTimeEvent *te;
+
+    while ((te = eventLoop->timeEventTable[i]) != NULL) {
+        if (te->id == id) return te;
+        i = (i+1) & mask;
+    }
+    return NULL;
 }
-/**
- * 创建一个 aeFileEvent 变量，添加到 eventLoop 中
- * @param eventLoop: aeFileEvent 将要添加到的事件结构体
- * @param fd : 将要创建的 aeFileEvent 的fd
- * @param mask: fd 的 mask
- * @param proc : 当该时间发生时，调用的函数，由用户编写
- * @param clientData: 用户数据
- * @param finalizerProc : 销毁该 aeFileEvent 时调用的函数，由用户编写
- */
-int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
-        aeFileProc *proc, void *clientData,
-        aeEventFinalizerProc *finalizerProc)
-{
-    aeFileEvent *fe;
 
-    fe = zmalloc(sizeof(*fe));
-    if (fe == NULL) return AE_ERR;
-    fe->fd = fd;
-    fe->mask = mask;
-    fe->fileProc = proc;
-    fe->finalizerProc = finalizerProc;
-    fe->clientData = clientData;
-    fe->next = eventLoop->fileEventHead;
-    eventLoop->fileEventHead = fe;
-    return AE_OK;
+static void aeTableInsert(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int mask = eventLoop->timeEventTableSize-1;
+    int i = (int)(te->id & mask);
+
+    while (eventLoop->timeEventTable[i] != NULL) i = (i+1) & mask;
+    eventLoop->timeEventTable[i] = te;
 }
-/**
- * 从事件队列中删除一个 aeFileEvent 变量
- * @param eventLoop : 将要删除的 aeFileEvent 所在的事件队列
- * @param fd : 将要删除的 aeFileEvent 的文件描述符
- * @param mask : 将要删除的 aeFileEvent 的 mask
- */
-void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
-{
-    aeFileEvent *fe, *prev = NULL;
-
-    fe = eventLoop->fileEventHead;
-    while(fe) {
-		//只有 fd 和 mask 都相等才删除
-        if (fe->fd == fd && fe->mask == mask) {
-            if (prev == NULL) //连表头
-                eventLoop->fileEventHead = fe->next;
-            else
-                prev->next = fe->next;
-            if (fe->finalizerProc)
-                fe->finalizerProc(eventLoop, fe->clientData);
-            zfree(fe);
-            return;
+
+/* Remove the entry for 'id' shifting back the entries that follow it in
+ * the same cluster, so that lookups never need tombstones. */
+static void aeTableRemove(aeEventLoop *eventLoop, long long id) {
+    aeTimeEvent **table = eventLoop->timeEventTable;
+    int mask = eventLoop->timeEventTableSize-1;
+    int i = (int)(id & mask), j, k;
+
+    while (table[i]->id != id) i = (i+1) & mask;
+    j = i;
+    while (1) {
+        table[i] = NULL;
+        do {
+            j = (j+1) & mask;
+            if (table[j] == NULL) return;
+            k = (int)(table[j]->id & mask);
+            /* Stop at the first entry whose home slot is not in (i,j] */
+        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+        table[i] = table[j];
+        i = j;
+    }
+}
+
+/* Make room for one more time event, keeping the id table at most half
+ * full. */
+static int aeTimeEventsReserve(aeEventLoop *eventLoop) {
+    if (eventLoop->timeEventCount == eventLoop->timeEventHeapSize) {
+        int size = eventLoop->timeEventHeapSize*2;
+        aeTimeEvent **heap;
+
+        heap = zrealloc(eventLoop->timeEventHeap,sizeof(aeTimeEvent*)*size);
+        if (!heap) return AE_ERR;
+        eventLoop->timeEventHeap = heap;
+        eventLoop->timeEventHeapSize = size;
+    }
+    if ((eventLoop->timeEventCount+1)*2 > eventLoop->timeEventTableSize) {
+        aeTimeEvent **old = eventLoop->timeEventTable;
+        int j, oldsize = eventLoop->timeEventTableSize;
+        int size = oldsize*2;
+
+        eventLoop->timeEventTable = zmalloc(sizeof(aeTimeEvent*)*size);
+        if (!eventLoop->timeEventTable) {
+            eventLoop->timeEventTable = old;
+            return AE_ERR;
         }
-        prev = fe;
-        fe = fe->next;
+        memset(eventLoop->timeEventTable,0,sizeof(aeTimeEvent*)*size);
+        eventLoop->timeEventTableSize = size;
+        for (j = 0; j < oldsize; j++)
+            if (old[j]) aeTableInsert(eventLoop,old[j]);
+        zfree(old);
     }
+    return AE_OK;
 }
-/*
- * 得到当前时间
- * @param seconds : 用来存当前时间点的秒数
- * @param milliseconds : 用来存当前时间点的毫秒数
- */
-static void aeGetTime(long *seconds, long *milliseconds)
-{
-    struct timeval tv;
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+/* Schedule te to fire at 'when' or up to te->slack microseconds later.
+ * Like the Linux kernel does, the time with the most trailing zero bits in
+ * the window is picked: timers with overlapping windows tend to land on the
+ * same time and to wake up the loop once. Timers without slack are exact. */
+static void aeScheduleTimeEvent(aeTimeEvent *te, long long when) {
+    unsigned long long limit, mask;
+
+    te->earliest = te->when = when;
+    if (te->slack <= 0) return;
+    limit = (unsigned long long)when + te->slack;
+    mask = (unsigned long long)when ^ limit;
+    mask = (1ULL << (63 - __builtin_clzll(mask))) - 1;
+    te->when = (long long)(limit & ~mask);
 }
-/*
- * 在当前时间上田间固定毫秒，并返回
- * @param milliseconds: 添加的毫秒数
- * @param sec: 用来存最后的秒数
- * @param ms : 用来存最后的毫秒数
- */
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
-    }
-    *sec = when_sec;
-    *ms = when_ms;
+static long long aeCreateGenericTimeEvent(aeEventLoop *eventLoop,
+        long long microseconds, long long slack, int usec, aeTimeProc *proc,
+        void *clientData, aeEventFinalizerProc *finalizerProc)
+{
+    long long id;
+    aeTimeEvent *te;
+
+    if (aeTimeEventsReserve(eventLoop) == AE_ERR) return AE_ERR;
+    te = zmalloc(sizeof(*te));
+    if (te == NULL) return AE_ERR;
+    id = eventLoop->timeEventNextId++;
+    te->id = id;
+    te->slack = slack;
+    aeScheduleTimeEvent(te, aeSchedulingTime(eventLoop) + microseconds);
+    te->usec = usec;
+    te->timeProc = proc;
+    te->finalizerProc = finalizerProc;
+    te->clientData = clientData;
+    /* Events created by a time event handler are not processed in the
+     * same iteration, in order to don't loop forever. */
+    te->iteration = eventLoop->iteration;
+    aeTableInsert(eventLoop,te);
+    aeHeapSet(eventLoop,eventLoop->timeEventCount++,te);
+    aeHeapSiftUp(eventLoop,te->heapIndex);
+    return id;
 }
+
 /**
  * 创建一个 aeTimeEvent 对像，并返回其 id
  * @param eventLoop: 事件队列
  * @param milliseconds : 从现在算起 aeTimeEvent 需要等待的时间
- * @param proc : 时间到了之后的处理函数，用户编写
+ * @param proc : 时间到了之后的处理函数，用户编写，返回下一次触发的毫秒数
  * @param clientData : 用户数据
  * @param finalizerProc : 删除该aeTimeEvent 时所调用的函数，用户编写
  */
@@ -160,41 +1662,71 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
 {
-    long long id = eventLoop->timeEventNextId++;
-    aeTimeEvent *te;
+    return aeCreateGenericTimeEvent(eventLoop, milliseconds*1000, 0, 0,
+            proc, clientData, finalizerProc);
+}
 
-    te = zmalloc(sizeof(*te));
-    if (te == NULL) return AE_ERR;
-    te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
-    te->timeProc = proc;
-    te->finalizerProc = finalizerProc;
-    te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
-    return id;
+/**
+ * 和 aeCreateTimeEvent 一样，只是时间的单位是微秒
+ * proc 的返回值也是微秒
+ */
+long long aeCreateTimeEventUs(aeEventLoop *eventLoop, long long microseconds,
+        aeTimeProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc)
+{
+    return aeCreateGenericTimeEvent(eventLoop, microseconds, 0, 1,
+            proc, clientData, finalizerProc);
+}
+
+/**
+ * 和 aeCreateTimeEvent 一样，但是允许定时器最多推迟 slack 毫秒触发，
+ * 每次重新调度时也是一样
+ * 窗口重叠的定时器会尽量在同一时间触发，减少 eventLoop 被唤醒的次数，
+ * 适合统计、定期清理、客户端超时这类不需要精确时间的定时器
+ */
+long long aeCreateTimeEventSlack(aeEventLoop *eventLoop, long long milliseconds,
+        long long slack, aeTimeProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc)
+{
+    return aeCreateGenericTimeEvent(eventLoop, milliseconds*1000,
+            slack > 0 ? slack*1000 : 0, 0, proc, clientData, finalizerProc);
 }
 //删除 aeTimeEvent 对象
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te, *prev = NULL;
-
-    te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            return AE_OK;
+    aeTimeEvent *te = aeTableFind(eventLoop,id);
+
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+    aeTableRemove(eventLoop,id);
+    aeHeapRemove(eventLoop,te);
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
+    return AE_OK;
+}
+
+/* Call the handler of a due timer, then reschedule or delete it */
+static void aeFireTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeProc *proc = te->timeProc;
+    long long id = te->id, callstart;
+    int retval;
+
+    callstart = aeStatsStart(eventLoop);
+    retval = proc(eventLoop, id, te->clientData);
+    aeStatsHandler(eventLoop, AE_STAT_TIMER, (void*)proc, id, callstart);
+    /* The handler may have deleted its own event (or created new
+     * ones, growing the heap), so look it up again by id. */
+    if (retval != AE_NOMORE) {
+        te = aeTableFind(eventLoop, id);
+        if (te) {
+            aeScheduleTimeEvent(te, eventLoop->now +
+                (te->usec ? retval : (long long)retval*1000));
+            te->iteration = eventLoop->iteration;
+            aeHeapUpdate(eventLoop, te);
         }
-        prev = te;
-        te = te->next;
+    } else {
+        aeDeleteTimeEvent(eventLoop, id);
     }
-    return AE_ERR; /* NO event with the specified ID found */
 }
 
 /* Search the first timer to fire.
@@ -202,20 +1734,276 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted. */
+ * It's O(1) since the nearest timer is the root of the heap. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
+    if (eventLoop->timeEventCount == 0) return NULL;
+    return eventLoop->timeEventHeap[0];
+}
+
+/* ----------------------------------------------------------------------------
+ * Per fd deadlines
+ *
+ * Deadlines are meant to be pushed forward on every I/O (idle, read or
+ * write timeouts of a connection), so arming, re-arming and cancelling one
+ * must be O(1) and must not allocate. They are kept in a hierarchical
+ * timing wheel: a deadline less than 256 ticks away goes in the root level,
+ * in the slot of its tick. Farther deadlines go in the slot of an upper
+ * level covering their range, and are moved down ("cascaded") when the
+ * wheel reaches that range. A bitmap of non empty slots lets us skip
+ * empty ticks and compute how long the loop can sleep.
+ * ------------------------------------------------------------------------- */
+
+/* wheelSlot of the deadlines detached from their slot to be fired, see
+ * aeWheelRun(). */
+#define AE_WHEEL_EXPIRING -1
+
+/* Wheel ticks are milliseconds of the cached clock. */
+static long long aeWheelNow(aeEventLoop *eventLoop) {
+    return eventLoop->now/1000;
+}
+
+//第 level 层时间轮每个槽位覆盖的 tick 数的位数
+static int aeWheelShift(int level) {
+    return level == 0 ? 0 :
+        AE_WHEEL_ROOT_BITS + AE_WHEEL_LEVEL_BITS*(level-1);
+}
+
+//第 level 层时间轮在 wheel 数组中的起始位置
+static int aeWheelOffset(int level) {
+    return level == 0 ? 0 :
+        (1<<AE_WHEEL_ROOT_BITS) + (1<<AE_WHEEL_LEVEL_BITS)*(level-1);
+}
+
+static int aeWheelSize(int level) {
+    return level == 0 ? 1<<AE_WHEEL_ROOT_BITS : 1<<AE_WHEEL_LEVEL_BITS;
+}
+
+/* Return how many slots after 'from' (included) the first non empty slot
+ * of 'level' is, wrapping around, or -1 if the level is empty. */
+static int aeWheelNextSlot(aeEventLoop *eventLoop, int level, int from) {
+    int off = aeWheelOffset(level), size = aeWheelSize(level), d = 0;
+
+    while (d < size) {
+        int idx = (from+d) & (size-1);
+        unsigned long long bits =
+            eventLoop->wheelBits[(off+idx)/64] >> ((off+idx)%64);
+
+        if (bits) return d + __builtin_ctzll(bits);
+        d += 64 - ((off+idx)%64);
+    }
+    return -1;
+}
+
+static void aeWheelLink(aeEventLoop *eventLoop, int fd) {
+    aeFileEvent *fe = &eventLoop->events[fd];
+    long long expire = fe->deadline;
+    long long delta = expire - eventLoop->wheelTick;
+    int level, slot;
+
+    if (delta < 0) {
+        /* Already expired: fire it with the next tick */
+        expire = eventLoop->wheelTick;
+        level = 0;
+    } else {
+        for (level = 0; level < AE_WHEEL_LEVELS-1; level++) {
+            if (delta < 1LL<<aeWheelShift(level+1)) break;
+        }
+        /* Deadlines beyond the range of the wheel (about 49 days) wait in
+         * the last level, they are linked again on every cascade. */
+        if (level == AE_WHEEL_LEVELS-1 &&
+            delta >= 1LL<<(aeWheelShift(level)+AE_WHEEL_LEVEL_BITS))
+            expire = eventLoop->wheelTick +
+                (1LL<<(aeWheelShift(level)+AE_WHEEL_LEVEL_BITS)) - 1;
+    }
+    slot = aeWheelOffset(level) +
+        (int)((expire >> aeWheelShift(level)) & (aeWheelSize(level)-1));
+
+    fe->wheelSlot = slot;
+    fe->wheelPrev = -1;
+    fe->wheelNext = eventLoop->wheel[slot];
+    if (fe->wheelNext != -1)
+        eventLoop->events[fe->wheelNext].wheelPrev = fd;
+    eventLoop->wheel[slot] = fd;
+    eventLoop->wheelBits[slot/64] |= 1ULL<<(slot%64);
+}
+
+static void aeWheelUnlink(aeEventLoop *eventLoop, int fd) {
+    aeFileEvent *fe = &eventLoop->events[fd];
+    int slot = fe->wheelSlot;
+    int *head = slot == AE_WHEEL_EXPIRING ?
+        &eventLoop->wheelExpiring : &eventLoop->wheel[slot];
+
+    if (fe->wheelPrev != -1)
+        eventLoop->events[fe->wheelPrev].wheelNext = fe->wheelNext;
+    else
+        *head = fe->wheelNext;
+    if (fe->wheelNext != -1)
+        eventLoop->events[fe->wheelNext].wheelPrev = fe->wheelPrev;
+    if (slot != AE_WHEEL_EXPIRING && eventLoop->wheel[slot] == -1)
+        eventLoop->wheelBits[slot/64] &= ~(1ULL<<(slot%64));
+}
+
+/* Move every deadline of the given upper level slot to the levels below. */
+static void aeWheelCascade(aeEventLoop *eventLoop, int level, int idx) {
+    int slot = aeWheelOffset(level)+idx;
+    int fd = eventLoop->wheel[slot];
+
+    eventLoop->wheel[slot] = -1;
+    eventLoop->wheelBits[slot/64] &= ~(1ULL<<(slot%64));
+    while (fd != -1) {
+        int next = eventLoop->events[fd].wheelNext;
+
+        aeWheelLink(eventLoop, fd);
+        fd = next;
+    }
+}
+
+/* Return the tick at which the wheel needs to be run again (the nearest
+ * deadline, or an earlier cascade), or -1 if no deadline is armed. */
+static long long aeWheelNextTick(aeEventLoop *eventLoop) {
+    long long tick = eventLoop->wheelTick, next = -1;
+    int level, d;
+
+    if (eventLoop->wheelCount == 0) return -1;
+    d = aeWheelNextSlot(eventLoop, 0,
+            (int)(tick & ((1<<AE_WHEEL_ROOT_BITS)-1)));
+    if (d != -1) next = tick+d;
+    for (level = 1; level < AE_WHEEL_LEVELS; level++) {
+        int shift = aeWheelShift(level);
+        /* The current slot of a level is cascaded right now if the tick is
+         * at the start of its range, otherwise only after a full turn. */
+        int skip = (tick & ((1LL<<shift)-1)) != 0;
+        long long cascade;
+
+        d = aeWheelNextSlot(eventLoop, level,
+                (int)(((tick>>shift)+skip) & (aeWheelSize(level)-1)));
+        if (d == -1) continue;
+        cascade = ((tick>>shift)+skip+d) << shift;
+        if (next == -1 || cascade < next) next = cascade;
+    }
+    return next;
+}
+
+/* Disarm the deadline of fd and call its handler */
+static void aeWheelExpire(aeEventLoop *eventLoop, int fd) {
+    aeFileEvent *fe = &eventLoop->events[fd];
+    aeDeadlineProc *proc = fe->deadlineProc;
+    long long start;
+
+    aeWheelUnlink(eventLoop, fd);
+    fe->deadlineProc = NULL;
+    eventLoop->wheelCount--;
+    start = aeStatsStart(eventLoop);
+    proc(eventLoop, fd, fe->deadlineClientData);
+    aeStatsHandler(eventLoop, AE_STAT_DEADLINE, (void*)proc, fd, start);
+}
+
+/* Fire every deadline expired at tick 'now'. Returns the number of
+ * deadlines processed. */
+static int aeWheelRun(aeEventLoop *eventLoop, long long now) {
+    int processed = 0;
+
+    while (eventLoop->wheelTick <= now) {
+        long long tick = eventLoop->wheelTick, boundary, next;
+        int idx = (int)(tick & ((1<<AE_WHEEL_ROOT_BITS)-1)), level, d, fd;
+
+        if (eventLoop->wheelCount == 0) {
+            eventLoop->wheelTick = now+1;
+            break;
+        }
+        /* At the start of the range of an upper level slot, move it down
+         * (and the same for the levels above as they wrap). */
+        if (idx == 0) {
+            for (level = 1; level < AE_WHEEL_LEVELS; level++) {
+                int i = (int)((tick >> aeWheelShift(level)) &
+                              (aeWheelSize(level)-1));
+
+                aeWheelCascade(eventLoop, level, i);
+                if (i != 0) break;
+            }
+        }
+        eventLoop->wheelTick++;
+        /* Detach the slot before firing it: a handler re-arming a deadline
+         * a full turn away links it in this same slot, and it must wait
+         * for that turn instead of firing again right now. Handlers may
+         * still cancel any deadline of the detached list, so always pop
+         * from its head. */
+        eventLoop->wheelExpiring = eventLoop->wheel[idx];
+        eventLoop->wheel[idx] = -1;
+        eventLoop->wheelBits[idx/64] &= ~(1ULL<<(idx%64));
+        for (fd = eventLoop->wheelExpiring; fd != -1;
+             fd = eventLoop->events[fd].wheelNext)
+            eventLoop->events[fd].wheelSlot = AE_WHEEL_EXPIRING;
+        while (eventLoop->wheelExpiring != -1) {
+            fd = eventLoop->wheelExpiring;
+            if (eventLoop->trace)
+                aeTraceEvent(eventLoop, AE_TRACE_DEADLINE, fd, 0, -1);
+            aeWheelExpire(eventLoop, fd);
+            processed++;
+        }
+
+        /* Skip the empty ticks, but never the start of a new turn of the
+         * root level as upper levels need to be cascaded there. */
+        tick = eventLoop->wheelTick;
+        boundary = ((tick-1) | ((1<<AE_WHEEL_ROOT_BITS)-1)) + 1;
+        d = aeWheelNextSlot(eventLoop, 0,
+                (int)(tick & ((1<<AE_WHEEL_ROOT_BITS)-1)));
+        next = (d == -1 || tick+d > boundary) ? boundary : tick+d;
+        if (next > now+1) next = now+1;
+        eventLoop->wheelTick = next;
+    }
+    return processed;
+}
+
+/**
+ * 为 fd 设置一个 deadline，milliseconds 毫秒之后调用 proc
+ * 如果 fd 已经有 deadline 了，则用新的替换 (O(1)，不分配内存)
+ * deadline 只会触发一次，和 fd 上注册的文件事件相互独立，
+ * 但是 fd 上最后一个文件事件被删除的时候 deadline 也会被取消，
+ * 免得 fd 被新的连接复用之后还触发旧连接的 deadline
+ * @param eventLoop: 事件结构体
+ * @param fd : deadline 所属的 fd
+ * @param milliseconds : 从现在算起的毫秒数
+ * @param proc : deadline 到期时调用的函数，由用户编写
+ * @param clientData : 用户数据
+ */
+int aeSetDeadline(aeEventLoop *eventLoop, int fd, long long milliseconds,
+        aeDeadlineProc *proc, void *clientData)
+{
+    aeFileEvent *fe;
+    long long us = aeSchedulingTime(eventLoop), now = us/1000;
 
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
+    if (fd < 0 || aeGrowSetSize(eventLoop, fd) == AE_ERR) return AE_ERR;
+    fe = &eventLoop->events[fd];
+    if (fe->deadlineProc) {
+        aeWheelUnlink(eventLoop, fd);
+        eventLoop->wheelCount--;
     }
-    return nearest;
+    /* With nothing armed the wheel can just jump to the current time, but
+     * never back: aeWheelRun() may be firing the tick we are in. */
+    if (eventLoop->wheelCount == 0 && now > eventLoop->wheelTick)
+        eventLoop->wheelTick = now;
+    fe->deadlineProc = proc;
+    fe->deadlineClientData = clientData;
+    /* Rounded up to a whole tick, so it never expires early */
+    fe->deadline = (us+milliseconds*1000+999)/1000;
+    aeWheelLink(eventLoop, fd);
+    eventLoop->wheelCount++;
+    return AE_OK;
+}
+
+//取消 fd 上的 deadline
+void aeDeleteDeadline(aeEventLoop *eventLoop, int fd)
+{
+    aeFileEvent *fe;
+
+    if (fd < 0 || fd >= eventLoop->setsize) return;
+    fe = &eventLoop->events[fd];
+    if (fe->deadlineProc == NULL) return;
+    aeWheelUnlink(eventLoop, fd);
+    fe->deadlineProc = NULL;
+    eventLoop->wheelCount--;
 }
 
 /* Process every pending time event, then every pending file event
@@ -229,60 +2017,55 @@ static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
  * if flags has AE_TIME_EVENTS set, time events are processed.
  * if flags has AE_DONT_WAIT set the function returns ASAP until all
  * the events that's possible to process without to wait are processed.
+ * if flags has AE_CALL_BEFORE_SLEEP set the beforesleep callback is called
+ * before the multiplexing layer, AE_CALL_AFTER_SLEEP calls the aftersleep
+ * one as soon as it returns.
  *
  * The function returns the number of events processed. */
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 {
-    int maxfd = 0, numfd = 0, processed = 0;
-    fd_set rfds, wfds, efds;
-    aeFileEvent *fe = eventLoop->fileEventHead;
-    aeTimeEvent *te;
-    long long maxId;
+    int processed = 0, dopoll;
+    long long start, polled = 0;
     AE_NOTUSED(flags);
 
     /* Nothing to do? return ASAP */
     if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
+    eventLoop->processing = 1;
+    aeUpdateTime(eventLoop);
+    start = eventLoop->now;
 
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-
-    /* Check file events */
-    if (flags & AE_FILE_EVENTS) {
-        while (fe != NULL) {
-            if (fe->mask & AE_READABLE) FD_SET(fe->fd, &rfds);
-            if (fe->mask & AE_WRITABLE) FD_SET(fe->fd, &wfds);
-            if (fe->mask & AE_EXCEPTION) FD_SET(fe->fd, &efds);
-            if (maxfd < fe->fd) maxfd = fe->fd;
-            numfd++;
-            fe = fe->next;
-        }
-    }
-    /* Note that we want call select() even if there are no
+    /* Note that we want call the multiplexing layer even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
      * to fire. */
-    if (numfd || ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
-        int retval;
+    dopoll = ((flags & AE_FILE_EVENTS) && eventLoop->maxfd != -1) ||
+             ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT));
+    /* Called before computing the timeout, and before the iteration
+     * starts: the timers the callback creates are not tagged with this
+     * iteration, so they are honoured in it. */
+    if (dopoll && eventLoop->beforesleep != NULL &&
+        flags & AE_CALL_BEFORE_SLEEP)
+        eventLoop->beforesleep(eventLoop);
+    eventLoop->iteration++;
+    if (dopoll) {
+        int j, numevents, prio, ordered, served = 0;
         aeTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
+        long long pollstart;
 
+        aeIoFlush(eventLoop);
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
-            long now_sec, now_ms;
-
             /* Calculate the time missing for the nearest
-             * timer to fire. */
-            aeGetTime(&now_sec, &now_ms);
+             * timer to fire. The timer may already be overdue: don't
+             * pass a negative timeout to the multiplexing layer. */
+            long long wait = shortest->when - eventLoop->now;
+
+            if (wait < 0) wait = 0;
+            tv.tv_sec = wait/1000000;
+            tv.tv_usec = wait%1000000;
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-                tvp->tv_sec --;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-            }
         } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to se the timeout
@@ -296,99 +2079,189 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
 
-        retval = select(maxfd+1, &rfds, &wfds, &efds, tvp);
-        if (retval > 0) {
-            fe = eventLoop->fileEventHead;
-            while(fe != NULL) {
-                int fd = (int) fe->fd;
-
-                if ((fe->mask & AE_READABLE && FD_ISSET(fd, &rfds)) ||
-                    (fe->mask & AE_WRITABLE && FD_ISSET(fd, &wfds)) ||
-                    (fe->mask & AE_EXCEPTION && FD_ISSET(fd, &efds)))
-                {
-                    int mask = 0;
-
-                    if (fe->mask & AE_READABLE && FD_ISSET(fd, &rfds))
-                        mask |= AE_READABLE;
-                    if (fe->mask & AE_WRITABLE && FD_ISSET(fd, &wfds))
-                        mask |= AE_WRITABLE;
-                    if (fe->mask & AE_EXCEPTION && FD_ISSET(fd, &efds))
-                        mask |= AE_EXCEPTION;
-                    fe->fileProc(eventLoop, fe->fd, fe->clientData, mask);
-                    processed++;
-                    /* After an event is processed our file event list
-                     * may no longer be the same, so what we do
-                     * is to clear the bit for this file descriptor and
-                     * restart again from the head. */
-                    fe = eventLoop->fileEventHead;
-                    FD_CLR(fd, &rfds);
-                    FD_CLR(fd, &wfds);
-                    FD_CLR(fd, &efds);
-                } else {
-                    fe = fe->next;
+        /* Requeued readiness is served right away */
+        if (flags & AE_FILE_EVENTS && eventLoop->requeuedCount) {
+            tv.tv_sec = tv.tv_usec = 0;
+            tvp = &tv;
+        }
+
+        /* Don't sleep past the next deadline of the timing wheel */
+        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT) &&
+            eventLoop->wheelCount) {
+            long long wait = aeWheelNextTick(eventLoop)*1000 - eventLoop->now;
+
+            if (wait < 0) wait = 0;
+            if (tvp == NULL ||
+                wait < (long long)tvp->tv_sec*1000000 + tvp->tv_usec) {
+                tv.tv_sec = wait/1000000;
+                tv.tv_usec = wait%1000000;
+                tvp = &tv;
+            }
+        }
+
+        /* With a timerfd the poll sleeps until it fires instead */
+        if (eventLoop->timerfd != -1 && !(flags & AE_DONT_WAIT))
+            tvp = aeTimerfdArm(eventLoop, tvp);
+
+        pollstart = aeStatsStart(eventLoop);
+        numevents = aeApiPoll(eventLoop, tvp);
+        aeUpdateTime(eventLoop);
+        if (eventLoop->stats) {
+            polled = eventLoop->now - pollstart;
+            aeStatsRecord(eventLoop, AE_STAT_POLL, polled);
+        }
+        if (eventLoop->aftersleep != NULL && flags & AE_CALL_AFTER_SLEEP)
+            eventLoop->aftersleep(eventLoop);
+        if (!(flags & AE_FILE_EVENTS)) numevents = 0;
+        else if (eventLoop->requeuedCount)
+            numevents = aeMergeRequeued(eventLoop, numevents);
+        /* One pass per priority class if some fd has a priority, a single
+         * one otherwise. Served events are cleared, and the last pass
+         * takes whatever is left: a handler changing the priority of an
+         * fd can't have it served twice, or not at all. */
+        ordered = eventLoop->priorityFds != 0;
+        for (prio = AE_PRIO_HIGH; prio >= AE_PRIO_LOW; prio--) {
+            for (j = 0; j < numevents; j++) {
+                int fd = eventLoop->fired[j].fd;
+                int mask = eventLoop->fired[j].mask;
+
+                if (mask == AE_NONE) continue;
+                if (ordered && prio != AE_PRIO_LOW &&
+                    eventLoop->events[fd].priority != prio) continue;
+                eventLoop->fired[j].mask = AE_NONE;
+                if (eventLoop->eventBudget && served == eventLoop->eventBudget) {
+                    aeRequeueFileEvent(eventLoop, fd, mask);
+                    if (eventLoop->events[fd].requeued != AE_NONE)
+                        eventLoop->events[fd].deferred = 1;
+                    continue;
                 }
+                if (eventLoop->trace)
+                    aeTraceEvent(eventLoop, AE_TRACE_FILE, fd, mask, -1);
+                processed += aeFireFileEvent(eventLoop, fd, mask);
+                served++;
             }
+            if (!ordered) break;
         }
     }
     /* Check time events */
     if (flags & AE_TIME_EVENTS) {
-        te = eventLoop->timeEventHead;
-        maxId = eventLoop->timeEventNextId-1;
-        while(te) {
-            long now_sec, now_ms;
-            long long id;
-
-            if (te->id > maxId) {
-                te = te->next;
-                continue;
-            }
-            aeGetTime(&now_sec, &now_ms);
-            if (now_sec > te->when_sec ||
-                (now_sec == te->when_sec && now_ms >= te->when_ms))
-            {
-                int retval;
-
-                id = te->id;
-                retval = te->timeProc(eventLoop, id, te->clientData);
-                /* After an event is processed our time event list may
-                 * no longer be the same, so we restart from head.
-                 * Still we make sure to don't process events registered
-                 * by event handlers itself in order to don't loop forever.
-                 * To do so we saved the max ID we want to handle. */
-                if (retval != AE_NOMORE) {
-                    aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-                } else {
-                    aeDeleteTimeEvent(eventLoop, id);
-                }
-                te = eventLoop->timeEventHead;
-            } else {
-                te = te->next;
-            }
+        /* Fire timers from the root of the heap until the nearest one is
+         * in the future. A timer (re)scheduled during this iteration
+         * stops the scan too: everything due before it was already
+         * processed, and what's left will fire in the next iteration. */
+        while (eventLoop->timeEventCount) {
+            aeTimeEvent *te = eventLoop->timeEventHeap[0];
+
+            if (te->iteration == eventLoop->iteration) break;
+            /* The window of the nearest timer may be open already: fire
+             * it now rather than waking up again for it. Every timer due
+             * is still fired as the root has the nearest 'when'. */
+            if (eventLoop->now < te->earliest) break;
+
+            if (eventLoop->trace)
+                aeTraceEvent(eventLoop, AE_TRACE_TIMER, -1, 0, te->id);
+            aeFireTimeEvent(eventLoop, te);
+            processed++;
         }
     }
+    /* Check expired deadlines */
+    if (flags & AE_TIME_EVENTS)
+        processed += aeWheelRun(eventLoop, aeWheelNow(eventLoop));
+    if (eventLoop->stats) {
+        aeStatIncr(eventLoop->stats->iterations);
+        aeStatsRecord(eventLoop, AE_STAT_BUSY,
+                aeMonotonicUs() - start - polled);
+    }
+    eventLoop->processing = 0;
     return processed; /* return the number of processed file/time events */
 }
 
+/**
+ * 按照 trace 文件中记录的顺序重新调用 eventLoop 的事件处理函数
+ * 调用之前需要用和录制时相同的顺序创建同样的事件，这样时间事件的 id 才能对应上
+ * 重放时 eventLoop 缓存的时间是虚拟时钟：从当前时间开始，按记录的时间间隔前进
+ * 记录中的 fd 没有注册对应的事件，或者时间事件已经不存在时会跳过这条记录
+ * 处理函数调用 aeStop() 时停止重放，返回重放的记录数，无法读取文件时返回 -1
+ * 重放之后时钟可能已经超前于真实时间，eventLoop 只应该用来做测试
+ */
+/**
+ * 按照 filename 中记录的顺序和时间调用 eventLoop 的事件处理函数，时钟是虚拟的
+ * trace 中没有数据，文件事件的处理函数作用在 eventLoop 中同样编号的真实 fd 上，
+ * 这些 fd 需要调用者先准备好，没有注册对应事件的记录会被跳过
+ * 返回被调用的记录数，文件打不开或者格式不对时返回 -1
+ */
+long long aeReplayTraceLive(aeEventLoop *eventLoop, const char *filename) {
+    FILE *fp;
+    char magic[8];
+    aeTraceRecord rec;
+    long long base, origin = 0, last = 0, replayed = 0;
+    int first = 1;
+
+    if ((fp = fopen(filename, "rb")) == NULL) return -1;
+    if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, AE_TRACE_MAGIC, 8)) {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+    base = aeSchedulingTime(eventLoop);
+    /* Handlers see the virtual clock, aeUpdateTime() is not called */
+    eventLoop->processing = 1;
+    eventLoop->stop = 0;
+    while (!eventLoop->stop && fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (first) {
+            origin = last = rec.when;
+            first = 0;
+        }
+        /* A new iteration for every step of the clock */
+        if (rec.when != last) eventLoop->iteration++;
+        last = rec.when;
+        eventLoop->now = base + (rec.when - origin);
+        if (rec.type == AE_TRACE_FILE) {
+            if (rec.fd < 0 || rec.fd >= eventLoop->setsize ||
+                aeFireFileEvent(eventLoop, rec.fd, rec.mask) == 0) continue;
+        } else if (rec.type == AE_TRACE_TIMER) {
+            aeTimeEvent *te = aeTableFind(eventLoop, rec.id);
+
+            if (te == NULL) continue;
+            aeFireTimeEvent(eventLoop, te);
+        } else if (rec.type == AE_TRACE_DEADLINE) {
+            if (rec.fd < 0 || rec.fd >= eventLoop->setsize ||
+                eventLoop->events[rec.fd].deadlineProc == NULL) continue;
+            aeWheelExpire(eventLoop, rec.fd);
+        } else {
+            continue;
+        }
+        replayed++;
+    }
+    eventLoop->processing = 0;
+    fclose(fp);
+    return replayed;
+}
+
 /* Wait for millseconds until the given file descriptor becomes
  * writable/readable/exception */
 int aeWait(int fd, int mask, long long milliseconds) {
-    struct timeval tv;
-    fd_set rfds, wfds, efds;
+    struct pollfd pfd;
     int retmask = 0, retval;
 
-    tv.tv_sec = milliseconds/1000;
-    tv.tv_usec = (milliseconds%1000)*1000;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-
-    if (mask & AE_READABLE) FD_SET(fd,&rfds);
-    if (mask & AE_WRITABLE) FD_SET(fd,&wfds);
-    if (mask & AE_EXCEPTION) FD_SET(fd,&efds);
-    if ((retval = select(fd+1, &rfds, &wfds, &efds, &tv)) > 0) {
-        if (FD_ISSET(fd,&rfds)) retmask |= AE_READABLE;
-        if (FD_ISSET(fd,&wfds)) retmask |= AE_WRITABLE;
-        if (FD_ISSET(fd,&efds)) retmask |= AE_EXCEPTION;
+    /* poll() has no FD_SETSIZE limit, unlike select() */
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = fd;
+    if (mask & AE_READABLE) pfd.events |= POLLIN;
+    if (mask & AE_WRITABLE) pfd.events |= POLLOUT;
+    if (mask & AE_EXCEPTION) pfd.events |= POLLPRI;
+    if (milliseconds > INT_MAX) milliseconds = INT_MAX;
+    if ((retval = poll(&pfd, 1, (int)milliseconds)) == 1) {
+        if (pfd.revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+        if (pfd.revents & POLLIN) retmask |= AE_READABLE;
+        if (pfd.revents & POLLOUT) retmask |= AE_WRITABLE;
+        if (pfd.revents & POLLPRI) retmask |= AE_EXCEPTION;
+        /* Like select(), report errors as readable and writable */
+        if (pfd.revents & (POLLERR|POLLHUP))
+            retmask |= mask & (AE_READABLE|AE_WRITABLE);
         return retmask;
     } else {
         return retval;
@@ -399,5 +2272,264 @@ void aeMain(aeEventLoop *eventLoop)
 {
     eventLoop->stop = 0;
     while (!eventLoop->stop)
-        aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS|
+                                   AE_CALL_BEFORE_SLEEP|
+                                   AE_CALL_AFTER_SLEEP);
+}
+
+/**
+ * 设置每次进入多路复用层等待之前调用的函数
+ * 例如把本次循环中积累的回复一次性写给客户端，而不是为每个回复注册可写事件
+ */
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
+    eventLoop->beforesleep = beforesleep;
+}
+
+//设置多路复用层返回之后，处理事件之前调用的函数
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
+    eventLoop->aftersleep = aftersleep;
+}
+
+//返回当前使用的多路复用层的名字
+char *aeGetApiName(void) {
+    return aeApiName();
+}
+
+//返回多路复用层是否会把 socket 的错误 (比如 MSG_ZEROCOPY 的完成通知) 报告给 AE_EXCEPTION 处理函数
+int aeReportsErrors(void) {
+    return aeApiReportsErrors();
+}
+
+/* ----------------------------------------------------------------------------
+ * Loop groups
+ *
+ * A loop group runs N event loops, each one in its own thread, so that the
+ * network load can be spread across cores. Connections can be sharded in
+ * two ways:
+ *
+ * 1) Every loop creates its own listening socket on the same port with
+ *    anetTcpReusePortServer() in the init callback, and the kernel balances
+ *    new connections among them.
+ * 2) A single acceptor (any loop, or the main thread) accepts connections
+ *    and calls aeLoopGroupDispatch() to hand every fd to a worker loop,
+ *    round robin or to the loop with less registered fds. The worker gets
+ *    the fd in its own thread through the handoff callback.
+ *
+ * Hand off posts a task to the worker loop (see aePostTask()), and so does
+ * aeStopLoopGroup() to stop it.
+ * ------------------------------------------------------------------------- */
+
+typedef struct aeLoopWorker {
+    aeLoopGroup *group;
+    aeEventLoop *eventLoop;
+    int index;
+    pthread_t thread;
+    int pending; /* fds handed off but not yet received */
+} aeLoopWorker;
+
+struct aeLoopGroup {
+    int numloops;
+    int flags; /* AE_GROUP_* */
+    int running; /* threads started */
+    unsigned int next; /* round robin cursor */
+    aeLoopWorker *workers;
+    aeLoopInitProc *initProc;
+    aeHandoffProc *handoffProc;
+    void *clientData;
+};
+
+/* Worker running in the current thread, NULL outside loop groups */
+static __thread aeLoopWorker *aeCurrentWorker = NULL;
+
+static void aeHandoffTask(aeEventLoop *eventLoop, void *arg) {
+    aeLoopWorker *w = aeCurrentWorker;
+    aeLoopGroup *group = w->group;
+    int fd = (int)(long)arg;
+
+    __atomic_sub_fetch(&w->pending, 1, __ATOMIC_RELAXED);
+    if (group->handoffProc)
+        group->handoffProc(eventLoop, fd, group->clientData);
+    else
+        close(fd);
+}
+
+static void aeStopTask(aeEventLoop *eventLoop, void *arg) {
+    AE_NOTUSED(arg);
+    aeStop(eventLoop);
+}
+
+static void *aeLoopWorkerMain(void *arg) {
+    aeLoopWorker *w = arg;
+    aeLoopGroup *group = w->group;
+
+    aeCurrentWorker = w;
+#ifdef __linux__
+    if (group->flags & AE_GROUP_PIN_CPU) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t cpuset;
+
+        if (ncpu > 0) {
+            CPU_ZERO(&cpuset);
+            CPU_SET(w->index % ncpu, &cpuset);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        }
+    }
+#endif
+    if (group->initProc)
+        group->initProc(w->eventLoop, w->index, group->clientData);
+    aeMain(w->eventLoop);
+    return NULL;
+}
+
+/**
+ * 创建一个包含 numloops 个 eventLoop 的 loop group
+ * 之后 zmalloc 会以线程安全的方式统计内存
+ * @param flags : AE_GROUP_PIN_CPU 和/或 AE_GROUP_LEAST_LOADED
+ */
+aeLoopGroup *aeCreateLoopGroup(int numloops, int flags) {
+    aeLoopGroup *group;
+    int j;
+
+    if (numloops <= 0) return NULL;
+    zmalloc_enable_thread_safeness();
+    group = zmalloc(sizeof(*group));
+    if (!group) return NULL;
+    group->workers = zmalloc(sizeof(aeLoopWorker)*numloops);
+    if (!group->workers) {
+        zfree(group);
+        return NULL;
+    }
+    group->numloops = 0;
+    group->flags = flags;
+    group->running = 0;
+    group->next = 0;
+    group->initProc = NULL;
+    group->handoffProc = NULL;
+    group->clientData = NULL;
+    for (j = 0; j < numloops; j++) {
+        aeLoopWorker *w = group->workers+j;
+
+        w->group = group;
+        w->index = j;
+        w->pending = 0;
+        if ((w->eventLoop = aeCreateEventLoop()) == NULL) goto err;
+        group->numloops++;
+    }
+    return group;
+
+err:
+    aeDeleteLoopGroup(group);
+    return NULL;
+}
+
+/**
+ * 在 numloops 个线程中分别运行 eventLoop
+ * @param initProc : 在线程中运行 aeMain 之前调用，例如创建 SO_REUSEPORT 的监听 socket
+ * @param handoffProc : 在线程中接收 aeLoopGroupDispatch 分配过来的 fd
+ * @param clientData : 传给上面两个函数的用户数据
+ */
+int aeStartLoopGroup(aeLoopGroup *group, aeLoopInitProc *initProc,
+        aeHandoffProc *handoffProc, void *clientData)
+{
+    int j;
+
+    if (group->running) return AE_ERR;
+    group->initProc = initProc;
+    group->handoffProc = handoffProc;
+    group->clientData = clientData;
+    for (j = 0; j < group->numloops; j++) {
+        aeLoopWorker *w = group->workers+j;
+
+        if (pthread_create(&w->thread, NULL, aeLoopWorkerMain, w) != 0) {
+            aeStopLoopGroup(group);
+            return AE_ERR;
+        }
+        group->running++;
+    }
+    return AE_OK;
+}
+
+//让所有线程中的 eventLoop 停止，并等待线程退出
+void aeStopLoopGroup(aeLoopGroup *group) {
+    int j;
+
+    for (j = 0; j < group->running; j++) {
+        /* The stop request must get through even if memory is short */
+        while (aePostTask(group->workers[j].eventLoop, aeStopTask, NULL) ==
+               AE_ERR)
+            sched_yield();
+    }
+    for (j = 0; j < group->running; j++)
+        pthread_join(group->workers[j].thread, NULL);
+    group->running = 0;
+}
+
+/* Tasks still queued when a worker stopped will never run: close the fds
+ * that were waiting to be handed off instead of leaking them. */
+static void aeDropHandoffs(aeEventLoop *eventLoop) {
+    aeTask *task;
+
+    while ((task = aeTaskPop(eventLoop)) != NULL) {
+        if (task->proc == aeHandoffTask) close((int)(long)task->arg);
+        zfree(task);
+    }
+}
+
+//释放 loop group，如果线程还在运行的话先停止它们
+//调用时其它线程不能再调用 aeLoopGroupDispatch，还没交出去的 fd 会被关闭
+void aeDeleteLoopGroup(aeLoopGroup *group) {
+    int j;
+
+    aeStopLoopGroup(group);
+    for (j = 0; j < group->numloops; j++) {
+        aeDropHandoffs(group->workers[j].eventLoop);
+        aeDeleteEventLoop(group->workers[j].eventLoop);
+    }
+    zfree(group->workers);
+    zfree(group);
+}
+
+/**
+ * 把 fd 交给 group 中的一个 eventLoop，可以在任意线程中调用
+ * fd 会在那个 eventLoop 的线程中传给 handoffProc
+ * 失败的时候返回 AE_ERR，fd 需要调用者自己关闭
+ */
+int aeLoopGroupDispatch(aeLoopGroup *group, int fd) {
+    aeLoopWorker *w;
+
+    if (fd < 0) return AE_ERR;
+    if (group->flags & AE_GROUP_LEAST_LOADED) {
+        int j, load, minload = INT_MAX;
+
+        w = group->workers;
+        for (j = 0; j < group->numloops; j++) {
+            aeLoopWorker *c = group->workers+j;
+
+            load = __atomic_load_n(&c->eventLoop->registered,__ATOMIC_RELAXED)
+                 + __atomic_load_n(&c->pending,__ATOMIC_RELAXED);
+            if (load < minload) {
+                w = c;
+                minload = load;
+            }
+        }
+    } else {
+        unsigned int next = __atomic_fetch_add(&group->next,1,__ATOMIC_RELAXED);
+
+        w = group->workers + (next % group->numloops);
+    }
+    __atomic_add_fetch(&w->pending, 1, __ATOMIC_RELAXED);
+    if (aePostTask(w->eventLoop, aeHandoffTask, (void*)(long)fd) == AE_ERR) {
+        __atomic_sub_fetch(&w->pending, 1, __ATOMIC_RELAXED);
+        return AE_ERR;
+    }
+    return AE_OK;
+}
+
+int aeLoopGroupSize(aeLoopGroup *group) {
+    return group->numloops;
+}
+
+aeEventLoop *aeLoopGroupGetLoop(aeLoopGroup *group, int index) {
+    if (index < 0 || index >= group->numloops) return NULL;
+    return group->workers[index].eventLoop;
 }
@@ -35,55 +35,243 @@
 
 struct aeEventLoop;
 
+/* Kinds of file events, each one with its own handler */
+#define AE_FILE_KINDS 3
+#define AE_KIND_READABLE 0
+#define AE_KIND_WRITABLE 1
+#define AE_KIND_EXCEPTION 2
+
+/* Per fd deadlines live in a hierarchical timing wheel with a tick of one
+ * millisecond: a first level of 256 slots, one per tick, and four levels
+ * of 64 slots each covering 64 times the range of the level below. */
+#define AE_WHEEL_LEVELS 5
+#define AE_WHEEL_ROOT_BITS 8
+#define AE_WHEEL_LEVEL_BITS 6
+#define AE_WHEEL_SLOTS ((1<<AE_WHEEL_ROOT_BITS) + \
+        (AE_WHEEL_LEVELS-1)*(1<<AE_WHEEL_LEVEL_BITS))
+
+/* Latency histograms: values in microseconds, HDR style buckets with
+ * 2^AE_HIST_SUB_BITS linear sub buckets for every power of two, so that
+ * values are kept with 1/8 of precision up to 2^31 microseconds. */
+#define AE_HIST_SUB_BITS 3
+#define AE_HIST_BUCKETS ((32-AE_HIST_SUB_BITS+1)<<AE_HIST_SUB_BITS)
+#define AE_STAT_POLL 0 /* iteration time blocked in the multiplexing layer */
+#define AE_STAT_BUSY 1 /* iteration time spent out of it */
+#define AE_STAT_FILE 2 /* a file event handler call */
+#define AE_STAT_TIMER 3 /* a time event handler call */
+#define AE_STAT_DEADLINE 4 /* a deadline handler call */
+#define AE_STAT_HISTS 5
+#define AE_STALL_LOG 16 /* slow handler calls remembered */
+
+/* Trace records, see aeStartTrace() */
+#define AE_TRACE_MAGIC "AETRACE1" /* 8 bytes header of every trace file */
+#define AE_TRACE_FILE 0 /* file event dispatched: fd and mask */
+#define AE_TRACE_TIMER 1 /* time event fired: id */
+#define AE_TRACE_DEADLINE 2 /* deadline expired: fd */
+
 /* Types and data structures */
 typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
+typedef void aeDeadlineProc(struct aeEventLoop *eventLoop, int fd, void *clientData);
+typedef void aeLoopInitProc(struct aeEventLoop *eventLoop, int index, void *clientData);
+typedef void aeHandoffProc(struct aeEventLoop *eventLoop, int fd, void *clientData);
+typedef void aeTaskProc(struct aeEventLoop *eventLoop, void *arg);
+typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeIoProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int res);
+typedef void aeSignalProc(struct aeEventLoop *eventLoop, int signo, void *clientData);
+typedef void aeCoFreeProc(struct aeEventLoop *eventLoop);
 
-/* File event structure */
-typedef struct aeFileEvent {
-    int fd;
-    int mask; /* one of AE_(READABLE|WRITABLE|EXCEPTION) */
+/* Handler registered for one kind (readable, writable, exception) of
+ * file event */
+typedef struct aeFileHandler {
     aeFileProc *fileProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeFileEvent *next;
+} aeFileHandler;
+
+/* Read or write started by aeSubmitRead()/aeSubmitWrite() */
+typedef struct aeIoRequest {
+    int fd;
+    int mask; /* AE_READABLE for reads, AE_WRITABLE for writes */
+    char *buf;
+    unsigned int len;
+    aeIoProc *proc;
+    void *clientData;
+    int ready; /* waiting for readiness instead of the io_uring */
+    int cancelled; /* detached by aeCancelIo(), waiting for the ring */
+    struct aeIoRequest *queued; /* next request of the fd, same direction */
+    struct aeIoRequest *prev, *next; /* all the requests not completed */
+} aeIoRequest;
+
+/* File event structure, one per fd slot */
+typedef struct aeFileEvent {
+    int mask; /* one of AE_(READABLE|WRITABLE|EXCEPTION) */
+    aeFileHandler handlers[AE_FILE_KINDS]; /* indexed by AE_KIND_* */
+    /* Deadline of the fd, see aeSetDeadline(). Armed deadlines are linked
+     * by fd (not by pointer, as the table may be reallocated) into one
+     * slot of the timing wheel. Cancelled with the last event of the fd. */
+    aeDeadlineProc *deadlineProc; /* NULL if no deadline is armed */
+    void *deadlineClientData;
+    long long deadline; /* expire time, in wheel ticks */
+    int wheelSlot, wheelPrev, wheelNext;
+    /* Reads and writes of the fd, indexed by AE_KIND_(READABLE|WRITABLE).
+     * The head of every queue is the one in progress. */
+    aeIoRequest *ioQueue[2];
+    int priority; /* AE_PRIO_*, higher priority fds are served first */
+    int budget; /* bytes the handler should move per call, 0 = no limit */
+    int requeued; /* readiness to fire again, see aeRequeueFileEvent() */
+    int deferred; /* requeued because the event budget ran out */
+    int edge; /* registered with AE_EDGE */
 } aeFileEvent;
 
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* expire time, monotonic clock in microseconds */
+    long long earliest; /* it may fire from here, 'when' is up to slack later */
+    long long slack; /* microseconds the timer may be delayed by */
+    int usec; /* timeProc returns microseconds instead of milliseconds */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
+    int heapIndex; /* position in eventLoop->timeEventHeap */
+    long long iteration; /* loop iteration it was (re)scheduled in */
 } aeTimeEvent;
 
+/* Task posted to the loop by another thread, see aePostTask() */
+typedef struct aeTask {
+    aeTaskProc *proc;
+    void *arg;
+    struct aeTask *next;
+} aeTask;
+
+/* Handler of a signal, see aeCreateSignalEvent() */
+typedef struct aeSignalHandler {
+    aeSignalProc *proc; /* NULL if the signal is not handled */
+    void *clientData;
+} aeSignalHandler;
+
+/* Handler call slower than the stall threshold */
+typedef struct aeStall {
+    void *proc; /* the handler */
+    int kind; /* AE_STAT_(FILE|TIMER|DEADLINE) */
+    long long id; /* fd, or time event id */
+    long long duration; /* microseconds */
+    long long when; /* monotonic clock when it returned */
+} aeStall;
+
+/* Event loop statistics, see aeEnableStats() */
+typedef struct aeLoopStats {
+    long long iterations;
+    long long fileEvents; /* file event handler calls */
+    long long timeEvents; /* time event handler calls */
+    long long deadlines; /* deadline handler calls */
+    long long stallThreshold; /* microseconds, 0 if disabled */
+    long long stalls; /* stalls so far, the latest are in stallLog */
+    aeStall stallLog[AE_STALL_LOG]; /* indexed by stall number */
+    unsigned long long hist[AE_STAT_HISTS][AE_HIST_BUCKETS];
+} aeLoopStats;
+
+/* A trace record, written as is (host byte order) */
+typedef struct aeTraceRecord {
+    long long when; /* loop clock in microseconds */
+    long long id; /* time event id, -1 for other records */
+    int fd; /* -1 for time events */
+    unsigned char type; /* AE_TRACE_* */
+    unsigned char mask; /* fired events for AE_TRACE_FILE */
+    unsigned short unused;
+} aeTraceRecord;
+
+/* A fired event */
+typedef struct aeFiredEvent {
+    int fd;
+    int mask;
+} aeFiredEvent;
+
 /* State of an event based program */
 typedef struct aeEventLoop {
+    int maxfd;   /* highest file descriptor currently registered */
+    int registered; /* fds with at least one event registered */
+    int setsize; /* number of slots in events and fired */
     long long timeEventNextId;
-    aeFileEvent *fileEventHead;
-    aeTimeEvent *timeEventHead;
+    aeFileEvent *events; /* Registered events, indexed by fd */
+    aeFiredEvent *fired; /* Fired events */
+    aeTimeEvent **timeEventHeap; /* Time events, min-heap by expire time */
+    int timeEventCount;
+    int timeEventHeapSize;
+    aeTimeEvent **timeEventTable; /* Time events, hashed by id */
+    int timeEventTableSize; /* always a power of two */
+    long long iteration; /* aeProcessEvents() calls so far */
+    long long now; /* cached monotonic clock in microseconds */
+    int processing; /* inside aeProcessEvents() */
+    long long wheelTick; /* next timing wheel tick to process */
+    int wheelCount; /* armed deadlines */
+    int wheel[AE_WHEEL_SLOTS]; /* first fd of every slot, -1 if empty */
+    unsigned long long wheelBits[AE_WHEEL_SLOTS/64]; /* non empty slots */
+    int wheelExpiring; /* deadlines of the slot being fired, -1 if none */
+    /* Posted tasks, a lock free queue: other threads only touch taskHead
+     * and taskWakeup, the tail belongs to the thread running the loop. */
+    aeTask *taskHead; /* last task posted */
+    int taskWakeup; /* a wake up is already on its way */
+    aeTask *taskTail; /* next task to run */
+    aeTask taskStub;
+    int taskfd[2]; /* eventfd (same fd twice) or pipe waking up the loop */
     int stop;
+    aeBeforeSleepProc *beforesleep; /* called before blocking in the poll */
+    aeBeforeSleepProc *aftersleep; /* called when the poll returns */
+    aeIoRequest *ioRequests; /* reads and writes not completed */
+    int ioProbed; /* already looked for io_uring */
+    int ioKeep; /* aeDeleteFileEvent() must not cancel the requests */
+    void *ioRing; /* io_uring state, NULL if it is not available */
+    aeLoopStats *stats; /* NULL unless enabled */
+    int *requeued; /* fds with readiness requeued for the next iteration */
+    int requeuedCount;
+    int priorityFds; /* fds with a priority other than AE_PRIO_NORMAL */
+    int eventBudget; /* fds served per iteration, 0 = no limit */
+    aeSignalHandler *signals; /* AE_NSIG handlers, NULL until needed */
+    int sigfd[2]; /* signalfd (same fd twice) or self pipe, -1 if none */
+    int timerfd; /* timerfd the poll waits for, -1 if not enabled */
+    long long timerfdWhen; /* time it is armed for, 0 if disarmed */
+    void *trace; /* FILE the trace is written to, NULL if not recording */
+    void *coroutines; /* suspended coroutines, see coro.c */
+    aeCoFreeProc *coFree; /* releases them when the loop is deleted */
+    void *apidata; /* This is used for polling API specific data */
 } aeEventLoop;
 
 /* Defines */
 #define AE_OK 0
 #define AE_ERR -1
 
+#define AE_SETSIZE_INIT 64 /* initial fd slots, grown on demand */
+#define AE_TIMERS_INIT 16 /* initial time event slots, grown on demand */
+#define AE_TASK_BATCH 256 /* posted tasks run before polling again */
+#define AE_NSIG 65 /* signals are numbered from 1 to AE_NSIG-1 */
+
+#define AE_NONE 0
 #define AE_READABLE 1
 #define AE_WRITABLE 2
 #define AE_EXCEPTION 4
+#define AE_EDGE 8 /* edge triggered, see aeCreateFileEvent() */
 
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
 #define AE_ALL_EVENTS (AE_FILE_EVENTS|AE_TIME_EVENTS)
 #define AE_DONT_WAIT 4
+#define AE_CALL_BEFORE_SLEEP 8
+#define AE_CALL_AFTER_SLEEP 16
 
 #define AE_NOMORE -1
 
+/* File event priorities */
+#define AE_PRIO_HIGH 1 /* e.g. listening sockets and replication links */
+#define AE_PRIO_NORMAL 0
+#define AE_PRIO_LOW -1
+
+/* Loop group flags */
+#define AE_GROUP_PIN_CPU 1 /* pin the thread of loop N to CPU N */
+#define AE_GROUP_LEAST_LOADED 2 /* hand off to the loop with less fds */
+
 /* Macros */
 #define AE_NOTUSED(V) ((void) V)
 
@@ -95,12 +283,61 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
+int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
+int aeSetFileEventPriority(aeEventLoop *eventLoop, int fd, int priority);
+int aeSetFileEventBudget(aeEventLoop *eventLoop, int fd, int budget);
+int aeGetFileEventBudget(aeEventLoop *eventLoop, int fd);
+void aeRequeueFileEvent(aeEventLoop *eventLoop, int fd, int mask);
+void aeSetEventBudget(aeEventLoop *eventLoop, int maxfds);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
+long long aeCreateTimeEventUs(aeEventLoop *eventLoop, long long microseconds,
+        aeTimeProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc);
+long long aeCreateTimeEventSlack(aeEventLoop *eventLoop, long long milliseconds,
+        long long slack, aeTimeProc *proc, void *clientData,
+        aeEventFinalizerProc *finalizerProc);
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
+int aeSetDeadline(aeEventLoop *eventLoop, int fd, long long milliseconds,
+        aeDeadlineProc *proc, void *clientData);
+void aeDeleteDeadline(aeEventLoop *eventLoop, int fd);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
+char *aeGetApiName(void);
+int aeReportsErrors(void);
+long long aeGetTime(aeEventLoop *eventLoop);
+int aePostTask(aeEventLoop *eventLoop, aeTaskProc *proc, void *arg);
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
+int aeCreateSignalEvent(aeEventLoop *eventLoop, int signo,
+        aeSignalProc *proc, void *clientData);
+void aeDeleteSignalEvent(aeEventLoop *eventLoop, int signo);
+int aeEnableTimerfd(aeEventLoop *eventLoop);
+int aeEnableStats(aeEventLoop *eventLoop, long long stallThreshold);
+void aeDisableStats(aeEventLoop *eventLoop);
+int aeGetStats(aeEventLoop *eventLoop, aeLoopStats *stats);
+long long aeStatsPercentile(aeLoopStats *stats, int hist, double percentile);
+int aeStartTrace(aeEventLoop *eventLoop, const char *filename);
+void aeStopTrace(aeEventLoop *eventLoop);
+long long aeReplayTraceLive(aeEventLoop *eventLoop, const char *filename);
+int aeSubmitRead(aeEventLoop *eventLoop, int fd, void *buf, unsigned int len,
+        aeIoProc *proc, void *clientData);
+int aeSubmitWrite(aeEventLoop *eventLoop, int fd, const void *buf,
+        unsigned int len, aeIoProc *proc, void *clientData);
+void aeCancelIo(aeEventLoop *eventLoop, int fd, int mask);
+
+/* Loop groups: N event loops running in N threads */
+typedef struct aeLoopGroup aeLoopGroup;
+
+aeLoopGroup *aeCreateLoopGroup(int numloops, int flags);
+void aeDeleteLoopGroup(aeLoopGroup *group);
+int aeStartLoopGroup(aeLoopGroup *group, aeLoopInitProc *initProc,
+        aeHandoffProc *handoffProc, void *clientData);
+void aeStopLoopGroup(aeLoopGroup *group);
+int aeLoopGroupDispatch(aeLoopGroup *group, int fd);
+int aeLoopGroupSize(aeLoopGroup *group);
+aeEventLoop *aeLoopGroupGetLoop(aeLoopGroup *group, int index);
 
 #endif
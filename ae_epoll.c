@@ -0,0 +1,155 @@
+/* Linux epoll(2) based ae.c module
+ * Copyright (C) 2009-2010 Salvatore Sanfilippo - antirez@gmail.com
+ * Released under the BSD license. */
+
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+typedef struct aeApiState {
+    int epfd;
+    struct epoll_event *events; /* setsize slots filled by epoll_wait() */
+    int pwait2; /* epoll_pwait2() is available (Linux >= 5.11) */
+} aeApiState;
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+
+    if (!state) return -1;
+    state->events = zmalloc(sizeof(struct epoll_event)*eventLoop->setsize);
+    if (!state->events) {
+        zfree(state);
+        return -1;
+    }
+    state->epfd = epoll_create(1024); /* 1024 is just an hint for the kernel */
+    if (state->epfd == -1) {
+        zfree(state->events);
+        zfree(state);
+        return -1;
+    }
+    state->pwait2 = 1;
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    struct epoll_event *events;
+
+    events = zrealloc(state->events,sizeof(struct epoll_event)*setsize);
+    if (!events) return -1;
+    state->events = events;
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    close(state->epfd);
+    zfree(state->events);
+    zfree(state);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    struct epoll_event ee;
+    /* If the fd was already monitored for some event, we need a MOD
+     * operation. Otherwise we need an ADD operation. */
+    int op = eventLoop->events[fd].mask == AE_NONE ?
+            EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    memset(&ee,0,sizeof(ee)); /* avoid valgrind warning on ee.data */
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    if (mask & AE_READABLE) ee.events |= EPOLLIN;
+    if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    if (mask & AE_EXCEPTION) ee.events |= EPOLLPRI;
+    if (eventLoop->events[fd].edge) ee.events |= EPOLLET;
+    ee.data.fd = fd;
+    if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    struct epoll_event ee;
+    int mask = eventLoop->events[fd].mask & (~delmask);
+
+    memset(&ee,0,sizeof(ee));
+    if (mask & AE_READABLE) ee.events |= EPOLLIN;
+    if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    if (mask & AE_EXCEPTION) ee.events |= EPOLLPRI;
+    if (eventLoop->events[fd].edge) ee.events |= EPOLLET;
+    ee.data.fd = fd;
+    if (mask != 0) {
+        epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,&ee);
+    } else {
+        /* Note, Kernel < 2.6.9 requires a non null event pointer even for
+         * EPOLL_CTL_DEL. */
+        epoll_ctl(state->epfd,EPOLL_CTL_DEL,fd,&ee);
+    }
+}
+
+/* epoll_wait() takes the timeout in milliseconds, so prefer epoll_pwait2()
+ * to honour sub millisecond timers. */
+static int aeApiWait(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+
+#ifdef SYS_epoll_pwait2
+    if (state->pwait2) {
+        struct timespec ts;
+        int retval;
+
+        if (tvp) {
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000;
+        }
+        retval = syscall(SYS_epoll_pwait2,state->epfd,state->events,
+                eventLoop->setsize,tvp ? &ts : NULL,NULL,0);
+        if (retval != -1 || errno != ENOSYS) return retval;
+        state->pwait2 = 0;
+    }
+#endif
+    /* Round the timeout up: waking up a bit before the nearest timer is
+     * due would just make us spin until it is. */
+    return epoll_wait(state->epfd,state->events,eventLoop->setsize,
+            tvp ? (tvp->tv_sec*1000 + (tvp->tv_usec+999)/1000) : -1);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    int retval, numevents = 0;
+
+    retval = aeApiWait(eventLoop,tvp);
+    if (retval > 0) {
+        int j;
+
+        numevents = retval;
+        for (j = 0; j < numevents; j++) {
+            int mask = 0;
+            struct epoll_event *e = state->events+j;
+
+            if (e->events & EPOLLIN) mask |= AE_READABLE;
+            if (e->events & EPOLLOUT) mask |= AE_WRITABLE;
+            if (e->events & EPOLLPRI) mask |= AE_EXCEPTION;
+            /* Errors and hangups are reported to whoever is listening so
+             * that the next read or write returns the actual error. */
+            if (e->events & (EPOLLERR|EPOLLHUP))
+                mask |= AE_READABLE|AE_WRITABLE;
+            /* A pending error queue (e.g. MSG_ZEROCOPY completions) is
+             * signaled only this way: let the exception handler read it. */
+            if (e->events & EPOLLERR) mask |= AE_EXCEPTION;
+            eventLoop->fired[j].fd = e->data.fd;
+            eventLoop->fired[j].mask = mask;
+        }
+    }
+    return numevents;
+}
+
+/* Errors reach AE_EXCEPTION handlers too, see aeApiPoll() */
+static int aeApiReportsErrors(void) {
+    return 1;
+}
+
+static char *aeApiName(void) {
+    return "epoll";
+}
@@ -0,0 +1,146 @@
+/* poll(2) based ae.c module
+ * Copyright (C) 2009-2010 Salvatore Sanfilippo - antirez@gmail.com
+ * Released under the BSD license. */
+
+#include <poll.h>
+#include <string.h>
+#include <limits.h>
+
+/* Unlike fd_set the pollfd array has no FD_SETSIZE limit, and it is kept
+ * across calls: adding or removing an event only touches the slot of the
+ * fd, instead of rebuilding the whole set before every poll(). The slots
+ * are packed, so poll() only scans the fds actually registered. */
+typedef struct aeApiState {
+    struct pollfd *fds; /* 'count' registered fds, in no particular order */
+    int count;
+    int *index; /* setsize slots: position of the fd in 'fds', or -1 */
+} aeApiState;
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+    int j;
+
+    if (!state) return -1;
+    state->fds = zmalloc(sizeof(struct pollfd)*eventLoop->setsize);
+    state->index = zmalloc(sizeof(int)*eventLoop->setsize);
+    if (!state->fds || !state->index) {
+        zfree(state->fds);
+        zfree(state->index);
+        zfree(state);
+        return -1;
+    }
+    for (j = 0; j < eventLoop->setsize; j++) state->index[j] = -1;
+    state->count = 0;
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    struct pollfd *fds;
+    int *index, j;
+
+    fds = zrealloc(state->fds,sizeof(struct pollfd)*setsize);
+    if (!fds) return -1;
+    state->fds = fds;
+    index = zrealloc(state->index,sizeof(int)*setsize);
+    if (!index) return -1;
+    for (j = eventLoop->setsize; j < setsize; j++) index[j] = -1;
+    state->index = index;
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    zfree(state->fds);
+    zfree(state->index);
+    zfree(state);
+}
+
+static short aeApiPollEvents(int mask) {
+    short events = 0;
+
+    if (mask & AE_READABLE) events |= POLLIN;
+    if (mask & AE_WRITABLE) events |= POLLOUT;
+    if (mask & AE_EXCEPTION) events |= POLLPRI;
+    return events;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    int i = state->index[fd];
+
+    if (i == -1) {
+        i = state->count++;
+        state->index[fd] = i;
+        state->fds[i].fd = fd;
+        state->fds[i].events = 0;
+        state->fds[i].revents = 0;
+    }
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    state->fds[i].events = aeApiPollEvents(mask);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    int mask = eventLoop->events[fd].mask & (~delmask);
+    int i = state->index[fd], last;
+
+    if (i == -1) return;
+    if (mask != 0) {
+        state->fds[i].events = aeApiPollEvents(mask);
+        return;
+    }
+    /* Move the last slot in the hole to keep the array packed */
+    last = --state->count;
+    if (i != last) {
+        state->fds[i] = state->fds[last];
+        state->index[state->fds[i].fd] = i;
+    }
+    state->index[fd] = -1;
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    int retval, j, timeout = -1, numevents = 0;
+
+    /* Round the timeout up: waking up a bit before the nearest timer is
+     * due would just make us spin until it is. */
+    if (tvp) {
+        long long ms = (long long)tvp->tv_sec*1000 + (tvp->tv_usec+999)/1000;
+
+        timeout = ms > INT_MAX ? INT_MAX : (int)ms;
+    }
+    retval = poll(state->fds,state->count,timeout);
+    for (j = 0; j < state->count && numevents < retval; j++) {
+        struct pollfd *p = state->fds+j;
+        int mask = 0;
+
+        if (p->revents == 0) continue;
+        if (p->revents & POLLIN) mask |= AE_READABLE;
+        if (p->revents & POLLOUT) mask |= AE_WRITABLE;
+        if (p->revents & POLLPRI) mask |= AE_EXCEPTION;
+        /* Errors and hangups are reported to whoever is listening so
+         * that the next read or write returns the actual error. */
+        if (p->revents & (POLLERR|POLLHUP|POLLNVAL))
+            mask |= AE_READABLE|AE_WRITABLE;
+        /* A pending error queue (e.g. MSG_ZEROCOPY completions) is
+         * signaled only this way: let the exception handler read it. */
+        if (p->revents & POLLERR) mask |= AE_EXCEPTION;
+        eventLoop->fired[numevents].fd = p->fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    return numevents;
+}
+
+/* Errors reach AE_EXCEPTION handlers too, see aeApiPoll() */
+static int aeApiReportsErrors(void) {
+    return 1;
+}
+
+static char *aeApiName(void) {
+    return "poll";
+}
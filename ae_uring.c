@@ -0,0 +1,180 @@
+/* Linux io_uring(7) based completion I/O for ae.c, see aeSubmitRead().
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define AE_RING_ENTRIES 256
+
+typedef struct aeRing {
+    int fd;
+    char *map; /* submission and completion rings, mapped together */
+    size_t maplen;
+    struct io_uring_sqe *sqes;
+    size_t sqeslen;
+    unsigned *sqhead, *sqtail, *sqflags, *sqarray;
+    unsigned sqmask, sqentries;
+    unsigned *cqhead, *cqtail;
+    unsigned cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned tosubmit; /* entries queued since the last io_uring_enter() */
+} aeRing;
+
+static int aeRingEnter(aeRing *ring, unsigned tosubmit, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring->fd, tosubmit, 0, flags, NULL, 0);
+}
+
+/* Returns NULL if the kernel has no io_uring or refuses it (as seccomp
+ * profiles often do), and if it is too old to poll sockets by itself:
+ * before Linux 5.7 reads and writes that can't complete at once are punted
+ * to kernel threads, which is slower than epoll. */
+static aeRing *aeRingCreate(void) {
+    struct io_uring_params p;
+    aeRing *ring;
+    size_t cqlen;
+
+    if ((ring = zmalloc(sizeof(*ring))) == NULL) return NULL;
+    memset(&p,0,sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, AE_RING_ENTRIES, &p);
+    if (ring->fd == -1) {
+        zfree(ring);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_FAST_POLL)) goto err;
+
+    ring->maplen = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (cqlen > ring->maplen) ring->maplen = cqlen;
+    ring->map = mmap(NULL, ring->maplen, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->map == MAP_FAILED) goto err;
+    ring->sqeslen = p.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqeslen, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->map, ring->maplen);
+        goto err;
+    }
+    ring->sqhead = (unsigned*)(ring->map + p.sq_off.head);
+    ring->sqtail = (unsigned*)(ring->map + p.sq_off.tail);
+    ring->sqflags = (unsigned*)(ring->map + p.sq_off.flags);
+    ring->sqarray = (unsigned*)(ring->map + p.sq_off.array);
+    ring->sqmask = *(unsigned*)(ring->map + p.sq_off.ring_mask);
+    ring->sqentries = p.sq_entries;
+    ring->cqhead = (unsigned*)(ring->map + p.cq_off.head);
+    ring->cqtail = (unsigned*)(ring->map + p.cq_off.tail);
+    ring->cqmask = *(unsigned*)(ring->map + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ring->map + p.cq_off.cqes);
+    ring->tosubmit = 0;
+    return ring;
+
+err:
+    close(ring->fd);
+    zfree(ring);
+    return NULL;
+}
+
+static void aeRingFree(aeRing *ring) {
+    munmap(ring->sqes, ring->sqeslen);
+    munmap(ring->map, ring->maplen);
+    close(ring->fd);
+    zfree(ring);
+}
+
+/* Hand the queued entries to the kernel, one system call for all of them.
+ * On error what's left stays queued for the next call. */
+static int aeRingFlush(aeRing *ring) {
+    while (ring->tosubmit) {
+        int n = aeRingEnter(ring, ring->tosubmit, 0);
+
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        ring->tosubmit -= n;
+    }
+    return 0;
+}
+
+/* Queue a read or a write at the current position of the fd (that is the
+ * only meaningful one for sockets and pipes), or the cancellation of the
+ * entry whose data is 'buf'. It is submitted by the next aeRingFlush(), or
+ * right now if the submission ring is full. */
+static int aeRingQueue(aeRing *ring, int opcode, int fd, void *buf,
+        unsigned len, void *data)
+{
+    unsigned tail = *ring->sqtail, idx;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ring->sqhead,__ATOMIC_ACQUIRE) ==
+        ring->sqentries)
+    {
+        if (aeRingFlush(ring) == -1) return -1;
+    }
+    idx = tail & ring->sqmask;
+    sqe = &ring->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = opcode == IORING_OP_ASYNC_CANCEL ? 0 : (__u64)-1;
+    sqe->user_data = (unsigned long)data;
+    ring->sqarray[idx] = idx;
+    __atomic_store_n(ring->sqtail, tail+1, __ATOMIC_RELEASE);
+    ring->tosubmit++;
+    return 0;
+}
+
+/* Pop a completion without entering the kernel. Returns 0 if there are
+ * none. */
+static int aeRingReap(aeRing *ring, void **data, int *res) {
+    unsigned head = *ring->cqhead;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(ring->cqtail,__ATOMIC_ACQUIRE)) {
+#ifdef IORING_SQ_CQ_OVERFLOW
+        /* Completions that didn't fit in the ring wait in the kernel */
+        if (!(__atomic_load_n(ring->sqflags,__ATOMIC_RELAXED) &
+              IORING_SQ_CQ_OVERFLOW)) return 0;
+        aeRingEnter(ring, 0, IORING_ENTER_GETEVENTS);
+        if (head == __atomic_load_n(ring->cqtail,__ATOMIC_ACQUIRE))
+#endif
+            return 0;
+    }
+    cqe = &ring->cqes[head & ring->cqmask];
+    *data = (void*)(unsigned long)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cqhead, head+1, __ATOMIC_RELEASE);
+    return 1;
+}
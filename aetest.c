@@ -0,0 +1,1996 @@
+/* Test driver for the event loop (ae.c) and the networking helpers (anet.c).
+ *
+ * Build and run it with:
+ *
+ *   cc -Wall -std=gnu99 -o aetest aetest.c ae.c anet.c sds.c zmalloc.c \
+ *       coro.c bio.c dns.c adlist.c -lpthread -lm && ./aetest
+ *
+ * Add -DAE_USE_POLL to run the same tests over the poll() backend. The
+ * tests only use pipes, socket pairs and the loopback interface.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fenv.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ae.h"
+#include "anet.h"
+#include "coro.h"
+#include "bio.h"
+#include "sds.h"
+#include "dns.h"
+#include "zmalloc.h"
+#include "testhelp.h"
+
+static long long mstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000+tv.tv_usec/1000;
+}
+
+static long long ustime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((long long)ts.tv_sec)*1000000+ts.tv_nsec/1000;
+}
+
+static int tickProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    return 1;
+}
+
+/* Run the loop until *flag is set, for at most 'ms' milliseconds. A tick
+ * timer makes sure the poll never blocks longer than a millisecond. */
+static void runUntil(aeEventLoop *eventLoop, int *flag, long long ms) {
+    long long end = mstime()+ms;
+    long long tick = aeCreateTimeEvent(eventLoop,1,tickProc,NULL,NULL);
+
+    while (!*flag && mstime() < end)
+        aeProcessEvents(eventLoop,AE_ALL_EVENTS);
+    aeDeleteTimeEvent(eventLoop,tick);
+}
+
+/* ----------------------------------------------------------------------------
+ * Multiplexing layer
+ * ------------------------------------------------------------------------- */
+
+#define PIPES 200
+static int calls, lastMask, fired[PIPES];
+
+static void countProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    calls++;
+    lastMask = mask;
+    if (clientData) fired[(long)clientData-1]++;
+}
+
+static void testMultiplexing(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int p[2], pipes[PIPES][2], j, exact = 1;
+
+    test_cond("Create an event loop", el != NULL);
+    test_cond("A backend is compiled in",
+        !strcmp(aeGetApiName(),"epoll") || !strcmp(aeGetApiName(),"poll") ||
+        !strcmp(aeGetApiName(),"select"));
+    if (pipe(p) == -1) exit(1);
+
+    aeCreateFileEvent(el,p[0],AE_READABLE,countProc,NULL,NULL);
+    calls = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Nothing fires on an empty pipe", calls == 0);
+    if (write(p[1],"x",1) != 1) exit(1);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("A readable pipe fires once per iteration",
+        calls == 1 && lastMask == AE_READABLE);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("A deleted event doesn't fire", calls == 1);
+
+    aeCreateFileEvent(el,p[1],AE_WRITABLE,countProc,NULL,NULL);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("A writable pipe fires", calls == 2 && lastMask == AE_WRITABLE);
+    aeDeleteFileEvent(el,p[1],AE_WRITABLE);
+    close(p[0]);
+    close(p[1]);
+
+    /* Past AE_SETSIZE_INIT: the backend has to grow. Only the ready fds
+     * are reported. */
+    for (j = 0; j < PIPES; j++) {
+        if (pipe(pipes[j]) == -1) exit(1);
+        aeCreateFileEvent(el,pipes[j][0],AE_READABLE,countProc,
+            (void*)(long)(j+1),NULL);
+        fired[j] = 0;
+    }
+    for (j = 0; j < PIPES; j += 7)
+        if (write(pipes[j][1],"x",1) != 1) exit(1);
+    calls = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    for (j = 0; j < PIPES; j++)
+        if (fired[j] != (j % 7 == 0)) exact = 0;
+    test_cond("Only the ready fds fire, past the initial set size",
+        exact && calls == (PIPES+6)/7);
+    for (j = 0; j < PIPES; j++) {
+        aeDeleteFileEvent(el,pipes[j][0],AE_READABLE);
+        close(pipes[j][0]);
+        close(pipes[j][1]);
+    }
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * File event table
+ * ------------------------------------------------------------------------- */
+
+static int finalized, pairFds[2], readCalls, writeCalls;
+
+static void countFinalizer(aeEventLoop *eventLoop, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(clientData);
+    finalized++;
+}
+
+static void readProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+    readCalls++;
+}
+
+static void writeProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+    writeCalls++;
+}
+
+/* Both fds are ready: whoever runs first deletes the other */
+static void deleteOtherProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+    calls++;
+    aeDeleteFileEvent(eventLoop,fd == pairFds[0] ? pairFds[1] : pairFds[0],
+        AE_READABLE);
+}
+
+static void testFileEventTable(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int p[2], q[2], sv[2];
+
+    if (pipe(p) == -1 || pipe(q) == -1) exit(1);
+    if (socketpair(AF_UNIX,SOCK_STREAM,0,sv) == -1) exit(1);
+
+    finalized = 0;
+    aeCreateFileEvent(el,p[0],AE_READABLE|AE_EXCEPTION,countProc,NULL,
+        countFinalizer);
+    test_cond("Registered kinds are kept in the table",
+        el->events[p[0]].mask == (AE_READABLE|AE_EXCEPTION) &&
+        el->events[p[1]].mask == AE_NONE && el->maxfd >= p[0]);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+    test_cond("The finalizer waits for the last kind of a registration",
+        finalized == 0 && el->events[p[0]].mask == AE_EXCEPTION);
+    aeDeleteFileEvent(el,p[0],AE_EXCEPTION);
+    test_cond("The finalizer runs once the registration is gone",
+        finalized == 1 && el->events[p[0]].mask == AE_NONE);
+
+    /* One handler per kind */
+    readCalls = writeCalls = 0;
+    if (write(sv[1],"x",1) != 1) exit(1);
+    aeCreateFileEvent(el,sv[0],AE_READABLE,readProc,NULL,NULL);
+    aeCreateFileEvent(el,sv[0],AE_WRITABLE,writeProc,NULL,NULL);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Readable and writable kinds have their own handler",
+        readCalls == 1 && writeCalls == 1);
+    aeDeleteFileEvent(el,sv[0],AE_WRITABLE);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Deleting a kind keeps the other one",
+        readCalls == 2 && writeCalls == 1);
+    aeDeleteFileEvent(el,sv[0],AE_READABLE);
+
+    /* Kinds registered together share a single call */
+    calls = 0;
+    aeCreateFileEvent(el,sv[0],AE_READABLE|AE_WRITABLE,countProc,NULL,NULL);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Kinds registered together are served by one call",
+        calls == 1 && lastMask == (AE_READABLE|AE_WRITABLE));
+    aeDeleteFileEvent(el,sv[0],AE_READABLE|AE_WRITABLE);
+
+    /* Deleting an fd that fired in the same iteration */
+    if (write(p[1],"x",1) != 1 || write(q[1],"x",1) != 1) exit(1);
+    pairFds[0] = p[0];
+    pairFds[1] = q[0];
+    aeCreateFileEvent(el,p[0],AE_READABLE,deleteOtherProc,NULL,NULL);
+    aeCreateFileEvent(el,q[0],AE_READABLE,deleteOtherProc,NULL,NULL);
+    calls = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("An event deleted by a previous handler is not dispatched",
+        calls == 1);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+    aeDeleteFileEvent(el,q[0],AE_READABLE);
+
+    close(p[0]); close(p[1]); close(q[0]); close(q[1]);
+    close(sv[0]); close(sv[1]);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Time events
+ * ------------------------------------------------------------------------- */
+
+#define TIMERS 200
+static int order[TIMERS], norder, timersDone, repeats;
+static long long victim;
+
+/* Expire time of the j-th timer of the ordering test, far enough apart
+ * that creating all of them can't swap two of them */
+static int timerDelay(int j) {
+    return ((j*37)%20)*5;
+}
+
+static int recordProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    order[norder++] = (int)(long)clientData;
+    if (norder == TIMERS) timersDone = 1;
+    return AE_NOMORE;
+}
+
+static int repeatProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    if (++repeats == 5) {
+        timersDone = 1;
+        return AE_NOMORE;
+    }
+    return 1;
+}
+
+static int zeroProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    repeats++;
+    return 0;
+}
+
+static int killerProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(id);
+    *(int*)clientData = aeDeleteTimeEvent(eventLoop,victim);
+    return AE_NOMORE;
+}
+
+static int victimProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    calls++;
+    return AE_NOMORE;
+}
+
+static void testTimeEvents(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int j, sorted = 1, deleted = AE_ERR;
+    long long id;
+
+    /* Expire times out of order: the heap has to reorder them. Ties are
+     * broken by creation order. */
+    norder = timersDone = 0;
+    for (j = 0; j < TIMERS; j++)
+        aeCreateTimeEvent(el,timerDelay(j),recordProc,(void*)(long)j,NULL);
+    runUntil(el,&timersDone,2000);
+    for (j = 1; j < norder; j++) {
+        int a = order[j-1], b = order[j];
+
+        if (timerDelay(a) > timerDelay(b) ||
+            (timerDelay(a) == timerDelay(b) && a > b)) sorted = 0;
+    }
+    test_cond("All the timers fire", norder == TIMERS);
+    test_cond("Timers fire in expire order, ties in creation order", sorted);
+
+    repeats = timersDone = finalized = 0;
+    aeCreateTimeEvent(el,1,repeatProc,NULL,countFinalizer);
+    runUntil(el,&timersDone,2000);
+    test_cond("A timer is rescheduled until it returns AE_NOMORE",
+        repeats == 5);
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    test_cond("The finalizer of a timer runs once", finalized == 1);
+
+    repeats = 0;
+    id = aeCreateTimeEvent(el,0,zeroProc,NULL,NULL);
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    test_cond("A timer returning 0 runs once per iteration", repeats == 2);
+    aeDeleteTimeEvent(el,id);
+
+    calls = 0;
+    aeCreateTimeEvent(el,1,killerProc,&deleted,NULL);
+    victim = aeCreateTimeEvent(el,1,victimProc,NULL,NULL);
+    usleep(5000);
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    test_cond("A due timer deleted by another handler never fires",
+        deleted == AE_OK && calls == 0);
+    test_cond("Deleting an unknown timer fails",
+        aeDeleteTimeEvent(el,victim) == AE_ERR);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Deadlines
+ * ------------------------------------------------------------------------- */
+
+static int expired[8], nexpired;
+static long long expiredAt[8];
+
+static void deadlineProc(aeEventLoop *eventLoop, int fd, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(clientData);
+    expiredAt[nexpired] = ustime();
+    expired[nexpired++] = fd;
+    if (nexpired == 3) timersDone = 1;
+}
+
+/* Re-arms its deadline a full turn of the root level away, once */
+static void rearmProc(aeEventLoop *eventLoop, int fd, void *clientData) {
+    calls++;
+    if (clientData)
+        aeSetDeadline(eventLoop,fd,(long)clientData,rearmProc,NULL);
+}
+
+static void testDeadlines(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int a[2], b[2], c[2];
+    long long start;
+
+    if (pipe(a) == -1 || pipe(b) == -1 || pipe(c) == -1) exit(1);
+    nexpired = timersDone = 0;
+    start = ustime();
+    aeSetDeadline(el,a[0],5,deadlineProc,NULL);
+    /* Past the 256 slots of the first level: it cascades down */
+    aeSetDeadline(el,a[1],300,deadlineProc,NULL);
+    aeSetDeadline(el,b[0],10,deadlineProc,NULL);
+    aeSetDeadline(el,b[0],40,deadlineProc,NULL); /* replaces the first */
+    aeSetDeadline(el,b[1],20,deadlineProc,NULL);
+    aeDeleteDeadline(el,b[1]);
+    /* Some levels up, it must not fire */
+    aeSetDeadline(el,c[0],70000,deadlineProc,NULL);
+    test_cond("Armed deadlines are counted", el->wheelCount == 4);
+    runUntil(el,&timersDone,2000);
+    usleep(10000);
+    aeProcessEvents(el,AE_ALL_EVENTS|AE_DONT_WAIT);
+
+    test_cond("Deadlines expire in order, a replaced one only once",
+        nexpired == 3 && expired[0] == a[0] && expired[1] == b[0] &&
+        expired[2] == a[1]);
+    test_cond("Deadlines never expire early",
+        nexpired == 3 && expiredAt[0]-start >= 5000 &&
+        expiredAt[1]-start >= 40000 && expiredAt[2]-start >= 300000);
+    test_cond("A far deadline stays armed", el->wheelCount == 1);
+    aeDeleteDeadline(el,c[0]);
+    test_cond("Deleting it disarms the wheel", el->wheelCount == 0);
+
+    /* The same slot, re-armed from its handler with the wheel running */
+    calls = timersDone = 0;
+    aeSetDeadline(el,a[0],1,rearmProc,(void*)255L);
+    aeSetDeadline(el,a[1],1,rearmProc,(void*)256L);
+    aeSetDeadline(el,c[0],70000,deadlineProc,NULL);
+    runUntil(el,&timersDone,100);
+    test_cond("A deadline re-armed a turn away waits for that turn",
+        calls == 2 && el->wheelCount == 3);
+    runUntil(el,&timersDone,300);
+    test_cond("and then fires", calls == 4 && el->wheelCount == 1);
+    aeDeleteDeadline(el,c[0]);
+
+    /* The fd number is reused once its events are gone */
+    aeCreateFileEvent(el,b[0],AE_READABLE,countProc,NULL,NULL);
+    aeSetDeadline(el,b[0],10,deadlineProc,NULL);
+    aeDeleteFileEvent(el,b[0],AE_READABLE);
+    test_cond("Deleting the last event of an fd cancels its deadline",
+        el->wheelCount == 0 && el->events[b[0]].deadlineProc == NULL);
+    close(a[0]); close(a[1]); close(b[0]); close(b[1]);
+    close(c[0]); close(c[1]);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Clock
+ * ------------------------------------------------------------------------- */
+
+static long long seenTime[2];
+static int nseen;
+
+static int clockProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    seenTime[nseen++] = aeGetTime(eventLoop);
+    if (nseen == 2) timersDone = 1;
+    return AE_NOMORE;
+}
+
+static int usProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    *(long long*)clientData = ustime();
+    timersDone = 1;
+    return AE_NOMORE;
+}
+
+static void testClock(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    long long t1, t2, start, fired = 0;
+
+    t1 = aeGetTime(el);
+    usleep(2000);
+    t2 = aeGetTime(el);
+    test_cond("Outside the loop aeGetTime() reads the clock",
+        t2-t1 >= 2000 && llabs(t2-ustime()) < 1000000);
+
+    /* Both timers are due in the same iteration */
+    nseen = timersDone = 0;
+    aeCreateTimeEvent(el,1,clockProc,NULL,NULL);
+    aeCreateTimeEvent(el,1,clockProc,NULL,NULL);
+    usleep(3000);
+    runUntil(el,&timersDone,1000);
+    test_cond("Handlers of the same iteration see the cached clock",
+        nseen == 2 && seenTime[0] == seenTime[1]);
+
+    timersDone = 0;
+    start = ustime();
+    aeCreateTimeEventUs(el,700,usProc,&fired,NULL);
+    runUntil(el,&timersDone,1000);
+    test_cond("A microsecond timer never fires early",
+        fired && fired-start >= 700);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Loop groups
+ * ------------------------------------------------------------------------- */
+
+#define HANDOFFS 100
+static int initSeen[2], handedOff[2];
+
+static void groupInitProc(aeEventLoop *eventLoop, int index, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(clientData);
+    __atomic_fetch_add(&initSeen[index],1,__ATOMIC_RELAXED);
+}
+
+static void groupHandoffProc(aeEventLoop *eventLoop, int fd,
+        void *clientData)
+{
+    aeLoopGroup *group = clientData;
+    int j;
+
+    for (j = 0; j < aeLoopGroupSize(group); j++) {
+        if (aeLoopGroupGetLoop(group,j) == eventLoop)
+            __atomic_fetch_add(&handedOff[j],1,__ATOMIC_RELAXED);
+    }
+    close(fd);
+}
+
+/* Port a socket is bound to */
+static int socketPort(int fd) {
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+
+    if (getsockname(fd,(struct sockaddr*)&sa,&salen) == -1) return -1;
+    if (sa.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6*)&sa)->sin6_port);
+    return ntohs(((struct sockaddr_in*)&sa)->sin_port);
+}
+
+static void testLoopGroups(void) {
+    aeLoopGroup *group = aeCreateLoopGroup(2,0);
+    char err[ANET_ERR_LEN], c;
+    int j, ok = 1, s1, s2, p[2];
+
+    test_cond("Create a loop group", group && aeLoopGroupSize(group) == 2);
+    test_cond("Start it",
+        aeStartLoopGroup(group,groupInitProc,groupHandoffProc,group) ==
+        AE_OK);
+    for (j = 0; j < HANDOFFS; j++) {
+        int fd = dup(1);
+
+        if (aeLoopGroupDispatch(group,fd) == AE_ERR) {
+            close(fd);
+            ok = 0;
+        }
+    }
+    /* The stop token is queued behind the fds */
+    aeStopLoopGroup(group);
+    test_cond("Every loop ran its init callback",
+        initSeen[0] == 1 && initSeen[1] == 1);
+    test_cond("Every fd is handed off once, spread across the loops",
+        ok && handedOff[0]+handedOff[1] == HANDOFFS &&
+        handedOff[0] && handedOff[1]);
+    /* Nobody will take this one: deleting the group has to close it */
+    if (pipe(p) == -1) exit(1);
+    anetNonBlock(NULL,p[0]);
+    aeLoopGroupDispatch(group,p[1]);
+    aeDeleteLoopGroup(group);
+    test_cond("Deleting a group closes the fds not handed off yet",
+        read(p[0],&c,1) == 0);
+    close(p[0]);
+
+    s1 = anetTcpReusePortServer(err,0,"127.0.0.1",0);
+    s2 = s1 == ANET_ERR ? ANET_ERR :
+        anetTcpReusePortServer(err,socketPort(s1),"127.0.0.1",0);
+    test_cond("Two listeners share a port with SO_REUSEPORT",
+        s1 != ANET_ERR && s2 != ANET_ERR && socketPort(s1) == socketPort(s2));
+    if (s1 != ANET_ERR) close(s1);
+    if (s2 != ANET_ERR) close(s2);
+}
+
+/* ----------------------------------------------------------------------------
+ * Tasks posted by other threads
+ * ------------------------------------------------------------------------- */
+
+#define PRODUCERS 4
+#define TASKS 5000
+static int lastSeq[PRODUCERS], tasksRun, tasksFifo = 1, tasksDone;
+
+static void taskProc(aeEventLoop *eventLoop, void *arg) {
+    long v = (long)arg;
+    int producer = v >> 16, seq = v & 0xffff;
+    AE_NOTUSED(eventLoop);
+
+    if (seq != lastSeq[producer]+1) tasksFifo = 0;
+    lastSeq[producer] = seq;
+    if (++tasksRun == PRODUCERS*TASKS) tasksDone = 1;
+}
+
+static void *producerMain(void *arg) {
+    aeEventLoop *el = arg;
+    static int next = 0;
+    int producer = __atomic_fetch_add(&next,1,__ATOMIC_RELAXED), j;
+
+    for (j = 1; j <= TASKS; j++) {
+        while (aePostTask(el,taskProc,(void*)(long)((producer<<16)|j)) ==
+               AE_ERR) usleep(100);
+    }
+    return NULL;
+}
+
+static void wakeupProc(aeEventLoop *eventLoop, void *arg) {
+    AE_NOTUSED(eventLoop);
+    *(int*)arg = 1;
+}
+
+static void *lateProducerMain(void *arg) {
+    static int woken;
+
+    usleep(20000);
+    aePostTask(arg,wakeupProc,&woken);
+    return &woken;
+}
+
+static void testTasks(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    pthread_t threads[PRODUCERS];
+    void *woken;
+    int j;
+
+    zmalloc_enable_thread_safeness();
+    for (j = 0; j < PRODUCERS; j++)
+        pthread_create(&threads[j],NULL,producerMain,el);
+    runUntil(el,&tasksDone,10000);
+    for (j = 0; j < PRODUCERS; j++) pthread_join(threads[j],NULL);
+    test_cond("Every task posted by other threads runs",
+        tasksRun == PRODUCERS*TASKS);
+    test_cond("Tasks of the same thread run in order", tasksFifo);
+
+    /* No timers and no fds: only the post can wake the loop up */
+    pthread_create(&threads[0],NULL,lateProducerMain,el);
+    aeProcessEvents(el,AE_ALL_EVENTS);
+    pthread_join(threads[0],&woken);
+    test_cond("A post wakes up a loop blocked in the poll", *(int*)woken);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Sleep hooks
+ * ------------------------------------------------------------------------- */
+
+static char hookLog[16];
+static int hookLen;
+
+static void beforeSleepProc(aeEventLoop *eventLoop) {
+    AE_NOTUSED(eventLoop);
+    if (hookLen < 15) hookLog[hookLen++] = 'B';
+}
+
+static void afterSleepProc(aeEventLoop *eventLoop) {
+    AE_NOTUSED(eventLoop);
+    if (hookLen < 15) hookLog[hookLen++] = 'A';
+}
+
+static void hookFileProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+    if (hookLen < 15) hookLog[hookLen++] = 'F';
+}
+
+static int stopProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    aeStop(eventLoop);
+    return AE_NOMORE;
+}
+
+/* Arms a timer that is due at once, the first time only */
+static void timerSleepProc(aeEventLoop *eventLoop) {
+    if (hookLen++ == 0) aeCreateTimeEvent(eventLoop,0,stopProc,NULL,NULL);
+}
+
+static void testSleepHooks(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    long long id;
+    int p[2];
+
+    if (pipe(p) == -1 || write(p[1],"x",1) != 1) exit(1);
+    aeSetBeforeSleepProc(el,beforeSleepProc);
+    aeSetAfterSleepProc(el,afterSleepProc);
+    aeCreateFileEvent(el,p[0],AE_READABLE,hookFileProc,NULL,NULL);
+
+    hookLen = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("The hooks only run when asked", hookLen == 1 &&
+        hookLog[0] == 'F');
+    hookLen = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT|
+        AE_CALL_BEFORE_SLEEP|AE_CALL_AFTER_SLEEP);
+    test_cond("beforesleep, poll, aftersleep, then the handlers",
+        hookLen == 3 && !memcmp(hookLog,"BAF",3));
+
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+    hookLen = 0;
+    aeCreateTimeEvent(el,1,stopProc,NULL,NULL);
+    aeMain(el);
+    test_cond("aeMain() calls both hooks",
+        hookLen >= 2 && hookLog[0] == 'B' && hookLog[1] == 'A');
+
+    /* Along with another timer that is due */
+    aeSetBeforeSleepProc(el,timerSleepProc);
+    aeSetAfterSleepProc(el,NULL);
+    hookLen = repeats = el->stop = 0;
+    id = aeCreateTimeEvent(el,0,repeatProc,NULL,NULL);
+    aeProcessEvents(el,AE_ALL_EVENTS|AE_CALL_BEFORE_SLEEP);
+    test_cond("A timer created by beforesleep fires in the same iteration",
+        hookLen == 1 && repeats == 1 && el->stop);
+    aeDeleteTimeEvent(el,id);
+    close(p[0]);
+    close(p[1]);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Completion I/O
+ * ------------------------------------------------------------------------- */
+
+static int nonBlockPair(int sv[2]) {
+    if (socketpair(AF_UNIX,SOCK_STREAM,0,sv) == -1) return -1;
+    anetNonBlock(NULL,sv[0]);
+    anetNonBlock(NULL,sv[1]);
+    return 0;
+}
+
+static int ioResult[8], ioTag[8], nio, ioWanted, ioDone;
+static char ioFill[65536];
+
+static void ioDoneProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int res)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    ioResult[nio] = res;
+    ioTag[nio++] = (int)(long)clientData;
+    if (nio == ioWanted) ioDone = 1;
+}
+
+/* With 'ring' zero the loop doesn't look for io_uring: every request
+ * waits for readiness, as on systems without it. */
+static void testCompletionIo(int ring) {
+    aeEventLoop *el = aeCreateEventLoop();
+    char buf1[4] = {0}, buf2[4] = {0}, descr[64], *mode;
+    int sv[2], res;
+
+    if (!ring) el->ioProbed = 1;
+    if (socketpair(AF_UNIX,SOCK_STREAM,0,sv) == -1) exit(1);
+    anetNonBlock(NULL,sv[0]);
+    anetNonBlock(NULL,sv[1]);
+
+    nio = ioDone = 0;
+    ioWanted = 3;
+    aeSubmitRead(el,sv[0],buf1,3,ioDoneProc,(void*)1);
+    aeSubmitRead(el,sv[0],buf2,3,ioDoneProc,(void*)2);
+    aeSubmitWrite(el,sv[1],"abcdef",6,ioDoneProc,(void*)3);
+    runUntil(el,&ioDone,1000);
+    if (ring && el->ioRing == NULL) {
+        printf("io_uring is not available, testing readiness only\n");
+        close(sv[0]); close(sv[1]);
+        aeDeleteEventLoop(el);
+        return;
+    }
+    mode = ring ? "io_uring" : "readiness";
+    snprintf(descr,sizeof(descr),"Reads of an fd complete in order (%s)",mode);
+    test_cond(descr, nio == 3 && ioTag[0] == 3 && ioResult[0] == 6 &&
+        ioTag[1] == 1 && ioResult[1] == 3 && !strcmp(buf1,"abc") &&
+        ioTag[2] == 2 && ioResult[2] == 3 && !strcmp(buf2,"def"));
+
+    nio = ioDone = 0;
+    ioWanted = 1;
+    close(sv[1]);
+    aeSubmitRead(el,sv[0],buf1,3,ioDoneProc,NULL);
+    runUntil(el,&ioDone,1000);
+    snprintf(descr,sizeof(descr),"A read at EOF completes with 0 (%s)",mode);
+    test_cond(descr, nio == 1 && ioResult[0] == 0);
+
+    nio = ioDone = 0;
+    close(sv[0]);
+    res = aeSubmitRead(el,sv[0],buf1,3,ioDoneProc,NULL);
+    if (res == AE_OK) runUntil(el,&ioDone,1000);
+    snprintf(descr,sizeof(descr),"I/O on a closed fd fails (%s)",mode);
+    test_cond(descr, res == AE_ERR || (nio == 1 && ioResult[0] == -EBADF));
+
+    /* Requests cancelled before closing the fd, that is then reused */
+    if (nonBlockPair(sv) == -1) exit(1);
+    nio = ioDone = 0;
+    ioWanted = 2;
+    aeSubmitRead(el,sv[0],buf1,3,ioDoneProc,(void*)1);
+    aeSubmitRead(el,sv[0],buf2,3,ioDoneProc,(void*)2);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    aeCancelIo(el,sv[0],AE_READABLE);
+    runUntil(el,&ioDone,1000);
+    snprintf(descr,sizeof(descr),"Cancelled requests complete (%s)",mode);
+    test_cond(descr, nio == 2 && ioResult[0] == -ECANCELED &&
+        ioResult[1] == -ECANCELED && ioTag[0]+ioTag[1] == 3);
+
+    /* Full socket buffer: the write waits until its events are deleted */
+    while (write(sv[1],ioFill,sizeof(ioFill)) > 0);
+    aeCreateFileEvent(el,sv[1],AE_READABLE,countProc,NULL,NULL);
+    nio = ioDone = 0;
+    ioWanted = 1;
+    aeSubmitWrite(el,sv[1],"x",1,ioDoneProc,(void*)3);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    aeDeleteFileEvent(el,sv[1],AE_READABLE|AE_WRITABLE);
+    runUntil(el,&ioDone,1000);
+    snprintf(descr,sizeof(descr),
+        "Deleting the events of an fd cancels its requests (%s)",mode);
+    test_cond(descr, nio == 1 && ioResult[0] == -ECANCELED);
+
+    /* Waiting for readiness needs the handler of the fd */
+    if (!ring) {
+        aeCreateFileEvent(el,sv[0],AE_READABLE,countProc,NULL,NULL);
+        errno = 0;
+        res = aeSubmitRead(el,sv[0],buf1,3,ioDoneProc,NULL);
+        test_cond("A read doesn't replace the handler of the fd (readiness)",
+            res == AE_ERR && errno == EBUSY &&
+            el->events[sv[0]].handlers[AE_KIND_READABLE].fileProc ==
+            countProc);
+        aeDeleteFileEvent(el,sv[0],AE_READABLE);
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    if (nonBlockPair(sv) == -1 || write(sv[1],"xyz",3) != 3) exit(1);
+    nio = ioDone = 0;
+    memset(buf1,0,sizeof(buf1));
+    aeSubmitRead(el,sv[0],buf1,3,ioDoneProc,(void*)4);
+    runUntil(el,&ioDone,1000);
+    runUntil(el,&ioDone,20); /* nothing else may complete */
+    snprintf(descr,sizeof(descr),
+        "A reused fd gets only its own requests (%s)",mode);
+    test_cond(descr, nio == 1 && ioTag[0] == 4 && ioResult[0] == 3 &&
+        !strcmp(buf1,"xyz"));
+    close(sv[0]);
+    close(sv[1]);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Statistics
+ * ------------------------------------------------------------------------- */
+
+static int slowProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    usleep(10000);
+    timersDone = 1;
+    return AE_NOMORE;
+}
+
+static void testStats(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    aeLoopStats stats;
+    long long id, p50;
+    int p[2];
+
+    test_cond("No statistics until enabled", aeGetStats(el,&stats) == AE_ERR);
+    aeEnableStats(el,5000);
+    if (pipe(p) == -1 || write(p[1],"x",1) != 1) exit(1);
+    aeCreateFileEvent(el,p[0],AE_READABLE,countProc,NULL,NULL);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+    timersDone = 0;
+    id = aeCreateTimeEvent(el,0,slowProc,NULL,NULL);
+    while (!timersDone) aeProcessEvents(el,AE_ALL_EVENTS);
+
+    test_cond("Get the statistics", aeGetStats(el,&stats) == AE_OK);
+    test_cond("Iterations and handler calls are counted",
+        stats.iterations >= 3 && stats.fileEvents == 2 &&
+        stats.timeEvents == 1);
+    test_cond("A handler slower than the threshold is a stall",
+        stats.stalls == 1 && stats.stallLog[0].kind == AE_STAT_TIMER &&
+        stats.stallLog[0].id == id && stats.stallLog[0].duration >= 10000 &&
+        stats.stallLog[0].proc == (void*)slowProc);
+    p50 = aeStatsPercentile(&stats,AE_STAT_TIMER,50);
+    test_cond("Percentiles are within the bucket precision",
+        p50 >= 10000*7/8 && p50 < 1000000);
+    aeDisableStats(el);
+    test_cond("Disable them", aeGetStats(el,&stats) == AE_ERR);
+    close(p[0]);
+    close(p[1]);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Fairness: budgets and priorities
+ * ------------------------------------------------------------------------- */
+
+static int servedOrder[4], nserved;
+
+static void orderProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(mask);
+    servedOrder[nserved++] = (int)(long)clientData;
+}
+
+static void testFairness(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int r[3][2], p[2], j;
+    int prio[3] = {AE_PRIO_LOW, AE_PRIO_NORMAL, AE_PRIO_HIGH};
+
+    if (pipe(p) == -1) exit(1);
+    test_cond("No budget on an fd without events",
+        aeSetFileEventBudget(el,p[0],1024) == AE_ERR);
+    aeCreateFileEvent(el,p[0],AE_READABLE,countProc,NULL,NULL);
+    aeSetFileEventBudget(el,p[0],1024);
+    test_cond("Set the budget of an fd", aeGetFileEventBudget(el,p[0]) == 1024);
+
+    /* Requeued readiness fires once more, even with nothing to read */
+    calls = 0;
+    aeRequeueFileEvent(el,p[0],AE_READABLE);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Requeued readiness fires in the next iteration only",
+        calls == 1);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+    test_cond("Deleting the fd resets its budget",
+        aeGetFileEventBudget(el,p[0]) == 0);
+
+    /* The fd number of a closed connection is reused by a new one */
+    aeCreateFileEvent(el,p[0],AE_READABLE,countProc,NULL,NULL);
+    aeRequeueFileEvent(el,p[0],AE_READABLE);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+    aeCreateFileEvent(el,p[0],AE_READABLE,countProc,NULL,NULL);
+    calls = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("A reused fd does not inherit requeued readiness", calls == 0);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+
+    /* Lower fds first, priorities the other way around */
+    for (j = 0; j < 3; j++) {
+        if (pipe(r[j]) == -1 || write(r[j][1],"x",1) != 1) exit(1);
+        aeCreateFileEvent(el,r[j][0],AE_READABLE,orderProc,(void*)(long)j,
+            NULL);
+        aeSetFileEventPriority(el,r[j][0],prio[j]);
+    }
+    nserved = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Higher priority fds are served first",
+        nserved == 3 && servedOrder[0] == 2 && servedOrder[1] == 1 &&
+        servedOrder[2] == 0);
+
+    aeSetEventBudget(el,1);
+    nserved = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("The event budget limits the fds served per iteration",
+        nserved == 1 && servedOrder[0] == 2);
+    /* Same priority: the fds left behind go first next time */
+    for (j = 0; j < 3; j++) aeSetFileEventPriority(el,r[j][0],AE_PRIO_NORMAL);
+    nserved = 0;
+    for (j = 0; j < 3; j++) aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Every ready fd is served within budget rounds",
+        nserved == 3 && servedOrder[0]+servedOrder[1]+servedOrder[2] == 3 &&
+        servedOrder[0] != servedOrder[1] && servedOrder[1] != servedOrder[2] &&
+        servedOrder[0] != servedOrder[2]);
+    aeSetEventBudget(el,0);
+    for (j = 0; j < 3; j++) {
+        aeDeleteFileEvent(el,r[j][0],AE_READABLE);
+        close(r[j][0]);
+        close(r[j][1]);
+    }
+    close(p[0]);
+    close(p[1]);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Coroutines
+ * ------------------------------------------------------------------------- */
+
+#define COROUTINES 500
+#define CO_BULK (1024*1024)
+static int coSv[2], coDone, coFinished, coWaitRes, coWaitErrno;
+static aeEventLoop *coLoop;
+static char coBuf[8];
+static long long coSlept;
+static char *coBulk, *coBulkIn;
+
+static void coReaderProc(aeCoroutine *co, void *arg) {
+    int n, got = 0;
+    AE_NOTUSED(arg);
+
+    coLoop = aeCoGetLoop(co);
+    while (got < 5 && (n = aeCoRead(co,coSv[0],coBuf+got,5-got)) > 0)
+        got += n;
+    /* Bigger than the socket buffers: the writer has to suspend */
+    got = 0;
+    while (got < CO_BULK &&
+           (n = aeCoRead(co,coSv[0],coBulkIn+got,CO_BULK-got)) > 0)
+        got += n;
+    coDone++;
+}
+
+static void coWriterProc(aeCoroutine *co, void *arg) {
+    long long start = mstime();
+    AE_NOTUSED(arg);
+
+    aeCoSleep(co,20);
+    coSlept = mstime()-start;
+    aeCoWrite(co,coSv[1],"hello",5);
+    aeCoWrite(co,coSv[1],coBulk,CO_BULK);
+    coDone++;
+}
+
+static void coWaitProc(aeCoroutine *co, void *arg) {
+    coWaitRes = aeCoWait(co,*(int*)arg,AE_READABLE,10);
+    coWaitErrno = errno;
+    coDone++;
+}
+
+static void coForeverProc(aeCoroutine *co, void *arg) {
+    aeCoWait(co,*(int*)arg,AE_READABLE,0);
+    coDone++;
+}
+
+static int coRoundIn, coRoundOut;
+
+static void coRoundProc(aeCoroutine *co, void *arg) {
+    AE_NOTUSED(arg);
+    fesetround(FE_UPWARD);
+    aeCoSleep(co,1);
+    coRoundIn = fegetround();
+    fesetround(FE_TONEAREST);
+    coDone++;
+}
+
+static void coSleepProc(aeCoroutine *co, void *arg) {
+    AE_NOTUSED(arg);
+    aeCoSleep(co,1);
+    coFinished++;
+}
+
+static void testCoroutines(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int p[2], q[2], j;
+
+    if (socketpair(AF_UNIX,SOCK_STREAM,0,coSv) == -1 || pipe(p) == -1)
+        exit(1);
+    anetNonBlock(NULL,coSv[0]);
+    anetNonBlock(NULL,coSv[1]);
+    coBulk = zmalloc(CO_BULK);
+    coBulkIn = zmalloc(CO_BULK);
+    for (j = 0; j < CO_BULK; j++) coBulk[j] = j % 251;
+
+    coDone = 0;
+    aeCoStart(el,coReaderProc,NULL);
+    aeCoStart(el,coWriterProc,NULL);
+    while (coDone < 2) aeProcessEvents(el,AE_ALL_EVENTS);
+    test_cond("A coroutine reads what another one writes",
+        coLoop == el && !memcmp(coBuf,"hello",5) &&
+        !memcmp(coBulk,coBulkIn,CO_BULK));
+    test_cond("aeCoSleep() suspends the coroutine", coSlept >= 20);
+
+    coDone = 0;
+    aeCoStart(el,coWaitProc,&p[0]);
+    while (coDone < 1) aeProcessEvents(el,AE_ALL_EVENTS);
+    test_cond("aeCoWait() times out", coWaitRes == 0);
+    if (write(p[1],"x",1) != 1) exit(1);
+    coDone = 0;
+    aeCoStart(el,coWaitProc,&p[0]);
+    while (coDone < 1) aeProcessEvents(el,AE_ALL_EVENTS);
+    test_cond("aeCoWait() returns the ready events", coWaitRes == AE_READABLE);
+
+    /* The fd belongs to a handler already */
+    aeCreateFileEvent(el,p[0],AE_READABLE,countProc,NULL,NULL);
+    coDone = calls = 0;
+    aeCoStart(el,coWaitProc,&p[0]);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("aeCoWait() doesn't take the event of another handler",
+        coDone == 1 && coWaitRes == -1 && coWaitErrno == EBUSY && calls == 1 &&
+        aeGetFileEvents(el,p[0]) == AE_READABLE);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+
+    /* The rounding mode is callee saved: each side keeps its own */
+    coDone = 0;
+    aeCoStart(el,coRoundProc,NULL);
+    coRoundOut = fegetround();
+    while (coDone < 1) aeProcessEvents(el,AE_ALL_EVENTS);
+    test_cond("A coroutine keeps its own floating point rounding mode",
+        coRoundOut == FE_TONEAREST && coRoundIn == FE_UPWARD);
+    fesetround(FE_TONEAREST);
+
+    coFinished = 0;
+    for (j = 0; j < COROUTINES; j++) aeCoStart(el,coSleepProc,NULL);
+    while (coFinished < COROUTINES) aeProcessEvents(el,AE_ALL_EVENTS);
+    test_cond("Many coroutines run side by side", coFinished == COROUTINES);
+
+    /* Still waiting when the loop goes away: its stack goes too */
+    if (pipe(q) == -1) exit(1);
+    coDone = 0;
+    aeCoStart(el,coForeverProc,&q[0]);
+    test_cond("A suspended coroutine is released with its loop",
+        coDone == 0 && el->coroutines != NULL && el->coFree != NULL);
+
+    zfree(coBulk);
+    zfree(coBulkIn);
+    close(coSv[0]); close(coSv[1]); close(p[0]); close(p[1]);
+    aeDeleteEventLoop(el);
+    close(q[0]); close(q[1]);
+}
+
+/* ----------------------------------------------------------------------------
+ * Background jobs
+ * ------------------------------------------------------------------------- */
+
+#define BIO_JOBS 100
+static int bioOrder[BIO_JOBS+2], bioResult[BIO_JOBS+2], nbio, bioFreed;
+
+static void bioDone(aeEventLoop *eventLoop, int type, int result,
+        void *clientData)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(type);
+    bioResult[nbio] = result;
+    bioOrder[nbio++] = (int)(long)clientData;
+}
+
+static void bioFree(void *ptr) {
+    zfree(ptr);
+    __atomic_fetch_add(&bioFreed,1,__ATOMIC_RELAXED);
+}
+
+static void testBio(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int j, p[2], fds[BIO_JOBS], ordered = 1, closed = 1;
+    FILE *fp = tmpfile();
+
+    test_cond("Jobs are refused before bioInit()",
+        bioCreateCloseJob(1,el,bioDone,NULL) == AE_ERR);
+    bioInit();
+    nbio = 0;
+    for (j = 0; j < BIO_JOBS; j++) {
+        if ((fds[j] = dup(1)) == -1) exit(1);
+        bioCreateCloseJob(fds[j],el,bioDone,(void*)(long)j);
+    }
+    while (nbio < BIO_JOBS) aeProcessEvents(el,AE_ALL_EVENTS);
+    for (j = 0; j < BIO_JOBS; j++) {
+        if (bioOrder[j] != j || bioResult[j] != 0) ordered = 0;
+        if (fcntl(fds[j],F_GETFD) != -1) closed = 0;
+    }
+    test_cond("Close jobs complete in the loop, in order", ordered);
+    test_cond("The files are closed", closed);
+
+    nbio = 0;
+    if (fp == NULL || pipe(p) == -1) exit(1);
+    bioCreateFsyncJob(fileno(fp),el,bioDone,NULL);
+    bioCreateFsyncJob(p[0],el,bioDone,NULL);
+    while (nbio < 2) aeProcessEvents(el,AE_ALL_EVENTS);
+    test_cond("Fsync jobs report errors", bioResult[0] == 0 &&
+        bioResult[1] == EINVAL);
+
+    nbio = 0;
+    bioCreateFreeJob(bioFree,zmalloc(64),el,bioDone,NULL);
+    bioCreateFreeJob(bioFree,zmalloc(64),NULL,NULL,NULL);
+    while (nbio < 1) aeProcessEvents(el,AE_ALL_EVENTS);
+    bioKillThreads();
+    test_cond("Free jobs run with or without a completion",
+        bioFreed == 2 && bioPendingJobsOfType(BIO_FREE) == 0);
+    fclose(fp);
+    close(p[0]);
+    close(p[1]);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Signals and timerfd
+ * ------------------------------------------------------------------------- */
+
+static int signalsSeen, lastSigno;
+
+static void signalProc(aeEventLoop *eventLoop, int signo, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(clientData);
+    signalsSeen++;
+    lastSigno = signo;
+}
+
+static void testSignals(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    long long start, fired = 0;
+    int j;
+
+    test_cond("Invalid signals are refused",
+        aeCreateSignalEvent(el,0,signalProc,NULL) == AE_ERR &&
+        aeCreateSignalEvent(el,AE_NSIG,signalProc,NULL) == AE_ERR);
+    test_cond("Handle SIGUSR1 in the loop",
+        aeCreateSignalEvent(el,SIGUSR1,signalProc,NULL) == AE_OK);
+    raise(SIGUSR1);
+    for (j = 0; j < 10 && !signalsSeen; j++)
+        aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("A signal is delivered as an event",
+        signalsSeen == 1 && lastSigno == SIGUSR1);
+    signalsSeen = 0;
+    raise(SIGUSR1);
+    raise(SIGUSR1);
+    for (j = 0; j < 10; j++) aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Signals received before the handler runs are merged",
+        signalsSeen == 1);
+    aeDeleteSignalEvent(el,SIGUSR1);
+
+    test_cond("Sleep on a timerfd",
+        aeEnableTimerfd(el) == AE_OK && el->timerfd != -1);
+    timersDone = 0;
+    start = ustime();
+    aeCreateTimeEventUs(el,1500,usProc,&fired,NULL);
+    while (!timersDone) aeProcessEvents(el,AE_ALL_EVENTS);
+    test_cond("A timer fires on time with the timerfd",
+        fired-start >= 1500 && fired-start < 100000);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * poll() backend and aeWait()
+ * ------------------------------------------------------------------------- */
+
+static void testWait(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int p[2], big;
+    char ch;
+
+    if (pipe(p) == -1) exit(1);
+    test_cond("aeWait() times out on an empty pipe",
+        aeWait(p[0],AE_READABLE,10) == 0);
+    if (write(p[1],"x",1) != 1) exit(1);
+    test_cond("aeWait() reports a readable pipe",
+        aeWait(p[0],AE_READABLE,10) & AE_READABLE);
+    test_cond("aeWait() reports a writable pipe",
+        aeWait(p[1],AE_WRITABLE,10) == AE_WRITABLE);
+    /* Past FD_SETSIZE, if the limits allow it */
+    if ((big = dup2(p[0],FD_SETSIZE+10)) != -1) {
+        test_cond("aeWait() works past FD_SETSIZE",
+            aeWait(big,AE_READABLE,10) & AE_READABLE);
+        calls = 0;
+        aeCreateFileEvent(el,big,AE_READABLE,countProc,NULL,NULL);
+        aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+        test_cond("The loop serves fds past FD_SETSIZE", calls == 1);
+        aeDeleteFileEvent(el,big,AE_READABLE);
+        close(big);
+    }
+    if (read(p[0],&ch,1) != 1) exit(1);
+    close(p[1]);
+    test_cond("A hangup is reported as readable",
+        aeWait(p[0],AE_READABLE,10) & AE_READABLE);
+    close(p[0]);
+    errno = 0;
+    test_cond("aeWait() fails on a closed fd",
+        aeWait(p[0],AE_READABLE,10) == -1 && errno == EBADF);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Trace and replay
+ * ------------------------------------------------------------------------- */
+
+static char traceLog[16];
+static long long traceTime[16];
+static int traceLen;
+
+static void traceNote(aeEventLoop *eventLoop, char what) {
+    if (traceLen == 15) return;
+    traceTime[traceLen] = aeGetTime(eventLoop);
+    traceLog[traceLen++] = what;
+}
+
+static void traceFileProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    AE_NOTUSED(fd);
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+    traceNote(eventLoop,'F');
+}
+
+static int traceTimeProc(aeEventLoop *eventLoop, long long id,
+        void *clientData)
+{
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    traceNote(eventLoop,'T');
+    return AE_NOMORE;
+}
+
+static void traceDeadlineProc(aeEventLoop *eventLoop, int fd,
+        void *clientData)
+{
+    AE_NOTUSED(fd);
+    AE_NOTUSED(clientData);
+    traceNote(eventLoop,'D');
+    timersDone = 1;
+}
+
+static void testTrace(void) {
+    aeEventLoop *el = aeCreateEventLoop(), *replay = aeCreateEventLoop();
+    aeEventLoop *bare = aeCreateEventLoop();
+    char path[64], recLog[16];
+    long long recTime[16];
+    int p[2], recLen, j, sameClock = 1;
+
+    snprintf(path,sizeof(path),"/tmp/aetest-%d.trace",(int)getpid());
+    if (pipe(p) == -1 || write(p[1],"x",1) != 1) exit(1);
+    test_cond("Start a trace", aeStartTrace(el,path) == AE_OK);
+    aeCreateFileEvent(el,p[0],AE_READABLE,traceFileProc,NULL,NULL);
+    aeCreateTimeEvent(el,5,traceTimeProc,NULL,NULL);
+    aeSetDeadline(el,p[1],10,traceDeadlineProc,NULL);
+    traceLen = timersDone = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    aeDeleteFileEvent(el,p[0],AE_READABLE);
+    while (!timersDone) aeProcessEvents(el,AE_ALL_EVENTS);
+    aeStopTrace(el);
+    recLen = traceLen;
+    memcpy(recLog,traceLog,sizeof(recLog));
+    memcpy(recTime,traceTime,sizeof(recTime));
+
+    /* Same events, created in the same order, that would never fire */
+    aeCreateFileEvent(replay,p[0],AE_READABLE,traceFileProc,NULL,NULL);
+    aeCreateTimeEvent(replay,100000,traceTimeProc,NULL,NULL);
+    aeSetDeadline(replay,p[1],100000,traceDeadlineProc,NULL);
+    traceLen = 0;
+    test_cond("Replay every record", aeReplayTraceLive(replay,path) == recLen);
+    for (j = 1; j < recLen; j++) {
+        if (traceTime[j]-traceTime[0] != recTime[j]-recTime[0])
+            sameClock = 0;
+    }
+    test_cond("The handlers are called in the recorded order",
+        recLen == 3 && traceLen == 3 && !memcmp(recLog,"FTD",3) &&
+        !memcmp(traceLog,recLog,3));
+    test_cond("Handlers see the recorded clock", sameClock);
+    /* No event for the fd in this loop: its record is skipped */
+    aeCreateTimeEvent(bare,100000,traceTimeProc,NULL,NULL);
+    aeSetDeadline(bare,p[1],100000,traceDeadlineProc,NULL);
+    traceLen = 0;
+    test_cond("Records of fds without events are skipped",
+        aeReplayTraceLive(bare,path) == 2 && traceLen == 2 &&
+        !memcmp(traceLog,"TD",2));
+    test_cond("A missing trace can't be replayed",
+        aeReplayTraceLive(replay,"/nonexistent/trace") == -1);
+    unlink(path);
+    close(p[0]);
+    close(p[1]);
+    aeDeleteEventLoop(el);
+    aeDeleteEventLoop(replay);
+    aeDeleteEventLoop(bare);
+}
+
+/* ----------------------------------------------------------------------------
+ * Timer slack
+ * ------------------------------------------------------------------------- */
+
+static long long slackIter[10];
+static int nslack;
+
+static int stampProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    *(long long*)clientData = mstime();
+    timersDone = 1;
+    return AE_NOMORE;
+}
+
+static int slackProc(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    slackIter[nslack++] = eventLoop->iteration;
+    if (nslack == 10) timersDone = 1;
+    return AE_NOMORE;
+}
+
+static void testSlack(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    long long start, fired = 0;
+    int j, wakeups = 1;
+
+    timersDone = 0;
+    start = mstime();
+    aeCreateTimeEventSlack(el,20,10,stampProc,&fired,NULL);
+    while (!timersDone) aeProcessEvents(el,AE_ALL_EVENTS);
+    test_cond("A timer with slack fires within its window",
+        fired-start >= 20 && fired-start < 20+10+50);
+
+    /* Overlapping windows: a few wake ups serve them all */
+    timersDone = nslack = 0;
+    for (j = 0; j < 10; j++)
+        aeCreateTimeEventSlack(el,10+j,20,slackProc,NULL,NULL);
+    while (!timersDone) aeProcessEvents(el,AE_ALL_EVENTS);
+    for (j = 1; j < 10; j++)
+        if (slackIter[j] != slackIter[j-1]) wakeups++;
+    test_cond("Timers with slack are coalesced", wakeups <= 3);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Edge triggered events and drain helpers
+ * ------------------------------------------------------------------------- */
+
+static char *randomBuffer(size_t len) {
+    char *buf = zmalloc(len);
+    size_t j;
+
+    for (j = 0; j < len; j++) buf[j] = rand();
+    return buf;
+}
+
+static void testEdgeTriggered(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int sv[2], edge = !strcmp(aeGetApiName(),"epoll");
+
+    if (nonBlockPair(sv) == -1 || write(sv[1],"x",1) != 1) exit(1);
+    aeCreateFileEvent(el,sv[0],AE_READABLE|AE_EDGE,countProc,NULL,NULL);
+    calls = 0;
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("An edge triggered fd fires once per edge (level without epoll)",
+        calls == (edge ? 1 : 2));
+    if (write(sv[1],"x",1) != 1) exit(1);
+    aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("New data is a new edge", calls == (edge ? 2 : 3));
+    aeDeleteFileEvent(el,sv[0],AE_READABLE);
+    test_cond("The trigger mode is reset with the last event",
+        el->events[sv[0]].edge == 0);
+
+    /* A failed AE_EDGE add keeps the mode of the events already there */
+    if (edge) {
+        int fd = dup(sv[0]);
+
+        aeCreateFileEvent(el,fd,AE_READABLE,countProc,NULL,NULL);
+        close(fd); /* epoll_ctl() fails on a closed fd */
+        test_cond("A failed edge triggered add restores the trigger mode",
+            aeCreateFileEvent(el,fd,AE_WRITABLE|AE_EDGE,countProc,NULL,NULL)
+            == AE_ERR && el->events[fd].edge == 0);
+        aeDeleteFileEvent(el,fd,AE_READABLE);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    aeDeleteEventLoop(el);
+}
+
+static void testDrainHelpers(void) {
+    size_t len = 1024*1024*2;
+    char *data = randomBuffer(len);
+    sds out = sdsnewlen(data,len), in = sdsempty();
+    int sv[2], eof = 0, ok = 1;
+    ssize_t n;
+
+    if (nonBlockPair(sv) == -1) exit(1);
+    while (sdslen(out) || sdslen(in) < len) {
+        if (anetWriteToEagain(NULL,sv[0],out) == ANET_ERR) ok = 0;
+        if (anetReadToEagain(NULL,sv[1],&in,0,&eof) == ANET_ERR) ok = 0;
+        if (!ok || eof) break;
+    }
+    test_cond("anetWriteToEagain/anetReadToEagain move a large buffer",
+        ok && sdslen(in) == len && memcmp(in,data,len) == 0);
+
+    sdsIncrLen(in,-(ssize_t)sdslen(in)); /* clear it */
+    if (write(sv[0],data,1000) != 1000) exit(1);
+    n = anetReadToEagain(NULL,sv[1],&in,100,&eof);
+    test_cond("anetReadToEagain() stops at the limit",
+        n == 100 && sdslen(in) == 100 && !eof);
+    n = anetReadToEagain(NULL,sv[1],&in,0,&eof);
+    test_cond("and reads the rest later", n == 900 && sdslen(in) == 1000);
+    close(sv[0]);
+    n = anetReadToEagain(NULL,sv[1],&in,0,&eof);
+    test_cond("anetReadToEagain() reports EOF", n == 0 && eof == 1);
+    close(sv[1]);
+    zfree(data);
+    sdsfree(out);
+    sdsfree(in);
+}
+
+/* ----------------------------------------------------------------------------
+ * Unix domain sockets and IPv6
+ * ------------------------------------------------------------------------- */
+
+/* Connect to a server bound to 'bindaddr' through 'addr': returns 1 if the
+ * connection is accepted, with the address of the client in 'ip'. */
+static int tcpRoundTrip(char *bindaddr, char *addr, char *ip) {
+    char err[ANET_ERR_LEN];
+    int s, c = ANET_ERR, fd = ANET_ERR, port = -1, ok;
+
+    if ((s = anetTcpServer(err,0,bindaddr,0)) == ANET_ERR) return 0;
+    c = anetTcpConnect(err,addr,socketPort(s));
+    if (c != ANET_ERR) fd = anetAccept(err,s,ip,ANET_IP_LEN,&port);
+    ok = fd != ANET_ERR && port == socketPort(c);
+    if (c != ANET_ERR) close(c);
+    if (fd != ANET_ERR) close(fd);
+    close(s);
+    return ok;
+}
+
+static void testAnetSockets(void) {
+    char err[ANET_ERR_LEN], ip[ANET_IP_LEN], path[64];
+    int s, c, fd;
+    struct stat st;
+    mode_t old;
+
+    test_cond("TCP over IPv4",
+        tcpRoundTrip("127.0.0.1","127.0.0.1",ip) && !strcmp(ip,"127.0.0.1"));
+    if ((s = anetTcpServer(err,0,"::1",0)) != ANET_ERR) {
+        close(s);
+        test_cond("TCP over IPv6",
+            tcpRoundTrip("::1","::1",ip) && !strcmp(ip,"::1"));
+        test_cond("A dual stack server reports IPv4 clients as IPv4",
+            tcpRoundTrip(NULL,"127.0.0.1",ip) && !strcmp(ip,"127.0.0.1"));
+    } else {
+        printf("IPv6 is not available, skipping the IPv6 tests\n");
+    }
+    test_cond("Resolve an ip literal",
+        anetResolve(err,"127.0.0.1",ip,sizeof(ip)) == ANET_OK &&
+        !strcmp(ip,"127.0.0.1"));
+    test_cond("Resolving a bad name fails",
+        anetResolve(err,"no.such.host.invalid",ip,sizeof(ip)) == ANET_ERR);
+
+    /* Resolving would block the loop */
+    s = anetTcpServer(err,0,"127.0.0.1",0);
+    c = anetTcpNonBlockConnect(err,"localhost",socketPort(s));
+    test_cond("A non blocking connect refuses names",
+        c == ANET_ERR && strstr(err,"dnsResolve") != NULL);
+    c = anetTcpNonBlockConnect(err,"127.0.0.1",socketPort(s));
+    test_cond("and connects to addresses",
+        c != ANET_ERR && aeWait(c,AE_WRITABLE,1000) == AE_WRITABLE);
+    if (c != ANET_ERR) close(c);
+    close(s);
+
+    snprintf(path,sizeof(path),"/tmp/aetest-%d.sock",(int)getpid());
+    unlink(path);
+    s = anetUnixServer(err,path,0600,0);
+    test_cond("A unix socket gets the requested permissions",
+        s != ANET_ERR && stat(path,&st) == 0 && (st.st_mode & 0777) == 0600);
+    c = anetUnixConnect(err,path);
+    fd = anetUnixAccept(err,s);
+    test_cond("Connect and accept over a unix socket",
+        c != ANET_ERR && fd != ANET_ERR && write(c,"x",1) == 1 &&
+        read(fd,ip,1) == 1 && ip[0] == 'x');
+    close(c); close(fd); close(s);
+    unlink(path);
+
+    /* No permissions requested: the umask decides */
+    old = umask(077);
+    s = anetUnixServer(err,path,0,0);
+    umask(old);
+    test_cond("A unix socket without permissions keeps the umask mode",
+        s != ANET_ERR && stat(path,&st) == 0 && (st.st_mode & 0777) == 0700);
+    if (s != ANET_ERR) close(s);
+    unlink(path);
+}
+
+/* ----------------------------------------------------------------------------
+ * DNS
+ * ------------------------------------------------------------------------- */
+
+static int resolved, resolvedStatus[4];
+static char resolvedIp[4][ANET_IP_LEN];
+
+static void resolveProc(aeEventLoop *eventLoop, int status, const char *host,
+        const char *ip, void *clientData)
+{
+    int j = (int)(long)clientData;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(host);
+
+    resolvedStatus[j] = status;
+    snprintf(resolvedIp[j],ANET_IP_LEN,"%s",ip);
+    resolved++;
+}
+
+static void testDns(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    int loops = 0;
+
+    dnsInit(2,0);
+    resolved = 0;
+    dnsResolve(el,"127.0.0.1",resolveProc,(void*)0);
+    dnsResolve(el,"localhost",resolveProc,(void*)1);
+    dnsResolve(el,"localhost",resolveProc,(void*)2);
+    dnsResolve(el,"no.such.host.invalid",resolveProc,(void*)3);
+    while (resolved < 4 && loops++ < 5000) {
+        aeProcessEvents(el,AE_ALL_EVENTS|AE_DONT_WAIT);
+        usleep(1000);
+    }
+    test_cond("An ip literal resolves to itself",
+        resolvedStatus[0] == DNS_OK && !strcmp(resolvedIp[0],"127.0.0.1"));
+    test_cond("localhost resolves to a loopback address",
+        resolvedStatus[1] == DNS_OK && (!strcmp(resolvedIp[1],"127.0.0.1") ||
+        !strcmp(resolvedIp[1],"::1")));
+    test_cond("Concurrent requests for a host get the same answer",
+        resolvedStatus[2] == DNS_OK && !strcmp(resolvedIp[1],resolvedIp[2]));
+    test_cond("A missing host is an error",
+        resolvedStatus[3] == DNS_ERR && resolvedIp[3][0] == '\0');
+    dnsKillThreads();
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Batch accept
+ * ------------------------------------------------------------------------- */
+
+#define CLIENTS 5
+static void testAcceptBatch(void) {
+    char err[ANET_ERR_LEN], ip[ANET_IP_LEN];
+    int s, j, n, port, clients[CLIENTS], fds[16], flags = 1;
+
+    test_cond("The system backlog limit is known", anetSomaxconn() > 0);
+    s = anetTcpServer(err,0,"127.0.0.1",16);
+    anetNonBlock(NULL,s);
+    test_cond("Nothing to accept yet", anetAcceptBatch(err,s,fds,16) == 0);
+    for (j = 0; j < CLIENTS; j++)
+        clients[j] = anetTcpConnect(err,"127.0.0.1",socketPort(s));
+    n = anetAcceptBatch(err,s,fds,16);
+    test_cond("Accept every pending connection in one call", n == CLIENTS);
+    for (j = 0; j < n; j++) {
+        if (!(fcntl(fds[j],F_GETFL) & O_NONBLOCK) ||
+            !(fcntl(fds[j],F_GETFD) & FD_CLOEXEC)) flags = 0;
+        close(fds[j]);
+    }
+    test_cond("Accepted sockets are non blocking and close-on-exec", flags);
+    test_cond("anetPeerToString() gives the server address",
+        anetPeerToString(err,clients[0],ip,sizeof(ip),&port) == ANET_OK &&
+        !strcmp(ip,"127.0.0.1") && port == socketPort(s));
+    for (j = 0; j < CLIENTS; j++) close(clients[j]);
+    close(s);
+}
+
+/* ----------------------------------------------------------------------------
+ * Vectored I/O
+ * ------------------------------------------------------------------------- */
+
+#define IOVS 3000
+#define IOV_LEN 100
+static void testVectoredIo(void) {
+    char *data = randomBuffer(IOVS*IOV_LEN), *in = zmalloc(IOVS*IOV_LEN);
+    struct iovec out[IOVS], rd[IOVS], *outp = out, *rdp = rd;
+    int sv[2], j, outcnt = IOVS, rdcnt = IOVS, eof = 0, ok = 1;
+    ssize_t n;
+
+    if (nonBlockPair(sv) == -1) exit(1);
+    /* More buffers than IOV_MAX, some of them empty */
+    for (j = 0; j < IOVS; j++) {
+        out[j].iov_base = data+j*IOV_LEN;
+        out[j].iov_len = j % 10 == 9 ? 0 : IOV_LEN;
+        rd[j].iov_base = in+j*IOV_LEN;
+        rd[j].iov_len = out[j].iov_len;
+    }
+    while (outcnt || rdcnt) {
+        if (outcnt && anetWritev(NULL,sv[0],&outp,&outcnt) == ANET_ERR)
+            ok = 0;
+        if (anetReadv(NULL,sv[1],&rdp,&rdcnt,&eof) == ANET_ERR) ok = 0;
+        if (!ok || eof) break;
+    }
+    for (j = 0; j < IOVS; j++) {
+        if (memcmp(data+j*IOV_LEN,in+j*IOV_LEN,out[j].iov_len)) ok = 0;
+    }
+    test_cond("anetWritev()/anetReadv() move more than IOV_MAX buffers",
+        ok && outcnt == 0 && rdcnt == 0);
+
+    rd[0].iov_base = in;
+    rd[0].iov_len = 10;
+    rdp = rd;
+    rdcnt = 1;
+    n = anetReadv(NULL,sv[1],&rdp,&rdcnt,&eof);
+    test_cond("anetReadv() stops at EAGAIN", n == 0 && !eof && rdcnt == 1);
+    close(sv[0]);
+    n = anetReadv(NULL,sv[1],&rdp,&rdcnt,&eof);
+    test_cond("anetReadv() reports EOF", n == 0 && eof);
+    close(sv[1]);
+    zfree(data);
+    zfree(in);
+}
+
+/* ----------------------------------------------------------------------------
+ * File transfers and relays
+ * ------------------------------------------------------------------------- */
+
+#define FILE_LEN 300000
+static char *transferIn;
+static size_t transferGot;
+static int transferStatus, transferDone;
+
+static FILE *tmpFileWith(char *data, size_t len) {
+    FILE *fp = tmpfile();
+
+    if (fp == NULL || fwrite(data,len,1,fp) != 1 || fflush(fp) != 0) exit(1);
+    return fp;
+}
+
+static void transferReadProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    ssize_t n;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+
+    while ((n = read(fd,transferIn+transferGot,FILE_LEN-transferGot)) > 0)
+        transferGot += n;
+}
+
+static void transferDoneProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int status)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(clientData);
+    transferStatus = status;
+    transferDone = 1;
+}
+
+static void testSendFile(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    char *data = randomBuffer(FILE_LEN), err[ANET_ERR_LEN];
+    FILE *fp = tmpFileWith(data,FILE_LEN);
+    off_t offset = 0;
+    int sv[2], ok = 1, loops = 0;
+    ssize_t n;
+
+    transferIn = zmalloc(FILE_LEN);
+    transferGot = 0;
+    if (nonBlockPair(sv) == -1) exit(1);
+    while (transferGot < FILE_LEN) {
+        if (offset < FILE_LEN &&
+            anetSendFile(NULL,sv[0],fileno(fp),&offset,FILE_LEN-offset) ==
+            ANET_ERR)
+        {
+            ok = 0;
+            break;
+        }
+        n = read(sv[1],transferIn+transferGot,FILE_LEN-transferGot);
+        if (n > 0) transferGot += n;
+    }
+    test_cond("anetSendFile() sends a file to a non blocking socket",
+        ok && transferGot == FILE_LEN && !memcmp(transferIn,data,FILE_LEN));
+    test_cond("anetSendFile() fails past the end of the file",
+        anetSendFile(err,sv[0],fileno(fp),&offset,10) == ANET_ERR);
+
+    /* The same from the writable event, starting in the middle */
+    transferGot = transferDone = 0;
+    aeCreateFileEvent(el,sv[1],AE_READABLE,transferReadProc,NULL,NULL);
+    anetTransferFile(el,sv[0],fileno(fp),1000,FILE_LEN-1000,
+        transferDoneProc,NULL);
+    while ((!transferDone || transferGot < FILE_LEN-1000) && loops++ < 10000)
+        aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("anetTransferFile() sends the range from the loop",
+        transferStatus == ANET_OK && transferGot == FILE_LEN-1000 &&
+        !memcmp(transferIn,data+1000,FILE_LEN-1000) &&
+        el->events[sv[0]].mask == AE_NONE);
+    aeDeleteFileEvent(el,sv[1],AE_READABLE);
+    fclose(fp);
+    close(sv[0]);
+    close(sv[1]);
+    zfree(transferIn);
+    zfree(data);
+    aeDeleteEventLoop(el);
+}
+
+static void testSplice(void) {
+    char *data = randomBuffer(FILE_LEN), *in = zmalloc(FILE_LEN);
+    int a[2], b[2], eof = 0, ok = 1;
+    size_t sent = 0, got = 0;
+    anetRelay relay;
+    ssize_t n;
+
+    if (anetRelayInit(NULL,&relay) == ANET_ERR) {
+        printf("splice is not available, skipping the relay tests\n");
+        zfree(data);
+        zfree(in);
+        return;
+    }
+    if (nonBlockPair(a) == -1 || nonBlockPair(b) == -1) exit(1);
+    while (got < FILE_LEN) {
+        if (sent < FILE_LEN &&
+            (n = write(a[1],data+sent,FILE_LEN-sent)) > 0) sent += n;
+        if (anetSplice(NULL,&relay,a[0],b[0],&eof) == ANET_ERR) {
+            ok = 0;
+            break;
+        }
+        if ((n = read(b[1],in+got,FILE_LEN-got)) > 0) got += n;
+    }
+    test_cond("anetSplice() relays a socket to another one",
+        ok && got == FILE_LEN && !memcmp(in,data,FILE_LEN) &&
+        relay.pending == 0);
+    close(a[1]);
+    n = anetSplice(NULL,&relay,a[0],b[0],&eof);
+    test_cond("anetSplice() reports EOF", n == 0 && eof);
+    anetRelayFree(&relay);
+    close(a[0]); close(b[0]); close(b[1]);
+    zfree(data);
+    zfree(in);
+}
+
+/* ----------------------------------------------------------------------------
+ * Zerocopy sends
+ * ------------------------------------------------------------------------- */
+
+#define ZC_CHUNK 65536
+#define ZC_CHUNKS 8
+static int zcReleased;
+
+static void zcFreeProc(void *ptr) {
+    zcReleased++;
+    zfree(ptr);
+}
+
+static void testZeroCopy(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    char err[ANET_ERR_LEN], *data = randomBuffer(ZC_CHUNK*ZC_CHUNKS);
+    char *in = zmalloc(ZC_CHUNK*ZC_CHUNKS);
+    int s, c, fd, j, loops = 0, ok = 1;
+    size_t got = 0;
+    anetZeroCopy *zc;
+    ssize_t n;
+
+    s = anetTcpServer(err,0,"127.0.0.1",0);
+    c = anetTcpConnect(err,"127.0.0.1",socketPort(s));
+    fd = anetAccept(err,s,NULL,0,NULL);
+    if (s == ANET_ERR || c == ANET_ERR || fd == ANET_ERR) exit(1);
+    anetNonBlock(NULL,c);
+    anetNonBlock(NULL,fd);
+    zc = anetZeroCopyCreate(err,el,c);
+    test_cond("Create the zerocopy state of a socket", zc != NULL);
+    if (zc == NULL) exit(1);
+    zcReleased = 0;
+    for (j = 0; j < ZC_CHUNKS; j++) {
+        char *buf = zmalloc(ZC_CHUNK);
+        size_t sent = 0;
+
+        memcpy(buf,data+j*ZC_CHUNK,ZC_CHUNK);
+        while (sent < ZC_CHUNK) {
+            if ((n = anetZeroCopyWrite(err,zc,buf+sent,ZC_CHUNK-sent)) < 0) {
+                ok = 0;
+                break;
+            }
+            sent += n;
+            while ((n = read(fd,in+got,ZC_CHUNK*ZC_CHUNKS-got)) > 0) got += n;
+        }
+        anetZeroCopyRelease(zc,zcFreeProc,buf);
+    }
+    while (got < ZC_CHUNK*ZC_CHUNKS && loops++ < 10000) {
+        if ((n = read(fd,in+got,ZC_CHUNK*ZC_CHUNKS-got)) > 0) got += n;
+        else usleep(100);
+    }
+    test_cond("Zerocopy writes deliver the data",
+        ok && got == ZC_CHUNK*ZC_CHUNKS && !memcmp(in,data,got));
+    loops = 0;
+    while (zcReleased < ZC_CHUNKS && loops++ < 1000)
+        if (aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT) == 0)
+            usleep(1000);
+    test_cond("Every buffer is released once its sends are completed",
+        zcReleased == ZC_CHUNKS && !anetZeroCopyPending(zc));
+    test_cond("Zerocopy is only enabled where the completions are reported",
+        !zc->enabled ||
+        (aeReportsErrors() && el->events[c].mask & AE_EXCEPTION));
+    anetZeroCopyFree(zc);
+    test_cond("Freeing the zerocopy state removes its completion event",
+        el->events[c].mask == AE_NONE);
+    close(c); close(fd); close(s);
+    zfree(data);
+    zfree(in);
+    aeDeleteEventLoop(el);
+}
+
+/* ----------------------------------------------------------------------------
+ * Buffered connections
+ * ------------------------------------------------------------------------- */
+
+static int connClosed;
+static sds echoed;
+
+static void echoReadProc(anetConn *conn) {
+    char *nl;
+
+    while ((nl = memchr(conn->inbuf,'\n',sdslen(conn->inbuf))) != NULL) {
+        size_t len = nl-conn->inbuf+1;
+
+        anetConnWrite(conn,conn->inbuf,len);
+        anetConnConsume(conn,len);
+    }
+}
+
+static void echoCloseProc(anetConn *conn) {
+    AE_NOTUSED(conn);
+    connClosed = 1;
+}
+
+static void clientReadProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    int eof;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+    anetReadToEagain(NULL,fd,&echoed,0,&eof);
+}
+
+static void testAnetConn(void) {
+    aeEventLoop *el = aeCreateEventLoop();
+    sds req = sdsempty();
+    anetConn *conn;
+    char err[ANET_ERR_LEN];
+    int sv[2], j, loops = 0, fd;
+
+    if (socketpair(AF_UNIX,SOCK_STREAM,0,sv) == -1) exit(1);
+    fd = sv[0];
+    conn = anetConnCreate(err,el,sv[0],echoReadProc,echoCloseProc,NULL);
+    test_cond("Create a connection", conn != NULL);
+    anetNonBlock(NULL,sv[1]);
+    echoed = sdsempty();
+    aeCreateFileEvent(el,sv[1],AE_READABLE,clientReadProc,NULL,NULL);
+    for (j = 0; j < 5000; j++) req = sdscatprintf(req,"line %d\n",j);
+    anetWrite(sv[1],req,sdslen(req));
+    while (sdslen(echoed) < sdslen(req) && loops++ < 10000)
+        aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("Pipelined requests are all answered, in order",
+        sdslen(echoed) == sdslen(req) && memcmp(echoed,req,sdslen(req)) == 0);
+
+    /* Output queued outside readProc goes out through the writable event */
+    anetConnWrite(conn,"tick\n",5);
+    test_cond("A write outside readProc registers the writable event",
+        el->events[fd].mask & AE_WRITABLE);
+    for (j = 0; j < 10; j++) aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("The writable event is removed once the queue is empty",
+        el->events[fd].mask == AE_READABLE && conn->outlen == 0);
+
+    connClosed = 0;
+    aeDeleteFileEvent(el,sv[1],AE_READABLE);
+    close(sv[1]);
+    for (j = 0; j < 10 && !connClosed; j++)
+        aeProcessEvents(el,AE_FILE_EVENTS|AE_DONT_WAIT);
+    test_cond("EOF calls closeProc and releases the connection",
+        connClosed && el->events[fd].mask == AE_NONE);
+
+    /* Other kinds registered on the fd, like the zerocopy completions */
+    if (socketpair(AF_UNIX,SOCK_STREAM,0,sv) == -1) exit(1);
+    fd = sv[0];
+    conn = anetConnCreate(err,el,sv[0],echoReadProc,echoCloseProc,NULL);
+    aeCreateFileEvent(el,fd,AE_EXCEPTION,countProc,NULL,NULL);
+    aeSetDeadline(el,fd,1000,deadlineProc,NULL);
+    anetConnClose(conn);
+    test_cond("Closing a connection removes every kind of event",
+        el->events[fd].mask == AE_NONE);
+    test_cond("and its deadline", el->wheelCount == 0);
+    close(sv[1]);
+    sdsfree(req);
+    sdsfree(echoed);
+    aeDeleteEventLoop(el);
+}
+
+int main(void) {
+    printf("ae backend: %s\n", aeGetApiName());
+    testMultiplexing();
+    testFileEventTable();
+    testTimeEvents();
+    testDeadlines();
+    testClock();
+    testLoopGroups();
+    testTasks();
+    testSleepHooks();
+    testCompletionIo(1);
+    testCompletionIo(0);
+    testStats();
+    testFairness();
+    testCoroutines();
+    testBio();
+    testSignals();
+    testWait();
+    testTrace();
+    testSlack();
+    testEdgeTriggered();
+    testDrainHelpers();
+    testAnetSockets();
+    testDns();
+    testAcceptBatch();
+    testVectoredIo();
+    testSendFile();
+    testSplice();
+    testZeroCopy();
+    testAnetConn();
+    test_report()
+    return 0;
+}
@@ -32,6 +32,12 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -42,8 +48,15 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include "anet.h"
+#include "zmalloc.h"
+#include "config.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /**
  * local function for setting error messages
@@ -136,89 +149,105 @@ int anetTcpKeepAlive(char *err, int fd)
 }
 
 /**
- * translate host to ip address
- * @param err
- * @param host: NUL-terminated ip/hostname
- * @param ipbuf: the ip address will be stored. Users have to allocate the space for ipbuf
+ * write the ip of the address sa into ip (if not NULL) and its port into
+ * port (if not NULL). IPv4 clients of a dual stack IPv6 socket show up as
+ * IPv4 mapped addresses (::ffff:a.b.c.d): they are reported as IPv4.
  */
-int anetResolve(char *err, char *host, char *ipbuf)
+static int anetFormatAddr(struct sockaddr *sa, char *ip, size_t ip_len, int *port)
 {
-    struct sockaddr_in sa;
+    if (sa->sa_family == AF_INET) {
+        struct sockaddr_in *s = (struct sockaddr_in*)sa;
 
-    sa.sin_family = AF_INET;
-    /**
-     * treats host as ip address
-     * if inet_aton fails (return 0 means fail), return 1 means success
-     */
-    if (inet_aton(host, &sa.sin_addr) == 0) {
-        struct hostent *he;
-        /**
-         *  treats host as hostname
-         */
-        he = gethostbyname(host);
-        if (he == NULL) {
-            anetSetError(err, "can't resolve: %s\n", host);
+        if (ip && inet_ntop(AF_INET,&s->sin_addr,ip,ip_len) == NULL)
             return ANET_ERR;
+        if (port) *port = ntohs(s->sin_port);
+    } else if (sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *s = (struct sockaddr_in6*)sa;
+
+        if (ip) {
+            if (IN6_IS_ADDR_V4MAPPED(&s->sin6_addr)) {
+                if (inet_ntop(AF_INET,s->sin6_addr.s6_addr+12,ip,ip_len) == NULL)
+                    return ANET_ERR;
+            } else if (inet_ntop(AF_INET6,&s->sin6_addr,ip,ip_len) == NULL) {
+                return ANET_ERR;
+            }
         }
-        memcpy(&sa.sin_addr, he->h_addr, sizeof(struct in_addr));
+        if (port) *port = ntohs(s->sin6_port);
+    } else {
+        /* Unix domain sockets have no ip and port */
+        if (ip && ip_len) ip[0] = '\0';
+        if (port) *port = 0;
     }
-    /**
-     * copy the address to ipbuf
-     */
-    strcpy(ipbuf,inet_ntoa(sa.sin_addr));
     return ANET_OK;
 }
 
+/**
+ * translate host to ip address, IPv4 or IPv6
+ * @param err
+ * @param host: NUL-terminated ip/hostname
+ * @param ipbuf: the ip address will be stored. Users have to allocate the space for ipbuf
+ * @param ipbuf_len: size of ipbuf, ANET_IP_LEN is enough for any address
+ */
+int anetResolve(char *err, char *host, char *ipbuf, size_t ipbuf_len)
+{
+    struct addrinfo hints, *info;
+    int rv;
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, NULL, &hints, &info)) != 0) {
+        anetSetError(err, "can't resolve %s: %s\n", host, gai_strerror(rv));
+        return ANET_ERR;
+    }
+    rv = anetFormatAddr(info->ai_addr, ipbuf, ipbuf_len, NULL);
+    freeaddrinfo(info);
+    if (rv == ANET_ERR) anetSetError(err, "can't format the address of %s\n", host);
+    return rv;
+}
+
 #define ANET_CONNECT_NONE 0
 #define ANET_CONNECT_NONBLOCK 1
+
 /**
- * return a socket defined by (addr, port, flags)
- * @param addr: address
- * @param port: port
- * @param flags: ANET_CONECT_NON/ANET_CONNECT_NONBLOCK to specify block or nonblock type
+ * create a socket of the given family, with SO_REUSEADDR set
  */
-static int anetTcpGenericConnect(char *err, char *addr, int port, int flags)
+static int anetCreateSocket(char *err, int domain)
 {
     int s, on = 1;
-    struct sockaddr_in sa;
-    /**
-     * create a tcp socket
-     */
-    if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+
+    if ((s = socket(domain, SOCK_STREAM, 0)) == -1) {
         anetSetError(err, "creating socket: %s\n", strerror(errno));
         return ANET_ERR;
     }
     /* Make sure connection-intensive things like the redis benckmark
      * will be able to close/open sockets a zillion of times */
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-
-    /**
-     * set up sa using addr and port
-     */
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
-    if (inet_aton(addr, &sa.sin_addr) == 0) {
-        struct hostent *he;
-
-        he = gethostbyname(addr);
-        if (he == NULL) {
-            anetSetError(err, "can't resolve: %s\n", addr);
-            close(s);
-            return ANET_ERR;
-        }
-        memcpy(&sa.sin_addr, he->h_addr, sizeof(struct in_addr));
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+        anetSetError(err, "setsockopt SO_REUSEADDR: %s\n", strerror(errno));
+        close(s);
+        return ANET_ERR;
     }
+    return s;
+}
+
+/**
+ * connect the socket s to sa, returns s or ANET_ERR (and closes s)
+ * @param flags: ANET_CONNECT_NONBLOCK to return as soon as the connection
+ *               is in progress
+ */
+static int anetGenericConnect(char *err, int s, struct sockaddr *sa,
+        socklen_t salen, int flags)
+{
     /**
      * set nonblock flag
      */
     if (flags & ANET_CONNECT_NONBLOCK) {
-        if (anetNonBlock(err,s) != ANET_OK)
+        if (anetNonBlock(err,s) != ANET_OK) {
+            close(s);
             return ANET_ERR;
+        }
     }
-    /**
-     * connect to sa{addr:port}
-     */
-    if (connect(s, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+    if (connect(s, sa, salen) == -1) {
         /**
          * nonblock type and we are inprogress, return the current socket
          */
@@ -232,6 +261,46 @@ static int anetTcpGenericConnect(char *err, char *addr, int port, int flags)
     }
     return s;
 }
+
+/**
+ * return a socket defined by (addr, port, flags)
+ * addr may be an IPv4 or IPv6 address, or a hostname: every address it
+ * resolves to is tried in turn until one of them accepts the connection
+ * resolving a hostname blocks, so with ANET_CONNECT_NONBLOCK addr must be
+ * an address: event loops resolve names with dnsResolve() first
+ * @param addr: address
+ * @param port: port
+ * @param flags: ANET_CONECT_NON/ANET_CONNECT_NONBLOCK to specify block or nonblock type
+ */
+static int anetTcpGenericConnect(char *err, char *addr, int port, int flags)
+{
+    int s = ANET_ERR, rv;
+    char portstr[6]; /* strlen("65535") + 1 */
+    struct addrinfo hints, *servinfo, *p;
+
+    snprintf(portstr,sizeof(portstr),"%d",port);
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    /* Fail fast on a name instead of blocking the caller's loop */
+    if (flags & ANET_CONNECT_NONBLOCK) hints.ai_flags = AI_NUMERICHOST;
+    if ((rv = getaddrinfo(addr,portstr,&hints,&servinfo)) != 0) {
+        if (rv == EAI_NONAME && flags & ANET_CONNECT_NONBLOCK)
+            anetSetError(err, "%s is not an address, resolve it with "
+                "dnsResolve() first\n", addr);
+        else
+            anetSetError(err, "can't resolve %s: %s\n", addr,
+                gai_strerror(rv));
+        return ANET_ERR;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((s = anetCreateSocket(err,p->ai_family)) == ANET_ERR) continue;
+        s = anetGenericConnect(err,s,p->ai_addr,p->ai_addrlen,flags);
+        if (s != ANET_ERR) break;
+    }
+    freeaddrinfo(servinfo);
+    return s;
+}
 /**
  * connect to {addr:port} with block type
  */
@@ -242,12 +311,54 @@ int anetTcpConnect(char *err, char *addr, int port)
 
 /**
  * connect to {addr:port} with nonblock type
+ * addr must be an IPv4 or IPv6 address, names are refused
  */
 int anetTcpNonBlockConnect(char *err, char *addr, int port)
 {
     return anetTcpGenericConnect(err,addr,port,ANET_CONNECT_NONBLOCK);
 }
 
+/**
+ * fill sa with the unix domain socket address path
+ */
+static int anetUnixAddr(char *err, struct sockaddr_un *sa, char *path)
+{
+    memset(sa,0,sizeof(*sa));
+    sa->sun_family = AF_LOCAL;
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        anetSetError(err, "unix socket path too long: %s\n", path);
+        return ANET_ERR;
+    }
+    strcpy(sa->sun_path,path);
+    return ANET_OK;
+}
+
+static int anetUnixGenericConnect(char *err, char *path, int flags)
+{
+    int s;
+    struct sockaddr_un sa;
+
+    if (anetUnixAddr(err,&sa,path) == ANET_ERR) return ANET_ERR;
+    if ((s = anetCreateSocket(err,AF_LOCAL)) == ANET_ERR) return ANET_ERR;
+    return anetGenericConnect(err,s,(struct sockaddr*)&sa,sizeof(sa),flags);
+}
+
+/**
+ * connect to the unix domain socket at path with block type
+ */
+int anetUnixConnect(char *err, char *path)
+{
+    return anetUnixGenericConnect(err,path,ANET_CONNECT_NONE);
+}
+
+/**
+ * connect to the unix domain socket at path with nonblock type
+ */
+int anetUnixNonBlockConnect(char *err, char *path)
+{
+    return anetUnixGenericConnect(err,path,ANET_CONNECT_NONBLOCK);
+}
+
 /* Like read(2) but make sure 'count' is read before to return
  * (unless error or EOF condition is encountered) */
 int anetRead(int fd, char *buf, int count)
@@ -295,49 +406,650 @@ int anetWrite(int fd, char *buf, int count)
     return totlen;
 }
 
-int anetTcpServer(char *err, int port, char *bindaddr)
+/* Read from the non blocking fd until the kernel has no more data for us
+ * (EAGAIN), appending it to *buf that grows as needed. This is what the
+ * handler of an edge triggered event (AE_EDGE) must do, as the fd is not
+ * reported readable again until new data arrives. If 'limit' is not zero
+ * at most 'limit' bytes are read: if that many are read the handler must
+ * requeue the event (see aeRequeueFileEvent()) to read the rest later.
+ *
+ * Returns the number of bytes read, with *eof set if the peer closed the
+ * connection. On error ANET_ERR is returned, what was read before the error
+ * is in *buf anyway. */
+ssize_t anetReadToEagain(char *err, int fd, sds *buf, size_t limit, int *eof)
 {
-    int s, on = 1;
-    struct sockaddr_in sa;
-    
-    if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        anetSetError(err, "socket: %s\n", strerror(errno));
+    ssize_t nread, totlen = 0;
+
+    *eof = 0;
+    while (limit == 0 || (size_t)totlen < limit) {
+        size_t room;
+        sds newbuf;
+
+        if ((newbuf = sdsMakeRoomFor(*buf,ANET_IOBUF_LEN)) == NULL) {
+            anetSetError(err, "out of memory");
+            return ANET_ERR;
+        }
+        *buf = newbuf;
+        /* sdsMakeRoomFor() makes more room than asked: use it all */
+        room = sdsavail(*buf);
+        if (limit && room > limit-totlen) room = limit-totlen;
+        nread = read(fd,*buf+sdslen(*buf),room);
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            anetSetError(err, "read: %s", strerror(errno));
+            return ANET_ERR;
+        }
+        if (nread == 0) {
+            *eof = 1;
+            break;
+        }
+        sdsIncrLen(*buf,nread);
+        totlen += nread;
+    }
+    return totlen;
+}
+
+/* Write buf to the non blocking fd until it is all written or the socket
+ * buffer is full (EAGAIN), removing what was written from the head of buf.
+ * While buf is not empty the caller should keep the fd writable event
+ * registered: with AE_EDGE it fires again once there is room.
+ *
+ * Returns the number of bytes written, ANET_ERR on error (the bytes written
+ * before the error are removed from buf anyway). */
+ssize_t anetWriteToEagain(char *err, int fd, sds buf)
+{
+    ssize_t nwritten, totlen = 0, len = sdslen(buf);
+    int retval = ANET_OK;
+
+    while (totlen < len) {
+        nwritten = write(fd,buf+totlen,len-totlen);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            anetSetError(err, "write: %s", strerror(errno));
+            retval = ANET_ERR;
+            break;
+        }
+        if (nwritten == 0) break;
+        totlen += nwritten;
+    }
+    if (totlen == len) sdsIncrLen(buf,-len);
+    else if (totlen) sdsrange(buf,totlen,-1);
+    return retval == ANET_ERR ? ANET_ERR : totlen;
+}
+
+/**
+ * skip the first n bytes of the buffers of *iov, advancing *iov past the
+ * buffers consumed and adjusting the one consumed in part in place
+ */
+static void anetIovAdvance(struct iovec **iov, int *iovcnt, size_t n)
+{
+    while (*iovcnt && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt && n) {
+        (*iov)->iov_base = (char*)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/* Common part of anetWritev() and anetReadv(): 'out' selects writev() */
+static ssize_t anetGenericIov(char *err, int fd, struct iovec **iov,
+        int *iovcnt, int out, int *eof)
+{
+    ssize_t n, totlen = 0;
+
+    while (1) {
+        int cnt, j;
+        size_t batch = 0;
+
+        /* Skip the empty buffers, the caller is done once none is left */
+        anetIovAdvance(iov,iovcnt,0);
+        if (*iovcnt == 0) break;
+        cnt = *iovcnt > IOV_MAX ? IOV_MAX : *iovcnt;
+        n = out ? writev(fd,*iov,cnt) : readv(fd,*iov,cnt);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            /* Report the progress made: the error will show up again */
+            if (totlen) break;
+            anetSetError(err, "%s: %s\n", out ? "writev" : "readv",
+                strerror(errno));
+            return ANET_ERR;
+        }
+        if (n == 0 && !out) {
+            *eof = 1;
+            break;
+        }
+        for (j = 0; j < cnt; j++) batch += (*iov)[j].iov_len;
+        anetIovAdvance(iov,iovcnt,n);
+        totlen += n;
+        /* A short transfer means the socket buffer is full (or empty):
+         * the next call would just return EAGAIN */
+        if ((size_t)n < batch) break;
+    }
+    return totlen;
+}
+
+/**
+ * write the iovcnt buffers of *iov to the non blocking fd, with a single
+ * writev(2) for every IOV_MAX buffers, until they are all written or the
+ * socket buffer is full. A reply made of a header, a payload and a trailer
+ * goes out with one system call and without copies.
+ *
+ * *iov and *iovcnt are advanced past what was written (the buffer written
+ * in part is adjusted in place), so the caller can call it again from the
+ * writable handler with the same arguments until *iovcnt is zero.
+ *
+ * Returns the number of bytes written, ANET_ERR on error.
+ */
+ssize_t anetWritev(char *err, int fd, struct iovec **iov, int *iovcnt)
+{
+    return anetGenericIov(err,fd,iov,iovcnt,1,NULL);
+}
+
+/**
+ * read from the non blocking fd into the iovcnt buffers of *iov, until
+ * they are full or there's nothing more to read. *iov and *iovcnt are
+ * advanced as in anetWritev(), *eof is set when the peer closed the
+ * connection.
+ *
+ * Returns the number of bytes read, ANET_ERR on error.
+ */
+ssize_t anetReadv(char *err, int fd, struct iovec **iov, int *iovcnt, int *eof)
+{
+    *eof = 0;
+    return anetGenericIov(err,fd,iov,iovcnt,0,eof);
+}
+
+/**
+ * send count bytes of filefd, starting at *offset, to the non blocking
+ * sock until they are all sent or the socket buffer is full. *offset is
+ * advanced past what was sent, the file offset of filefd is not used.
+ *
+ * With sendfile(2) the data goes from the page cache to the socket
+ * without being copied to userspace, elsewhere it is pread() into a
+ * buffer on the stack and written.
+ *
+ * Returns the number of bytes sent, ANET_ERR on error, and that includes
+ * reaching the end of the file before count bytes were sent.
+ */
+ssize_t anetSendFile(char *err, int sock, int filefd, off_t *offset, size_t count)
+{
+    ssize_t n, totlen = 0;
+
+    while ((size_t)totlen < count) {
+#ifdef HAVE_SENDFILE
+        n = sendfile(sock,filefd,offset,count-totlen);
+#else
+        char buf[ANET_IOBUF_LEN];
+        size_t len = count-totlen > sizeof(buf) ? sizeof(buf) : count-totlen;
+
+        /* What can't be written now is read again next time */
+        n = pread(filefd,buf,len,*offset);
+        if (n > 0 && (n = write(sock,buf,n)) > 0) *offset += n;
+#endif
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (totlen) break;
+            anetSetError(err, "sendfile: %s\n", strerror(errno));
+            return ANET_ERR;
+        }
+        if (n == 0) {
+            if (totlen) break;
+            anetSetError(err, "sendfile: unexpected end of file\n");
+            return ANET_ERR;
+        }
+        totlen += n;
+    }
+    return totlen;
+}
+
+/* State of a file transfer driven by the writable event of the socket */
+typedef struct anetTransfer {
+    int filefd;
+    off_t offset;
+    size_t left;
+    anetTransferProc *proc;
+    void *clientData;
+} anetTransfer;
+
+static void anetTransferFinalizer(aeEventLoop *eventLoop, void *clientData)
+{
+    AE_NOTUSED(eventLoop);
+    zfree(clientData);
+}
+
+static void anetTransferHandler(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask)
+{
+    anetTransfer *t = clientData;
+    anetTransferProc *proc = t->proc;
+    void *procData = t->clientData;
+    ssize_t n;
+    AE_NOTUSED(mask);
+
+    n = anetSendFile(NULL,fd,t->filefd,&t->offset,t->left);
+    if (n != ANET_ERR) {
+        t->left -= n;
+        if (t->left) return;
+    }
+    /* Done or failed: the finalizer releases t */
+    aeDeleteFileEvent(eventLoop,fd,AE_WRITABLE);
+    if (proc) proc(eventLoop,fd,procData,n == ANET_ERR ? ANET_ERR : ANET_OK);
+}
+
+/**
+ * send count bytes of filefd, starting at offset, to the non blocking
+ * sock without blocking the event loop: a writable handler registered on
+ * sock sends a chunk with anetSendFile() every time the socket buffer has
+ * room, then removes itself and calls proc. sock can't have a writable
+ * handler of its own until then, and filefd must stay open.
+ *
+ * Returns ANET_ERR if the writable event can't be registered.
+ */
+int anetTransferFile(aeEventLoop *eventLoop, int sock, int filefd, off_t offset,
+        size_t count, anetTransferProc *proc, void *clientData)
+{
+    anetTransfer *t = zmalloc(sizeof(*t));
+
+    if (t == NULL) return ANET_ERR;
+    t->filefd = filefd;
+    t->offset = offset;
+    t->left = count;
+    t->proc = proc;
+    t->clientData = clientData;
+    if (aeCreateFileEvent(eventLoop,sock,AE_WRITABLE,anetTransferHandler,t,
+            anetTransferFinalizer) == AE_ERR) {
+        zfree(t);
         return ANET_ERR;
     }
-    /**
-     * set address reuseable, so we can open/close zillian times
-     */
-    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
-        anetSetError(err, "setsockopt SO_REUSEADDR: %s\n", strerror(errno));
-        close(s);
+    return ANET_OK;
+}
+
+/**
+ * prepare a relay for anetSplice(): a non blocking pipe the data goes
+ * through. Fails where splice(2) is not available.
+ */
+int anetRelayInit(char *err, anetRelay *relay)
+{
+    relay->pending = 0;
+#ifdef HAVE_SPLICE
+    if (pipe2(relay->pipe,O_NONBLOCK|O_CLOEXEC) == -1) {
+        anetSetError(err, "pipe: %s\n", strerror(errno));
         return ANET_ERR;
     }
-    memset(&sa,0,sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    /**
-     * if bindaddr isn't NULL, bind the address to sa
-     */
-    if (bindaddr) {
-        if (inet_aton(bindaddr, &sa.sin_addr) == 0) {
-            anetSetError(err, "Invalid bind address\n");
-            close(s);
+    return ANET_OK;
+#else
+    relay->pipe[0] = relay->pipe[1] = -1;
+    anetSetError(err, "splice not supported\n");
+    return ANET_ERR;
+#endif
+}
+
+void anetRelayFree(anetRelay *relay)
+{
+    if (relay->pipe[0] != -1) close(relay->pipe[0]);
+    if (relay->pipe[1] != -1) close(relay->pipe[1]);
+    relay->pipe[0] = relay->pipe[1] = -1;
+}
+
+/**
+ * move data from the non blocking socket 'from' to the non blocking
+ * socket 'to' with splice(2), through the pipe of the relay: the kernel
+ * moves pages around, the data is never copied to userspace. It stops
+ * when 'from' has nothing to read or 'to' can't take more.
+ *
+ * Call it from the readable handler of 'from', and from the writable
+ * handler of 'to' while relay->pending is not zero (the data read but not
+ * written yet). *eof is set once 'from' is closed by the peer.
+ *
+ * Returns the number of bytes written to 'to', ANET_ERR on error.
+ */
+ssize_t anetSplice(char *err, anetRelay *relay, int from, int to, int *eof)
+{
+#ifdef HAVE_SPLICE
+    ssize_t n, totlen = 0;
+    int flags = SPLICE_F_MOVE|SPLICE_F_NONBLOCK;
+
+    *eof = 0;
+    while (1) {
+        if (relay->pending) {
+            n = splice(relay->pipe[0],NULL,to,NULL,relay->pending,flags);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) break;
+                anetSetError(err, "splice: %s\n", strerror(errno));
+                return totlen ? totlen : ANET_ERR;
+            }
+            relay->pending -= n;
+            totlen += n;
+            continue;
+        }
+        /* The pipe is empty here: EAGAIN means nothing to read */
+        n = splice(from,NULL,relay->pipe[1],NULL,ANET_SPLICE_LEN,flags);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            anetSetError(err, "splice: %s\n", strerror(errno));
+            return totlen ? totlen : ANET_ERR;
+        }
+        if (n == 0) {
+            *eof = 1;
+            break;
+        }
+        relay->pending += n;
+    }
+    return totlen;
+#else
+    AE_NOTUSED(relay);
+    AE_NOTUSED(from);
+    AE_NOTUSED(to);
+    *eof = 0;
+    anetSetError(err, "splice not supported\n");
+    return ANET_ERR;
+#endif
+}
+
+/**
+ * MSG_ZEROCOPY sends. The pages of the buffer are pinned and handed to
+ * the network stack instead of being copied into the socket buffer, so
+ * the buffer must not be modified or freed until the kernel reports the
+ * send as completed on the error queue of the socket.
+ *
+ * Every successful zerocopy send gets the next id of a per socket counter,
+ * and completions come as ranges of ids, in order for TCP. So the caller
+ * writes a buffer with anetZeroCopyWrite() (in as many calls as needed)
+ * and then hands it to anetZeroCopyRelease(): it is freed once all the
+ * sends issued up to then are completed, right away if none is in flight.
+ *
+ * Completions are read by an AE_EXCEPTION handler registered on the
+ * socket (the backends report a pending error queue to it), the socket
+ * can still have readable and writable handlers of its own.
+ *
+ * Pinning pages and reading notifications costs more than copying a few
+ * KB, so sends shorter than zc->minlen use plain write(), as do all sends
+ * where MSG_ZEROCOPY is not available or the backend of the loop can't
+ * report completions (select()): the API works the same.
+ */
+#ifdef HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
+
+static void anetZeroCopyHandler(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask)
+{
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(mask);
+    anetZeroCopyReap(clientData);
+}
+
+/**
+ * enable zerocopy sends on fd. If the kernel or the socket doesn't support
+ * them the state is still returned, with every send copied.
+ * @return NULL on out of memory or if the event can't be registered.
+ */
+anetZeroCopy *anetZeroCopyCreate(char *err, aeEventLoop *eventLoop, int fd)
+{
+    anetZeroCopy *zc = zmalloc(sizeof(*zc));
+
+    if (zc == NULL) {
+        anetSetError(err, "out of memory\n");
+        return NULL;
+    }
+    zc->eventLoop = eventLoop;
+    zc->fd = fd;
+    zc->enabled = 0;
+    zc->minlen = ANET_ZEROCOPY_MIN;
+    zc->next = zc->completed = 0;
+    zc->copied = 0;
+    zc->head = zc->tail = NULL;
+#ifdef HAVE_MSG_ZEROCOPY
+    {
+        int yes = 1;
+
+        /* Completions would never be read if the backend can't report
+         * them: the buffers would be held forever. */
+        if (aeReportsErrors() &&
+            setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == 0)
+            zc->enabled = 1;
+    }
+#endif
+    if (zc->enabled && aeCreateFileEvent(eventLoop, fd, AE_EXCEPTION,
+            anetZeroCopyHandler, zc, NULL) == AE_ERR) {
+        anetSetError(err, "can't register the completion event\n");
+        zfree(zc);
+        return NULL;
+    }
+    return zc;
+}
+
+/**
+ * release the zerocopy state of a socket that is going to be closed. The
+ * buffers still held are released too: the kernel keeps the pages it is
+ * sending pinned, but the data transmitted after this is undefined.
+ * Call it before the socket is closed (anetConnClose() included): once
+ * the fd number is reused the exception handler is no longer ours.
+ */
+void anetZeroCopyFree(anetZeroCopy *zc)
+{
+    anetZeroCopyHold *h, *next;
+
+    if (zc->enabled) aeDeleteFileEvent(zc->eventLoop, zc->fd, AE_EXCEPTION);
+    for (h = zc->head; h; h = next) {
+        next = h->next;
+        h->proc(h->ptr);
+        zfree(h);
+    }
+    zfree(zc);
+}
+
+/**
+ * write buf to the non blocking socket until all of it is written or the
+ * socket buffer is full, with MSG_ZEROCOPY for the chunks of at least
+ * zc->minlen bytes. Don't touch buf before it is released, see
+ * anetZeroCopyRelease().
+ * @return the number of bytes written, ANET_ERR on error.
+ */
+ssize_t anetZeroCopyWrite(char *err, anetZeroCopy *zc, char *buf, size_t len)
+{
+    ssize_t n, totlen = 0;
+
+    while ((size_t)totlen < len) {
+        size_t left = len-totlen;
+
+#ifdef HAVE_MSG_ZEROCOPY
+        if (zc->enabled && left >= zc->minlen) {
+            n = send(zc->fd, buf+totlen, left, MSG_ZEROCOPY);
+            if (n >= 0) zc->next++;
+            /* Out of optmem for the pinned pages: copy this one */
+            else if (errno == ENOBUFS) n = write(zc->fd, buf+totlen, left);
+        } else
+#endif
+        n = write(zc->fd, buf+totlen, left);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (totlen) break;
+            anetSetError(err, "write: %s\n", strerror(errno));
             return ANET_ERR;
         }
+        if (n == 0) break;
+        totlen += n;
     }
+    return totlen;
+}
+
+/* Return true if some zerocopy send is not completed yet */
+int anetZeroCopyPending(anetZeroCopy *zc)
+{
+    return zc->next != zc->completed;
+}
+
+/**
+ * call proc(ptr) once the kernel completed every zerocopy send issued so
+ * far, that is when the buffer just written is no longer referenced.
+ */
+void anetZeroCopyRelease(anetZeroCopy *zc, anetZeroCopyFreeProc *proc, void *ptr)
+{
+    anetZeroCopyHold *h = NULL;
+
+    /* Release it now if nothing is in flight, or on out of memory, where
+     * all we can do is hope the pages are sent before they are reused. */
+    if (anetZeroCopyPending(zc)) h = zmalloc(sizeof(*h));
+    if (h == NULL) {
+        proc(ptr);
+        return;
+    }
+    h->id = zc->next-1;
+    h->proc = proc;
+    h->ptr = ptr;
+    h->next = NULL;
+    if (zc->tail) zc->tail->next = h;
+    else zc->head = h;
+    zc->tail = h;
+}
+
+/**
+ * read the completions queued on the socket and release the buffers no
+ * longer in use. Called by the exception handler, but can be called
+ * directly, e.g. to poll for completions before closing the socket.
+ */
+void anetZeroCopyReap(anetZeroCopy *zc)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    while (1) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EINTR) continue;
+            break; /* EAGAIN: the queue is empty */
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee;
+
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 &&
+                   cm->cmsg_type == IPV6_RECVERR))) continue;
+            ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* Sends from ee_info to ee_data (inclusive) are completed */
+            if ((int)(ee->ee_data+1-zc->completed) > 0)
+                zc->completed = ee->ee_data+1;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied += ee->ee_data-ee->ee_info+1;
+        }
+    }
+#endif
+    while (zc->head && (int)(zc->head->id-zc->completed) < 0) {
+        anetZeroCopyHold *h = zc->head;
+
+        zc->head = h->next;
+        if (zc->head == NULL) zc->tail = NULL;
+        h->proc(h->ptr);
+        zfree(h);
+    }
+}
+
+#define ANET_SERVER_NONE 0
+#define ANET_SERVER_REUSEPORT 1
+
+/**
+ * set SO_REUSEPORT on s if flags ask for it, closes s on error
+ */
+static int anetSetReusePort(char *err, int s, int flags)
+{
+    if (!(flags & ANET_SERVER_REUSEPORT)) return ANET_OK;
+#ifdef SO_REUSEPORT
+    int on = 1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        anetSetError(err, "setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    anetSetError(err, "SO_REUSEPORT not supported\n");
+    close(s);
+    return ANET_ERR;
+#endif
+}
+
+/**
+ * return the maximum backlog the system allows (net.core.somaxconn on
+ * Linux), or -1 if it is unknown
+ */
+int anetSomaxconn(void)
+{
+#ifdef __linux__
+    FILE *fp = fopen("/proc/sys/net/core/somaxconn","r");
+    int somaxconn = -1;
+
+    if (fp == NULL) return -1;
+    if (fscanf(fp,"%d",&somaxconn) != 1) somaxconn = -1;
+    fclose(fp);
+    return somaxconn;
+#else
+    return SOMAXCONN;
+#endif
+}
+
+/**
+ * bind the socket s to sa and listen on it, returns s or ANET_ERR (and
+ * closes s)
+ * @param backlog: queue of connections not accepted yet. The system caps
+ *                 it silently: 0 (or less) asks for as much as allowed
+ * @param perm: for unix sockets, if not zero the permissions of the socket
+ *              file. They are set before listen(): until then connecting
+ *              is refused, so no client ever sees the umask default
+ */
+static int anetListen(char *err, int s, struct sockaddr *sa, socklen_t len,
+        int backlog, mode_t perm)
+{
     /**
      * bind the server address to socket s
      */
-    if (bind(s, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+    if (bind(s,sa,len) == -1) {
         anetSetError(err, "bind: %s\n", strerror(errno));
         close(s);
         return ANET_ERR;
     }
-    /**
-     * listen at most 64 sockets to connect
-     */
-    if (listen(s, 64) == -1) {
+    if (sa->sa_family == AF_LOCAL && perm &&
+        chmod(((struct sockaddr_un*)sa)->sun_path, perm) == -1) {
+        anetSetError(err, "chmod %s: %s\n",
+            ((struct sockaddr_un*)sa)->sun_path, strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
+    if (backlog <= 0) {
+        backlog = anetSomaxconn();
+        if (backlog <= 0) backlog = ANET_BACKLOG;
+    }
+    if (listen(s, backlog) == -1) {
         anetSetError(err, "listen: %s\n", strerror(errno));
         close(s);
         return ANET_ERR;
@@ -346,24 +1058,110 @@ int anetTcpServer(char *err, int port, char *bindaddr)
 }
 
 /**
- * accept a connect, save the client's ip and port
- * to the paramenter @ip and @port
- * @param serversock: server fd
- * @param ip: if it is not null, the client ip will save to it
- * @param port: the space to hold the connect client port
+ * create a tcp socket listening on {bindaddr:port}
+ * @param bindaddr: address to bind, IPv4 or IPv6. NULL means any address:
+ *                  an IPv6 socket accepting IPv4 clients too (dual stack),
+ *                  or an IPv4 one if the system has no IPv6
+ * @param backlog: see anetListen()
+ * @param flags: ANET_SERVER_REUSEPORT to allow other sockets to listen on
+ *               the same port, the kernel balances connections among them
+ */
+static int anetTcpGenericServer(char *err, int port, char *bindaddr,
+        int backlog, int flags)
+{
+    int s = ANET_ERR, rv, on = 1, off = 0;
+    char portstr[6]; /* strlen("65535") + 1 */
+    struct addrinfo hints, *servinfo, *p;
+
+    snprintf(portstr,sizeof(portstr),"%d",port);
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = bindaddr ? AF_UNSPEC : AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((rv = getaddrinfo(bindaddr,portstr,&hints,&servinfo)) != 0) {
+        anetSetError(err, "Invalid bind address %s: %s\n",
+            bindaddr ? bindaddr : "::", gai_strerror(rv));
+        return ANET_ERR;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        s = anetCreateSocket(err,p->ai_family);
+        if (s == ANET_ERR && !bindaddr &&
+            (errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT)) {
+            /* No IPv6 here: listen on any IPv4 address instead */
+            struct sockaddr_in sa;
+
+            memset(&sa,0,sizeof(sa));
+            sa.sin_family = AF_INET;
+            sa.sin_port = htons(port);
+            sa.sin_addr.s_addr = htonl(INADDR_ANY);
+            if ((s = anetCreateSocket(err,AF_INET)) == ANET_ERR) break;
+            if (anetSetReusePort(err,s,flags) == ANET_ERR) {
+                s = ANET_ERR;
+                break;
+            }
+            s = anetListen(err,s,(struct sockaddr*)&sa,sizeof(sa),backlog,0);
+            break;
+        }
+        if (s == ANET_ERR) continue;
+        if (p->ai_family == AF_INET6) {
+            /* Any IPv6 address accepts IPv4 clients too, a given one
+             * only its own family */
+            int *v6only = bindaddr ? &on : &off;
+
+            setsockopt(s,IPPROTO_IPV6,IPV6_V6ONLY,v6only,sizeof(*v6only));
+        }
+        if (anetSetReusePort(err,s,flags) == ANET_ERR) {
+            s = ANET_ERR;
+            continue;
+        }
+        s = anetListen(err,s,p->ai_addr,p->ai_addrlen,backlog,0);
+        if (s != ANET_ERR) break;
+    }
+    freeaddrinfo(servinfo);
+    return s;
+}
+
+int anetTcpServer(char *err, int port, char *bindaddr, int backlog)
+{
+    return anetTcpGenericServer(err,port,bindaddr,backlog,ANET_SERVER_NONE);
+}
+
+/**
+ * like anetTcpServer but with SO_REUSEPORT set, so that every thread can
+ * have its own listening socket on the same port
+ */
+int anetTcpReusePortServer(char *err, int port, char *bindaddr, int backlog)
+{
+    return anetTcpGenericServer(err,port,bindaddr,backlog,ANET_SERVER_REUSEPORT);
+}
+
+/**
+ * create a unix domain socket listening on path
+ * the file must not exist: a stale socket left by a previous run has to
+ * be unlinked by the caller
+ * @param perm: if not zero the permissions of the socket file, to choose
+ *              who can connect
+ * @param backlog: see anetListen()
  */
-int anetAccept(char *err, int serversock, char *ip, int *port)
+int anetUnixServer(char *err, char *path, mode_t perm, int backlog)
+{
+    int s;
+    struct sockaddr_un sa;
+
+    if (anetUnixAddr(err,&sa,path) == ANET_ERR) return ANET_ERR;
+    if ((s = anetCreateSocket(err,AF_LOCAL)) == ANET_ERR) return ANET_ERR;
+    return anetListen(err,s,(struct sockaddr*)&sa,sizeof(sa),backlog,perm);
+}
+
+/**
+ * accept a connection, retrying if interrupted by a signal
+ */
+static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *len)
 {
     int fd;
-    struct sockaddr_in sa;
-    unsigned int saLen;
 
-    /**
-     * accept a connect
-     */
     while(1) {
-        saLen = sizeof(sa);
-        fd = accept(serversock, (struct sockaddr*)&sa, &saLen);
+        fd = accept(s,sa,len);
         if (fd == -1) {
             if (errno == EINTR)
                 continue;
@@ -374,7 +1172,375 @@ int anetAccept(char *err, int serversock, char *ip, int *port)
         }
         break;
     }
-    if (ip) strcpy(ip,inet_ntoa(sa.sin_addr));
-    if (port) *port = ntohs(sa.sin_port);
     return fd;
 }
+
+/**
+ * accept a connect, save the client's ip and port
+ * to the paramenter @ip and @port
+ * @param serversock: server fd
+ * @param ip: if it is not null, the client ip will save to it
+ * @param ip_len: size of ip, ANET_IP_LEN is enough for any address
+ * @param port: the space to hold the connect client port
+ */
+int anetAccept(char *err, int serversock, char *ip, size_t ip_len, int *port)
+{
+    int fd;
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+
+    if ((fd = anetGenericAccept(err,serversock,(struct sockaddr*)&sa,&salen)) == ANET_ERR)
+        return ANET_ERR;
+    anetFormatAddr((struct sockaddr*)&sa,ip,ip_len,port);
+    return fd;
+}
+
+/**
+ * accept a connection on a unix domain socket
+ */
+int anetUnixAccept(char *err, int serversock)
+{
+    struct sockaddr_un sa;
+    socklen_t salen = sizeof(sa);
+
+    return anetGenericAccept(err,serversock,(struct sockaddr*)&sa,&salen);
+}
+
+/**
+ * accept up to max pending connections on the non blocking serversock,
+ * storing the new fds into fds. Call it from the readable handler of the
+ * listening socket: draining the queue takes one system call per
+ * connection instead of a round through the event loop each.
+ *
+ * The new fds are already non blocking and close-on-exec (with a single
+ * accept4() call where available). Options like TCP_NODELAY, SO_KEEPALIVE
+ * or the buffer sizes can be set once on the listening socket: Linux and
+ * the BSDs copy them to the accepted sockets.
+ *
+ * Returns the number of connections accepted, 0 if none was pending, or
+ * ANET_ERR if the first accept failed. An error after some connections
+ * were accepted is left for the next call.
+ */
+int anetAcceptBatch(char *err, int serversock, int *fds, int max)
+{
+    int fd, count = 0;
+
+    while (count < max) {
+#ifdef HAVE_ACCEPT4
+        fd = accept4(serversock,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+        fd = accept(serversock,NULL,NULL);
+#endif
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            /* The connection was reset before we got to it */
+            if (errno == ECONNABORTED) continue;
+            if (count) break;
+            anetSetError(err, "accept: %s\n", strerror(errno));
+            return ANET_ERR;
+        }
+#ifndef HAVE_ACCEPT4
+        if (anetNonBlock(err,fd) == ANET_ERR) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd,F_SETFD,FD_CLOEXEC);
+#endif
+        fds[count++] = fd;
+    }
+    return count;
+}
+
+/**
+ * write the ip and port of the peer of the socket fd, like anetAccept()
+ */
+int anetPeerToString(char *err, int fd, char *ip, size_t ip_len, int *port)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+
+    if (getpeername(fd,(struct sockaddr*)&sa,&salen) == -1) {
+        anetSetError(err, "getpeername: %s\n", strerror(errno));
+        return ANET_ERR;
+    }
+    return anetFormatAddr((struct sockaddr*)&sa,ip,ip_len,port);
+}
+
+/**
+ * Buffered non blocking connections.
+ *
+ * anetRead() and anetWrite() loop until count bytes are transferred and
+ * are meant for blocking sockets. An anetConn wraps a non blocking socket
+ * instead: every readable event performs a single read() into the spare
+ * room of inbuf and calls readProc, that parses what it can and removes
+ * it with anetConnConsume(). Writes are queued (small ones coalesced in
+ * the last chunk) and the whole queue is flushed with one writev() once
+ * readProc returns, so a batch of pipelined requests costs one read and
+ * one write. What the socket can't take is written by the writable
+ * handler, registered only while output is pending.
+ *
+ * On EOF or error closeProc is called and the connection released (with
+ * the socket). The procs can call anetConnClose(), the release is then
+ * delayed until they return.
+ */
+static void anetConnReadHandler(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask);
+static void anetConnWriteHandler(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask);
+
+/**
+ * wrap the socket fd (set non blocking) in a connection, serving its
+ * readable event from now on.
+ * @return NULL on out of memory or if the event can't be registered.
+ */
+anetConn *anetConnCreate(char *err, aeEventLoop *eventLoop, int fd,
+        anetConnProc *readProc, anetConnProc *closeProc, void *privdata)
+{
+    anetConn *conn;
+
+    if (anetNonBlock(err,fd) == ANET_ERR) return NULL;
+    if ((conn = zmalloc(sizeof(*conn))) == NULL ||
+        (conn->inbuf = sdsempty()) == NULL)
+    {
+        zfree(conn);
+        anetSetError(err, "out of memory\n");
+        return NULL;
+    }
+    conn->eventLoop = eventLoop;
+    conn->fd = fd;
+    conn->flags = 0;
+    conn->maxinput = ANET_CONN_MAXINPUT;
+    conn->head = conn->tail = NULL;
+    conn->sentlen = conn->outlen = 0;
+    conn->readProc = readProc;
+    conn->closeProc = closeProc;
+    conn->privdata = privdata;
+    conn->err[0] = '\0';
+    if (aeCreateFileEvent(eventLoop,fd,AE_READABLE,anetConnReadHandler,conn,
+            NULL) == AE_ERR) {
+        anetSetError(err, "can't register the readable event\n");
+        sdsfree(conn->inbuf);
+        zfree(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+static void anetConnRelease(anetConn *conn)
+{
+    anetConnChunk *c, *next;
+
+    /* Every kind, e.g. the AE_EXCEPTION handler of anetZeroCopyCreate():
+     * left in the table it would be called for the next user of the fd */
+    aeDeleteFileEvent(conn->eventLoop,conn->fd,
+            AE_READABLE|AE_WRITABLE|AE_EXCEPTION);
+    aeDeleteDeadline(conn->eventLoop,conn->fd);
+    close(conn->fd);
+    for (c = conn->head; c; c = next) {
+        next = c->next;
+        sdsfree(c->buf);
+        zfree(c);
+    }
+    sdsfree(conn->inbuf);
+    zfree(conn);
+}
+
+/**
+ * close the connection now, dropping the output not written yet.
+ * closeProc is not called.
+ */
+void anetConnClose(anetConn *conn)
+{
+    if (conn->flags & ANET_CONN_IN_HANDLER)
+        conn->flags |= ANET_CONN_CLOSED;
+    else
+        anetConnRelease(conn);
+}
+
+/* Call a proc of the connection, returns ANET_ERR if it was closed */
+static int anetConnCall(anetConn *conn, anetConnProc *proc)
+{
+    if (proc) {
+        conn->flags |= ANET_CONN_IN_HANDLER;
+        proc(conn);
+        conn->flags &= ~ANET_CONN_IN_HANDLER;
+    }
+    if (conn->flags & ANET_CONN_CLOSED) {
+        anetConnRelease(conn);
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
+/* EOF or error: let the owner know, then release the connection */
+static void anetConnFail(anetConn *conn)
+{
+    conn->flags |= ANET_CONN_CLOSED;
+    anetConnCall(conn,conn->closeProc);
+}
+
+/* Register the writable event if some output is pending, remove it
+ * otherwise. */
+static int anetConnUpdateWritable(anetConn *conn)
+{
+    if (conn->outlen && !(conn->flags & ANET_CONN_WRITABLE)) {
+        if (aeCreateFileEvent(conn->eventLoop,conn->fd,AE_WRITABLE,
+                anetConnWriteHandler,conn,NULL) == AE_ERR) {
+            anetSetError(conn->err, "can't register the writable event\n");
+            return ANET_ERR;
+        }
+        conn->flags |= ANET_CONN_WRITABLE;
+    } else if (!conn->outlen && conn->flags & ANET_CONN_WRITABLE) {
+        aeDeleteFileEvent(conn->eventLoop,conn->fd,AE_WRITABLE);
+        conn->flags &= ~ANET_CONN_WRITABLE;
+    }
+    return ANET_OK;
+}
+
+/* Write the output queue until it is empty or the socket is full */
+static int anetConnFlush(anetConn *conn)
+{
+    while (conn->outlen) {
+        struct iovec iov[ANET_CONN_IOV], *iovp = iov;
+        anetConnChunk *c;
+        ssize_t nwritten;
+        int iovcnt = 0;
+
+        for (c = conn->head; c && iovcnt < ANET_CONN_IOV; c = c->next) {
+            size_t skip = c == conn->head ? conn->sentlen : 0;
+
+            iov[iovcnt].iov_base = c->buf+skip;
+            iov[iovcnt++].iov_len = sdslen(c->buf)-skip;
+        }
+        nwritten = anetWritev(conn->err,conn->fd,&iovp,&iovcnt);
+        if (nwritten == ANET_ERR) return ANET_ERR;
+        conn->outlen -= nwritten;
+        nwritten += conn->sentlen;
+        while (conn->head && (size_t)nwritten >= sdslen(conn->head->buf)) {
+            c = conn->head;
+            nwritten -= sdslen(c->buf);
+            conn->head = c->next;
+            sdsfree(c->buf);
+            zfree(c);
+        }
+        if (conn->head == NULL) conn->tail = NULL;
+        conn->sentlen = nwritten;
+        if (iovcnt) break; /* the socket buffer is full */
+    }
+    return anetConnUpdateWritable(conn);
+}
+
+static void anetConnReadHandler(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask)
+{
+    anetConn *conn = clientData;
+    ssize_t nread;
+    sds buf;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(mask);
+
+    /* A single read: if more data is ready the event fires again, after
+     * the other clients got their turn. */
+    if ((buf = sdsMakeRoomFor(conn->inbuf,ANET_IOBUF_LEN)) == NULL) {
+        anetSetError(conn->err, "out of memory\n");
+        anetConnFail(conn);
+        return;
+    }
+    conn->inbuf = buf;
+    nread = read(fd,buf+sdslen(buf),sdsavail(buf));
+    if (nread == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        anetSetError(conn->err, "read: %s\n", strerror(errno));
+        anetConnFail(conn);
+        return;
+    }
+    if (nread == 0) {
+        anetConnFail(conn);
+        return;
+    }
+    sdsIncrLen(conn->inbuf,nread);
+    if (sdslen(conn->inbuf) > conn->maxinput) {
+        anetSetError(conn->err, "input buffer limit reached\n");
+        anetConnFail(conn);
+        return;
+    }
+    if (anetConnCall(conn,conn->readProc) == ANET_ERR) return;
+    if (anetConnFlush(conn) == ANET_ERR) anetConnFail(conn);
+}
+
+static void anetConnWriteHandler(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask)
+{
+    anetConn *conn = clientData;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(mask);
+
+    if (anetConnFlush(conn) == ANET_ERR) anetConnFail(conn);
+}
+
+/* Append a chunk to the output queue, the writable event is registered
+ * unless we are in readProc, that is followed by a flush anyway. */
+static int anetConnQueue(anetConn *conn, anetConnChunk *c)
+{
+    c->next = NULL;
+    if (conn->tail) conn->tail->next = c;
+    else conn->head = c;
+    conn->tail = c;
+    conn->outlen += sdslen(c->buf);
+    if (conn->flags & ANET_CONN_IN_HANDLER) return ANET_OK;
+    return anetConnUpdateWritable(conn);
+}
+
+/**
+ * queue len bytes of buf for writing. Writes smaller than ANET_CONN_CHUNK
+ * are copied at the end of the last chunk, to keep the queue short.
+ * @return ANET_ERR on out of memory.
+ */
+int anetConnWrite(anetConn *conn, const void *buf, size_t len)
+{
+    anetConnChunk *c = conn->tail;
+    sds s;
+
+    if (len == 0) return ANET_OK;
+    if (c && sdslen(c->buf)+len <= ANET_CONN_CHUNK) {
+        if ((s = sdscatlen(c->buf,(void*)buf,len)) == NULL) return ANET_ERR;
+        c->buf = s;
+        conn->outlen += len;
+        return ANET_OK;
+    }
+    if ((s = sdsnewlen(buf,len)) == NULL) return ANET_ERR;
+    if (anetConnWriteSds(conn,s) == ANET_ERR) return ANET_ERR;
+    return ANET_OK;
+}
+
+/**
+ * queue s for writing without copying it: the connection takes ownership
+ * of s, that is freed once written, even on error.
+ */
+int anetConnWriteSds(anetConn *conn, sds s)
+{
+    anetConnChunk *c;
+
+    if (sdslen(s) == 0) {
+        sdsfree(s);
+        return ANET_OK;
+    }
+    if ((c = zmalloc(sizeof(*c))) == NULL) {
+        sdsfree(s);
+        return ANET_ERR;
+    }
+    c->buf = s;
+    return anetConnQueue(conn,c);
+}
+
+/* Remove the first len bytes of the input buffer, once parsed */
+void anetConnConsume(anetConn *conn, size_t len)
+{
+    size_t buflen = sdslen(conn->inbuf);
+
+    if (len >= buflen) sdsIncrLen(conn->inbuf,-(ssize_t)buflen);
+    else if (len) sdsrange(conn->inbuf,len,-1);
+}
@@ -31,17 +31,121 @@
 #ifndef ANET_H
 #define ANET_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "sds.h"
+#include "ae.h"
+
 #define ANET_OK 0
 #define ANET_ERR -1
 #define ANET_ERR_LEN 256
+#define ANET_IP_LEN 46 /* INET6_ADDRSTRLEN, room for any textual ip */
+#define ANET_BACKLOG 511 /* listen() backlog if somaxconn is unknown */
+#define ANET_IOBUF_LEN (1024*16) /* minimum room for every read */
+#define ANET_SPLICE_LEN (1024*64) /* bytes moved into the pipe at once */
+#define ANET_ZEROCOPY_MIN (1024*16) /* smaller sends are just copied */
+#define ANET_CONN_CHUNK (1024*16) /* smaller writes are coalesced */
+#define ANET_CONN_IOV 64 /* output chunks written with a single writev() */
+#define ANET_CONN_MAXINPUT (1024*1024*1024) /* default input buffer limit */
+
+/* anetConn flags */
+#define ANET_CONN_IN_HANDLER 1 /* calling a proc of the connection */
+#define ANET_CONN_CLOSED 2 /* anetConnClose() called by a proc */
+#define ANET_CONN_WRITABLE 4 /* the writable event is registered */
+
+/* Socket to socket relay through a pipe, see anetSplice() */
+typedef struct anetRelay {
+    int pipe[2];
+    size_t pending; /* bytes read from the source still in the pipe */
+} anetRelay;
+
+/* Called when anetTransferFile() is done, status is ANET_OK or ANET_ERR */
+typedef void anetTransferProc(aeEventLoop *eventLoop, int fd, void *clientData,
+        int status);
+
+/* Buffered non blocking connection, see anetConnCreate() */
+typedef struct anetConn anetConn;
+typedef void anetConnProc(anetConn *conn);
+
+typedef struct anetConnChunk {
+    sds buf;
+    struct anetConnChunk *next;
+} anetConnChunk;
+
+struct anetConn {
+    aeEventLoop *eventLoop;
+    int fd;
+    int flags;
+    sds inbuf; /* data read and not consumed yet */
+    size_t maxinput; /* the connection is closed if inbuf grows past it */
+    anetConnChunk *head, *tail; /* output queue */
+    size_t sentlen; /* bytes of the head chunk already written */
+    size_t outlen; /* bytes queued and not written yet */
+    anetConnProc *readProc; /* called when inbuf has new data */
+    anetConnProc *closeProc; /* called on EOF or error, before the release */
+    void *privdata;
+    char err[ANET_ERR_LEN]; /* why the connection was closed, if empty EOF */
+};
+
+/* Releases a buffer once the kernel is done with it, see anetZeroCopy */
+typedef void anetZeroCopyFreeProc(void *ptr);
+
+typedef struct anetZeroCopyHold {
+    unsigned int id; /* the last send that may reference ptr */
+    anetZeroCopyFreeProc *proc;
+    void *ptr;
+    struct anetZeroCopyHold *next;
+} anetZeroCopyHold;
+
+/* MSG_ZEROCOPY state of a socket */
+typedef struct anetZeroCopy {
+    aeEventLoop *eventLoop;
+    int fd;
+    int enabled; /* zero if the socket can't send without copying */
+    size_t minlen; /* sends shorter than this are copied */
+    unsigned int next; /* id the kernel gives to the next zerocopy send */
+    unsigned int completed; /* sends with a lower id were completed */
+    unsigned long long copied; /* zerocopy sends the kernel copied anyway */
+    anetZeroCopyHold *head, *tail; /* buffers to release, oldest first */
+} anetZeroCopy;
 
 int anetTcpConnect(char *err, char *addr, int port);
 int anetTcpNonBlockConnect(char *err, char *addr, int port);
+int anetUnixConnect(char *err, char *path);
+int anetUnixNonBlockConnect(char *err, char *path);
 int anetRead(int fd, char *buf, int count);
-int anetResolve(char *err, char *host, char *ipbuf);
-int anetTcpServer(char *err, int port, char *bindaddr);
-int anetAccept(char *err, int serversock, char *ip, int *port);
+int anetResolve(char *err, char *host, char *ipbuf, size_t ipbuf_len);
+int anetTcpServer(char *err, int port, char *bindaddr, int backlog);
+int anetTcpReusePortServer(char *err, int port, char *bindaddr, int backlog);
+int anetUnixServer(char *err, char *path, mode_t perm, int backlog);
+int anetSomaxconn(void);
+int anetAccept(char *err, int serversock, char *ip, size_t ip_len, int *port);
+int anetAcceptBatch(char *err, int serversock, int *fds, int max);
+int anetPeerToString(char *err, int fd, char *ip, size_t ip_len, int *port);
+int anetUnixAccept(char *err, int serversock);
 int anetWrite(int fd, char *buf, int count);
+ssize_t anetReadToEagain(char *err, int fd, sds *buf, size_t limit, int *eof);
+ssize_t anetWriteToEagain(char *err, int fd, sds buf);
+ssize_t anetSendFile(char *err, int sock, int filefd, off_t *offset, size_t count);
+int anetTransferFile(aeEventLoop *eventLoop, int sock, int filefd, off_t offset,
+        size_t count, anetTransferProc *proc, void *clientData);
+anetZeroCopy *anetZeroCopyCreate(char *err, aeEventLoop *eventLoop, int fd);
+void anetZeroCopyFree(anetZeroCopy *zc);
+ssize_t anetZeroCopyWrite(char *err, anetZeroCopy *zc, char *buf, size_t len);
+void anetZeroCopyRelease(anetZeroCopy *zc, anetZeroCopyFreeProc *proc, void *ptr);
+int anetZeroCopyPending(anetZeroCopy *zc);
+void anetZeroCopyReap(anetZeroCopy *zc);
+anetConn *anetConnCreate(char *err, aeEventLoop *eventLoop, int fd,
+        anetConnProc *readProc, anetConnProc *closeProc, void *privdata);
+void anetConnClose(anetConn *conn);
+int anetConnWrite(anetConn *conn, const void *buf, size_t len);
+int anetConnWriteSds(anetConn *conn, sds s);
+void anetConnConsume(anetConn *conn, size_t len);
+int anetRelayInit(char *err, anetRelay *relay);
+void anetRelayFree(anetRelay *relay);
+ssize_t anetSplice(char *err, anetRelay *relay, int from, int to, int *eof);
+ssize_t anetWritev(char *err, int fd, struct iovec **iov, int *iovcnt);
+ssize_t anetReadv(char *err, int fd, struct iovec **iov, int *iovcnt, int *eof);
 int anetNonBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
 int anetTcpKeepAlive(char *err, int fd);
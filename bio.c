@@ -0,0 +1,282 @@
+/* Background I/O service.
+ *
+ * This file implements operations that we need to perform in the background.
+ * Currently there are three: closing files (the close(2) of the last
+ * reference to an unlinked file can take a long time), fsync(2), and
+ * releasing large objects. They are slow system calls that would block every
+ * client if performed inline in an event handler.
+ *
+ * DESIGN
+ * ------
+ *
+ * The design is trivial, we have a structure representing a job to perform
+ * and a different thread and job queue for every job type. Every thread
+ * waits for new jobs in its queue, and processes every job sequentially.
+ * Jobs of the same type are guaranteed to be processed from the least
+ * recently inserted to the most recently inserted (older jobs processed
+ * first).
+ *
+ * Creating a job only costs the event loop a mutex and a queue insertion.
+ * When the job is done the thread posts a task (see aePostTask()) to the
+ * event loop that created it, so the completion callback runs in the
+ * thread of the loop like any other event handler.
+ *
+ * Only the number of threads is fixed, the queues are not: to give some
+ * backpressure a type with BIO_MAX_PENDING jobs refuses new ones, and the
+ * caller is expected to perform the operation inline.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "bio.h"
+#include "adlist.h"
+#include "zmalloc.h"
+#include "config.h"
+
+static pthread_t bio_threads[BIO_NUM_OPS];
+static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
+static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
+static list *bio_jobs[BIO_NUM_OPS];
+/* Jobs queued or in progress for every type: the thread removes a job
+ * from the queue when it starts it, but decrements this only when done.
+ * New jobs are refused past BIO_MAX_PENDING. */
+static unsigned long long bio_pending[BIO_NUM_OPS];
+static int bio_started = 0;
+static int bio_stop[BIO_NUM_OPS];
+
+/* This structure represents a background Job. It is only used locally to
+ * this file as the API does not expose the internals at all. */
+struct bio_job {
+    int type;
+    int fd; /* BIO_CLOSE_FILE and BIO_FSYNC */
+    bioFreeProc *freeProc; /* BIO_FREE */
+    void *ptr;
+    int result; /* 0 or errno */
+    aeEventLoop *eventLoop; /* loop to notify, NULL if none */
+    bioDoneProc *done;
+    void *clientData;
+};
+
+static void *bioProcessBackgroundJobs(void *arg);
+
+/* Initialize the background system, spawning the threads. */
+void bioInit(void) {
+    int j;
+
+    if (bio_started) return;
+    /* Jobs are allocated by the loop and released by the threads */
+    zmalloc_enable_thread_safeness();
+    for (j = 0; j < BIO_NUM_OPS; j++) {
+        bio_stop[j] = 0;
+        pthread_mutex_init(&bio_mutex[j],NULL);
+        pthread_cond_init(&bio_newjob_cond[j],NULL);
+        bio_jobs[j] = listCreate();
+        bio_pending[j] = 0;
+    }
+    for (j = 0; j < BIO_NUM_OPS; j++) {
+        if (pthread_create(&bio_threads[j],NULL,bioProcessBackgroundJobs,
+                (void*)(long)j) != 0) {
+            fprintf(stderr,"Fatal: Can't initialize Background Jobs.\n");
+            exit(1);
+        }
+    }
+    bio_started = 1;
+}
+
+/* Queue a job, that is released on failure: bioInit() was not called or
+ * BIO_MAX_PENDING jobs of the same type are already pending. */
+static int bioSubmitJob(struct bio_job *job) {
+    int type = job->type;
+
+    if (!bio_started) {
+        zfree(job);
+        return AE_ERR;
+    }
+    pthread_mutex_lock(&bio_mutex[type]);
+    if (bio_pending[type] >= BIO_MAX_PENDING ||
+        listAddNodeTail(bio_jobs[type],job) == NULL) {
+        pthread_mutex_unlock(&bio_mutex[type]);
+        zfree(job);
+        return AE_ERR;
+    }
+    bio_pending[type]++;
+    pthread_cond_signal(&bio_newjob_cond[type]);
+    pthread_mutex_unlock(&bio_mutex[type]);
+    return AE_OK;
+}
+
+static struct bio_job *bioNewJob(int type, aeEventLoop *eventLoop,
+        bioDoneProc *done, void *clientData)
+{
+    struct bio_job *job = zmalloc(sizeof(*job));
+
+    if (!job) return NULL;
+    job->type = type;
+    job->fd = -1;
+    job->freeProc = NULL;
+    job->ptr = NULL;
+    job->result = 0;
+    job->eventLoop = done ? eventLoop : NULL;
+    job->done = done;
+    job->clientData = clientData;
+    return job;
+}
+
+/* Close 'fd' in background. If 'done' is not NULL it is called in the
+ * thread of 'eventLoop' once the file is closed. Returns AE_ERR if the job
+ * can't be queued (see bioSubmitJob()), the fd is then still open. */
+int bioCreateCloseJob(int fd, aeEventLoop *eventLoop, bioDoneProc *done,
+        void *clientData)
+{
+    struct bio_job *job = bioNewJob(BIO_CLOSE_FILE,eventLoop,done,clientData);
+
+    if (!job) return AE_ERR;
+    job->fd = fd;
+    return bioSubmitJob(job);
+}
+
+/* Flush 'fd' to disk in background, see bioCreateCloseJob(). */
+int bioCreateFsyncJob(int fd, aeEventLoop *eventLoop, bioDoneProc *done,
+        void *clientData)
+{
+    struct bio_job *job = bioNewJob(BIO_FSYNC,eventLoop,done,clientData);
+
+    if (!job) return AE_ERR;
+    job->fd = fd;
+    return bioSubmitJob(job);
+}
+
+/* Call freeProc(ptr) in background. The object must not be referenced by
+ * the main thread anymore. */
+int bioCreateFreeJob(bioFreeProc *freeProc, void *ptr, aeEventLoop *eventLoop,
+        bioDoneProc *done, void *clientData)
+{
+    struct bio_job *job = bioNewJob(BIO_FREE,eventLoop,done,clientData);
+
+    if (!job) return AE_ERR;
+    job->freeProc = freeProc;
+    job->ptr = ptr;
+    return bioSubmitJob(job);
+}
+
+/* Runs in the thread of the event loop that created the job. */
+static void bioJobDone(aeEventLoop *eventLoop, void *arg) {
+    struct bio_job *job = arg;
+
+    job->done(eventLoop,job->type,job->result,job->clientData);
+    zfree(job);
+}
+
+static void *bioProcessBackgroundJobs(void *arg) {
+    int type = (int)(long)arg;
+    struct bio_job *job;
+
+    pthread_mutex_lock(&bio_mutex[type]);
+    while(1) {
+        listNode *ln;
+
+        /* The loop always starts with the lock hold. */
+        if (listLength(bio_jobs[type]) == 0) {
+            if (bio_stop[type]) break;
+            pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
+            continue;
+        }
+        /* Pop the job from the queue. */
+        ln = listFirst(bio_jobs[type]);
+        job = ln->value;
+        listDelNode(bio_jobs[type],ln);
+        /* It is now possible to unlock the background system as we know
+         * have a stand alone job structure to process.*/
+        pthread_mutex_unlock(&bio_mutex[type]);
+
+        /* Process the job accordingly to its type. */
+        if (type == BIO_CLOSE_FILE) {
+            if (close(job->fd) == -1) job->result = errno;
+        } else if (type == BIO_FSYNC) {
+            if (redis_fsync(job->fd) == -1) job->result = errno;
+        } else if (type == BIO_FREE) {
+            job->freeProc(job->ptr);
+        }
+
+        if (job->eventLoop) {
+            /* Retry if memory is short: the completion can't be lost. */
+            while (aePostTask(job->eventLoop,bioJobDone,job) == AE_ERR)
+                sched_yield();
+        } else {
+            zfree(job);
+        }
+
+        /* Lock again before reiterating the loop, if there are no longer
+         * jobs to process we'll block again in pthread_cond_wait(). */
+        pthread_mutex_lock(&bio_mutex[type]);
+        bio_pending[type]--;
+    }
+    pthread_mutex_unlock(&bio_mutex[type]);
+    return NULL;
+}
+
+/* Return the number of pending jobs of the specified type. */
+unsigned long long bioPendingJobsOfType(int type) {
+    unsigned long long val;
+
+    pthread_mutex_lock(&bio_mutex[type]);
+    val = bio_pending[type];
+    pthread_mutex_unlock(&bio_mutex[type]);
+    return val;
+}
+
+/* Stop the background threads once the jobs already queued are done, and
+ * wait for them to exit. Completions not yet delivered stay queued in the
+ * event loops. */
+void bioKillThreads(void) {
+    int j;
+
+    if (!bio_started) return;
+    for (j = 0; j < BIO_NUM_OPS; j++) {
+        pthread_mutex_lock(&bio_mutex[j]);
+        bio_stop[j] = 1;
+        pthread_cond_signal(&bio_newjob_cond[j]);
+        pthread_mutex_unlock(&bio_mutex[j]);
+    }
+    for (j = 0; j < BIO_NUM_OPS; j++) {
+        pthread_join(bio_threads[j],NULL);
+        listRelease(bio_jobs[j]);
+        pthread_mutex_destroy(&bio_mutex[j]);
+        pthread_cond_destroy(&bio_newjob_cond[j]);
+    }
+    bio_started = 0;
+}
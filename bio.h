@@ -0,0 +1,64 @@
+/* Background I/O service, see bio.c.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __BIO_H
+#define __BIO_H
+
+#include "ae.h"
+
+/* Background job opcodes */
+#define BIO_CLOSE_FILE 0 /* Deferred close(2) syscall. */
+#define BIO_FSYNC 1 /* Deferred fsync(2) (fdatasync(2) on Linux). */
+#define BIO_FREE 2 /* Deferred release of a large object. */
+#define BIO_NUM_OPS 3
+
+/* Jobs queued or in progress for every type. Past this the create functions
+ * fail and the caller should do the work itself: a disk slower than the
+ * rate of jobs would otherwise let the queue grow without limit. */
+#define BIO_MAX_PENDING (1024*64)
+
+/* Called in the thread of the event loop that created the job when it is
+ * done. 'result' is 0 on success, an errno value otherwise. */
+typedef void bioDoneProc(aeEventLoop *eventLoop, int type, int result,
+        void *clientData);
+typedef void bioFreeProc(void *ptr);
+
+/* Exported API */
+void bioInit(void);
+int bioCreateCloseJob(int fd, aeEventLoop *eventLoop, bioDoneProc *done,
+        void *clientData);
+int bioCreateFsyncJob(int fd, aeEventLoop *eventLoop, bioDoneProc *done,
+        void *clientData);
+int bioCreateFreeJob(bioFreeProc *freeProc, void *ptr, aeEventLoop *eventLoop,
+        bioDoneProc *done, void *clientData);
+unsigned long long bioPendingJobsOfType(int type);
+void bioKillThreads(void);
+
+#endif
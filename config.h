@@ -0,0 +1,62 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#ifdef __APPLE__
+#include <AvailabilityMacros.h>
+#endif
+
+/* test for malloc_size() */
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#define HAVE_MALLOC_SIZE 1
+#define redis_malloc_size(p) malloc_size(p)
+#endif
+
+/* test for polling API. Define AE_USE_POLL to skip epoll, for instance
+ * where a seccomp profile doesn't allow it. */
+#if defined(__linux__) && !defined(AE_USE_POLL)
+#define HAVE_EPOLL 1
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POLL 1
+#endif
+
+/* test for io_uring, the kernel may still refuse it at runtime */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+/* Define redis_fsync to fdatasync() in Linux and fsync() for all the rest */
+#ifdef __linux__
+#define redis_fsync fdatasync
+#else
+#define redis_fsync fsync
+#endif
+
+/* test for eventfd(), signalfd() and timerfd_create() */
+#ifdef __linux__
+#define HAVE_EVENTFD 1
+#define HAVE_SIGNALFD 1
+#define HAVE_TIMERFD 1
+#endif
+
+/* test for sendfile() and splice() */
+#ifdef __linux__
+#define HAVE_SENDFILE 1
+#define HAVE_SPLICE 1
+#endif
+
+/* test for MSG_ZEROCOPY */
+#ifdef __linux__
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+
+/* test for accept4() */
+#if defined(__linux__) || defined(__FreeBSD__)
+#define HAVE_ACCEPT4 1
+#endif
+
+#endif
@@ -0,0 +1,390 @@
+/* coro.c -- Stackful coroutines running on top of the ae event loop
+ *
+ * A coroutine is a function running on a stack of its own that can be
+ * suspended and resumed later. aeCoRead(), aeCoWrite(), aeCoWait() and
+ * aeCoSleep() look like blocking calls, but they register the right ae
+ * event and suspend the coroutine: the loop goes on serving the other
+ * clients, and resumes the coroutine from the event handler. So protocol
+ * code can be written as plain sequential code instead of a state machine
+ * spread across callbacks, while thousands of sessions share one loop.
+ *
+ * Coroutines belong to the thread (and so to the event loop) that started
+ * them. Stacks are mmap()ed with a guard page below them, so an overflow
+ * crashes instead of silently corrupting the memory of somebody else, and
+ * are pooled per thread. On x86_64 switching coroutine only saves and
+ * restores the callee saved registers, elsewhere (or building with
+ * AE_CO_USE_UCONTEXT) it falls back to swapcontext(3), which also enters
+ * the kernel to switch the signal mask.
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if !defined(__x86_64__) && !defined(AE_CO_USE_UCONTEXT)
+#define AE_CO_USE_UCONTEXT
+#endif
+#ifdef AE_CO_USE_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#include "ae.h"
+#include "coro.h"
+#include "zmalloc.h"
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+struct aeCoroutine {
+    aeEventLoop *eventLoop;
+    aeCoProc *proc;
+    void *arg;
+    char *stack; /* mapping: the guard page, then the stack */
+#ifdef AE_CO_USE_UCONTEXT
+    ucontext_t ctx, callerctx;
+#else
+    void *sp; /* stack pointer of the suspended coroutine */
+    void *callersp; /* stack pointer of who resumed it */
+#endif
+    long long timer; /* time event id of the pending wait, -1 if none */
+    int fired; /* mask that ended the last wait, 0 on timeout */
+    int done;
+    struct aeCoroutine *prev, *next; /* eventLoop->coroutines list */
+};
+
+/* Running coroutine, NULL when the thread runs on its own stack */
+static __thread aeCoroutine *aeCoCurrent = NULL;
+static __thread char *aeCoStacks[AE_CO_POOL_SIZE];
+static __thread int aeCoStacksCount = 0;
+
+static size_t aeCoPageSize(void) {
+    static size_t pagesize = 0;
+
+    if (pagesize == 0) pagesize = sysconf(_SC_PAGESIZE);
+    return pagesize;
+}
+
+/* Returns the base of the mapping, the stack starts one page above it */
+static char *aeCoStackAlloc(void) {
+    size_t page = aeCoPageSize();
+    char *stack;
+
+    if (aeCoStacksCount) return aeCoStacks[--aeCoStacksCount];
+    stack = mmap(NULL, AE_CO_STACK_SIZE+page, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) return NULL;
+    if (mprotect(stack, page, PROT_NONE) == -1) {
+        munmap(stack, AE_CO_STACK_SIZE+page);
+        return NULL;
+    }
+    return stack;
+}
+
+static void aeCoStackFree(char *stack) {
+    if (aeCoStacksCount < AE_CO_POOL_SIZE)
+        aeCoStacks[aeCoStacksCount++] = stack;
+    else
+        munmap(stack, AE_CO_STACK_SIZE+aeCoPageSize());
+}
+
+/* ----------------------------------------------------------------------------
+ * Context switch
+ * ------------------------------------------------------------------------- */
+
+static void aeCoEntry(void);
+
+#ifndef AE_CO_USE_UCONTEXT
+/* void aeCoSwitch(void **sp, void *to)
+ *
+ * Push the callee saved registers on the current stack, save the stack
+ * pointer in *sp, then switch to the stack 'to' and pop the registers the
+ * same way. Caller saved registers are already saved by the compiler
+ * around the call. The floating point control state (MXCSR and the x87
+ * control word: rounding mode, exception masks) is callee saved too, and
+ * goes in one more 8 bytes slot below the registers. */
+void aeCoSwitch(void **sp, void *to);
+__asm__ (
+    ".text\n"
+    ".globl aeCoSwitch\n"
+    ".hidden aeCoSwitch\n"
+    ".type aeCoSwitch,@function\n"
+    "aeCoSwitch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size aeCoSwitch,.-aeCoSwitch\n"
+);
+
+/* Lay out the new stack as if aeCoSwitch() had been called from the start
+ * of aeCoEntry(): the floating point control state, six registers to pop,
+ * then the address to return to. The coroutine starts with the control
+ * state of its creator. */
+static int aeCoMakeContext(aeCoroutine *co) {
+    void **top = (void**)(co->stack + aeCoPageSize() + AE_CO_STACK_SIZE);
+    int j;
+
+    *--top = NULL; /* aeCoEntry() never returns, keep the ABI alignment */
+    *--top = (void*)aeCoEntry;
+    for (j = 0; j < 6; j++) *--top = NULL;
+    *--top = NULL;
+    __asm__ volatile ("stmxcsr (%0)\n\tfnstcw 4(%0)" : : "r" (top) : "memory");
+    co->sp = top;
+    return 0;
+}
+
+static void aeCoSwitchIn(aeCoroutine *co) {
+    aeCoSwitch(&co->callersp, co->sp);
+}
+
+static void aeCoSwitchOut(aeCoroutine *co) {
+    aeCoSwitch(&co->sp, co->callersp);
+}
+#else
+static int aeCoMakeContext(aeCoroutine *co) {
+    if (getcontext(&co->ctx) == -1) return -1;
+    co->ctx.uc_stack.ss_sp = co->stack + aeCoPageSize();
+    co->ctx.uc_stack.ss_size = AE_CO_STACK_SIZE;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, aeCoEntry, 0);
+    return 0;
+}
+
+static void aeCoSwitchIn(aeCoroutine *co) {
+    swapcontext(&co->callerctx, &co->ctx);
+}
+
+static void aeCoSwitchOut(aeCoroutine *co) {
+    swapcontext(&co->ctx, &co->callerctx);
+}
+#endif
+
+static void aeCoEntry(void) {
+    aeCoroutine *co = aeCoCurrent;
+
+    co->proc(co, co->arg);
+    co->done = 1;
+    aeCoSwitchOut(co); /* never comes back */
+}
+
+/* Run the coroutine until it suspends or returns. The caller may be the
+ * thread itself or another coroutine, suspending goes back to it. */
+static void aeCoResume(aeCoroutine *co) {
+    aeCoroutine *caller = aeCoCurrent;
+
+    aeCoCurrent = co;
+    aeCoSwitchIn(co);
+    aeCoCurrent = caller;
+    /* Can't release the stack we are running on: do it from here */
+    if (co->done) {
+        if (co->prev) co->prev->next = co->next;
+        else co->eventLoop->coroutines = co->next;
+        if (co->next) co->next->prev = co->prev;
+        aeCoStackFree(co->stack);
+        zfree(co);
+    }
+}
+
+/* Called by aeDeleteEventLoop(): the coroutines still suspended waiting
+ * for its events will never be resumed, release their stacks. Whatever
+ * they hold on their stacks is lost, the events go with the loop. So the
+ * loop can't be deleted from one of its own coroutines. */
+static void aeCoFreeAll(aeEventLoop *eventLoop) {
+    aeCoroutine *co = eventLoop->coroutines, *next;
+
+    while (co) {
+        next = co->next;
+        aeCoStackFree(co->stack);
+        zfree(co);
+        co = next;
+    }
+    eventLoop->coroutines = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public API
+ * ------------------------------------------------------------------------- */
+
+/* Create a coroutine running proc(co,arg) on the event loop and run it
+ * until the first time it waits: it may even be over when aeCoStart()
+ * returns. Must be called from the thread of the event loop. */
+int aeCoStart(aeEventLoop *eventLoop, aeCoProc *proc, void *arg) {
+    aeCoroutine *co = zmalloc(sizeof(*co));
+
+    if (!co) return AE_ERR;
+    co->eventLoop = eventLoop;
+    co->proc = proc;
+    co->arg = arg;
+    co->timer = -1;
+    co->fired = 0;
+    co->done = 0;
+    if ((co->stack = aeCoStackAlloc()) == NULL) {
+        zfree(co);
+        return AE_ERR;
+    }
+    if (aeCoMakeContext(co) == -1) {
+        aeCoStackFree(co->stack);
+        zfree(co);
+        return AE_ERR;
+    }
+    co->prev = NULL;
+    co->next = eventLoop->coroutines;
+    if (co->next) co->next->prev = co;
+    eventLoop->coroutines = co;
+    eventLoop->coFree = aeCoFreeAll;
+    aeCoResume(co);
+    return AE_OK;
+}
+
+aeEventLoop *aeCoGetLoop(aeCoroutine *co) {
+    return co->eventLoop;
+}
+
+static void aeCoFileReady(aeEventLoop *eventLoop, int fd, void *clientData,
+        int mask)
+{
+    aeCoroutine *co = clientData;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+
+    co->fired = mask;
+    aeCoResume(co);
+}
+
+static int aeCoTimeout(aeEventLoop *eventLoop, long long id, void *clientData) {
+    aeCoroutine *co = clientData;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+
+    co->timer = -1;
+    co->fired = 0;
+    aeCoResume(co);
+    return AE_NOMORE;
+}
+
+/* Suspend the coroutine until the fd is ready for one of the events in
+ * 'mask', or at most 'milliseconds' (forever if <= 0). Returns the mask of
+ * the events that fired, 0 on timeout, -1 if the fd can't be waited, with
+ * errno set to EBUSY if one of the events already has a handler. */
+int aeCoWait(aeCoroutine *co, int fd, int mask, long long milliseconds) {
+    aeEventLoop *el = co->eventLoop;
+
+    co->fired = 0;
+    /* The handler is ours until we resume: don't steal the one of some
+     * other owner of the fd, and delete it afterwards. */
+    if (aeGetFileEvents(el, fd) & mask) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (aeCreateFileEvent(el, fd, mask, aeCoFileReady, co, NULL) == AE_ERR)
+        return -1;
+    if (milliseconds > 0) {
+        co->timer = aeCreateTimeEvent(el, milliseconds, aeCoTimeout, co, NULL);
+        if (co->timer == AE_ERR) {
+            aeDeleteFileEvent(el, fd, mask);
+            return -1;
+        }
+    }
+    aeCoSwitchOut(co);
+    aeDeleteFileEvent(el, fd, mask);
+    if (co->timer != -1) {
+        aeDeleteTimeEvent(el, co->timer);
+        co->timer = -1;
+    }
+    return co->fired;
+}
+
+/* Suspend the coroutine for the given time */
+void aeCoSleep(aeCoroutine *co, long long milliseconds) {
+    co->timer = aeCreateTimeEvent(co->eventLoop, milliseconds, aeCoTimeout,
+            co, NULL);
+    if (co->timer == AE_ERR) {
+        co->timer = -1;
+        return;
+    }
+    aeCoSwitchOut(co);
+}
+
+/* Like read(2) on a non blocking fd, but instead of failing with EAGAIN
+ * suspend the coroutine until some data arrives. Returns the bytes read,
+ * 0 on EOF, -1 on error. */
+int aeCoRead(aeCoroutine *co, int fd, void *buf, int count) {
+    ssize_t nread;
+
+    while (1) {
+        nread = read(fd, buf, count);
+        if (nread >= 0) return nread;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN) return -1;
+        if (aeCoWait(co, fd, AE_READABLE, 0) == -1) return -1;
+    }
+}
+
+/* Write all the 'count' bytes to a non blocking fd, suspending the
+ * coroutine every time the socket buffer is full. Returns count, or -1
+ * on error. */
+int aeCoWrite(aeCoroutine *co, int fd, const void *buf, int count) {
+    const char *p = buf;
+    int totlen = 0;
+    ssize_t nwritten;
+
+    while (totlen != count) {
+        nwritten = write(fd, p+totlen, count-totlen);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return -1;
+            if (aeCoWait(co, fd, AE_WRITABLE, 0) == -1) return -1;
+            continue;
+        }
+        totlen += nwritten;
+    }
+    return totlen;
+}
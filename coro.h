@@ -0,0 +1,53 @@
+/* coro.c -- Stackful coroutines running on top of the ae event loop
+ *
+ * Copyright (c) 2006-2009, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include "ae.h"
+
+/* Usable stack of every coroutine, a guard page is added below it */
+#ifndef AE_CO_STACK_SIZE
+#define AE_CO_STACK_SIZE (64*1024)
+#endif
+#define AE_CO_POOL_SIZE 256 /* free stacks kept around by every thread */
+
+typedef struct aeCoroutine aeCoroutine;
+typedef void aeCoProc(aeCoroutine *co, void *arg);
+
+/* Prototypes */
+int aeCoStart(aeEventLoop *eventLoop, aeCoProc *proc, void *arg);
+aeEventLoop *aeCoGetLoop(aeCoroutine *co);
+int aeCoWait(aeCoroutine *co, int fd, int mask, long long milliseconds);
+void aeCoSleep(aeCoroutine *co, long long milliseconds);
+int aeCoRead(aeCoroutine *co, int fd, void *buf, int count);
+int aeCoWrite(aeCoroutine *co, int fd, const void *buf, int count);
+
+#endif
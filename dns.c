@@ -0,0 +1,404 @@
+/* Asynchronous DNS resolution.
+ *
+ * getaddrinfo() blocks for as long as the resolver takes to answer, that
+ * can be seconds: called from an event handler it would freeze every
+ * client of the loop. dnsResolve() hands the lookup to a pool of resolver
+ * threads and returns at once, the callback is called later in the thread
+ * of the event loop (through aePostTask()) with the address of the host.
+ *
+ * Results are cached for a fixed TTL (getaddrinfo() doesn't report the TTL
+ * of the records), failures for a shorter time, so that hot hosts are only
+ * resolved once in a while. Concurrent requests for the same host share a
+ * single lookup. IP addresses are never sent to the threads at all.
+ *
+ * The cache and the job queue are protected by a single mutex: it is only
+ * held for a hash table lookup or a queue insertion, never during a lookup.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
+
+#include "dns.h"
+#include "anet.h"
+#include "adlist.h"
+#include "sds.h"
+#include "zmalloc.h"
+
+/* A callback waiting for a lookup in progress */
+typedef struct dnsWaiter {
+    aeEventLoop *eventLoop;
+    dnsResolveProc *proc;
+    void *clientData;
+    struct dnsWaiter *next;
+    char host[]; /* as given by the caller */
+} dnsWaiter;
+
+/* A cached host, or one being resolved */
+typedef struct dnsEntry {
+    sds host; /* lower case */
+    char ip[ANET_IP_LEN];
+    int status;
+    int pending; /* lookup in progress: the entry can't be evicted */
+    long long expire; /* milliseconds, monotonic clock */
+    dnsWaiter *waiters; /* callbacks to call once resolved */
+    struct dnsEntry *next; /* next entry of the same bucket */
+} dnsEntry;
+
+/* Result on its way to the thread of an event loop */
+typedef struct dnsResult {
+    dnsResolveProc *proc;
+    void *clientData;
+    int status;
+    char ip[ANET_IP_LEN];
+    char host[]; /* NUL terminated */
+} dnsResult;
+
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_newjob_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *dns_threads;
+static int dns_numthreads = 0;
+static int dns_started = 0;
+static int dns_stop = 0;
+static long long dns_ttl;
+static list *dns_jobs; /* entries to resolve */
+static dnsEntry *dns_table[DNS_CACHE_BUCKETS];
+static int dns_entries = 0;
+
+static void *dnsProcessJobs(void *arg);
+
+static long long dnsMstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static unsigned int dnsHash(const char *host) {
+    unsigned int hash = 5381;
+
+    while (*host) hash = (hash << 5) + hash + (unsigned char)*host++;
+    return hash & (DNS_CACHE_BUCKETS-1);
+}
+
+/* Initialize the resolver, spawning 'numthreads' threads (DNS_THREADS if
+ * zero). Results are cached for 'ttl' milliseconds (DNS_TTL if zero). */
+void dnsInit(int numthreads, long long ttl) {
+    int j;
+
+    if (dns_started) return;
+    /* Jobs and results are allocated and released by different threads */
+    zmalloc_enable_thread_safeness();
+    dns_numthreads = numthreads > 0 ? numthreads : DNS_THREADS;
+    dns_ttl = ttl > 0 ? ttl : DNS_TTL;
+    dns_stop = 0;
+    dns_jobs = listCreate();
+    dns_threads = zmalloc(sizeof(pthread_t)*dns_numthreads);
+    if (dns_jobs == NULL || dns_threads == NULL) {
+        fprintf(stderr,"Fatal: Can't initialize the DNS resolver.\n");
+        exit(1);
+    }
+    for (j = 0; j < dns_numthreads; j++) {
+        if (pthread_create(&dns_threads[j],NULL,dnsProcessJobs,NULL) != 0) {
+            fprintf(stderr,"Fatal: Can't initialize the DNS resolver.\n");
+            exit(1);
+        }
+    }
+    dns_started = 1;
+}
+
+/* Runs in the thread of the event loop that asked for the resolution. */
+static void dnsDeliver(aeEventLoop *eventLoop, void *arg) {
+    dnsResult *res = arg;
+
+    res->proc(eventLoop,res->status,res->host,res->ip,res->clientData);
+    zfree(res);
+}
+
+static int dnsPost(aeEventLoop *eventLoop, dnsResolveProc *proc,
+        void *clientData, int status, const char *host, const char *ip)
+{
+    size_t hostlen = strlen(host);
+    dnsResult *res = zmalloc(sizeof(*res)+hostlen+1);
+
+    if (res == NULL) return DNS_ERR;
+    res->proc = proc;
+    res->clientData = clientData;
+    res->status = status;
+    strcpy(res->ip,ip);
+    memcpy(res->host,host,hostlen+1);
+    if (aePostTask(eventLoop,dnsDeliver,res) == AE_ERR) {
+        zfree(res);
+        return DNS_ERR;
+    }
+    return DNS_OK;
+}
+
+static void dnsFreeEntry(dnsEntry *de) {
+    sdsfree(de->host);
+    zfree(de);
+}
+
+/* Remove the entries that are not pending, only the expired ones unless
+ * 'all' is set. Called with the mutex held. */
+static void dnsEvict(int all, long long now) {
+    int j;
+
+    for (j = 0; j < DNS_CACHE_BUCKETS; j++) {
+        dnsEntry **pde = &dns_table[j];
+
+        while (*pde) {
+            dnsEntry *de = *pde;
+
+            if (de->pending || (!all && de->expire > now)) {
+                pde = &de->next;
+                continue;
+            }
+            *pde = de->next;
+            dnsFreeEntry(de);
+            dns_entries--;
+        }
+    }
+}
+
+/* Make room for a new entry: drop the expired ones first, then whatever
+ * can be dropped if the cache is still full. Called with the mutex held. */
+static void dnsMakeRoom(long long now) {
+    int j;
+
+    if (dns_entries < DNS_CACHE_MAX) return;
+    dnsEvict(0,now);
+    for (j = 0; j < DNS_CACHE_BUCKETS && dns_entries >= DNS_CACHE_MAX; j++) {
+        dnsEntry **pde = &dns_table[j];
+
+        while (*pde && dns_entries >= DNS_CACHE_MAX) {
+            dnsEntry *de = *pde;
+
+            if (de->pending) {
+                pde = &de->next;
+                continue;
+            }
+            *pde = de->next;
+            dnsFreeEntry(de);
+            dns_entries--;
+        }
+    }
+}
+
+/* Resolve 'host' without blocking: proc is called later, in the thread of
+ * 'eventLoop', with its address. The callback is never called before this
+ * function returns, not even for cached hosts or ip addresses.
+ *
+ * dnsInit() must be called first. Returns DNS_ERR (and proc will never be
+ * called) if the resolver is not initialized or memory is short. */
+int dnsResolve(aeEventLoop *eventLoop, const char *host, dnsResolveProc *proc,
+        void *clientData)
+{
+    unsigned char addr[sizeof(struct in6_addr)];
+    dnsEntry *de;
+    dnsWaiter *w;
+    unsigned int h;
+    long long now;
+    sds key;
+
+    if (!dns_started) return DNS_ERR;
+    /* Nothing to resolve for ip addresses */
+    if (inet_pton(AF_INET,host,addr) == 1 || inet_pton(AF_INET6,host,addr) == 1)
+        return strlen(host) < ANET_IP_LEN ?
+            dnsPost(eventLoop,proc,clientData,DNS_OK,host,host) : DNS_ERR;
+
+    if ((key = sdsnew(host)) == NULL) return DNS_ERR;
+    sdstolower(key);
+    h = dnsHash(key);
+    now = dnsMstime();
+    pthread_mutex_lock(&dns_mutex);
+    for (de = dns_table[h]; de; de = de->next)
+        if (sdscmp(de->host,key) == 0) break;
+
+    if (de && de->expire > now) {
+        /* Cache hit */
+        char ip[ANET_IP_LEN];
+        int status = de->status;
+
+        strcpy(ip,de->ip);
+        pthread_mutex_unlock(&dns_mutex);
+        sdsfree(key);
+        return dnsPost(eventLoop,proc,clientData,status,host,ip);
+    }
+
+    if ((w = zmalloc(sizeof(*w)+strlen(host)+1)) == NULL) goto err;
+    strcpy(w->host,host);
+    w->eventLoop = eventLoop;
+    w->proc = proc;
+    w->clientData = clientData;
+    if (de == NULL) {
+        /* Not cached yet */
+        dnsMakeRoom(now);
+        if ((de = zmalloc(sizeof(*de))) == NULL) {
+            zfree(w);
+            goto err;
+        }
+        de->host = key;
+        key = NULL;
+        de->ip[0] = '\0';
+        de->status = DNS_ERR;
+        de->pending = 0;
+        de->expire = 0;
+        de->waiters = NULL;
+        de->next = dns_table[h];
+        dns_table[h] = de;
+        dns_entries++;
+    }
+    if (!de->pending) {
+        /* New or expired: queue a lookup */
+        if (listAddNodeTail(dns_jobs,de) == NULL) {
+            zfree(w);
+            goto err;
+        }
+        de->pending = 1;
+        pthread_cond_signal(&dns_newjob_cond);
+    }
+    /* Else a lookup is already in progress: just wait for it */
+    w->next = de->waiters;
+    de->waiters = w;
+    pthread_mutex_unlock(&dns_mutex);
+    sdsfree(key);
+    return DNS_OK;
+
+err:
+    pthread_mutex_unlock(&dns_mutex);
+    sdsfree(key);
+    return DNS_ERR;
+}
+
+static void *dnsProcessJobs(void *arg) {
+    dnsEntry *de;
+    dnsWaiter *w;
+    char ip[ANET_IP_LEN];
+    int status;
+
+    (void)arg;
+    pthread_mutex_lock(&dns_mutex);
+    while(1) {
+        listNode *ln;
+
+        /* The loop always starts with the lock hold. */
+        if (listLength(dns_jobs) == 0) {
+            if (dns_stop) break;
+            pthread_cond_wait(&dns_newjob_cond,&dns_mutex);
+            continue;
+        }
+        ln = listFirst(dns_jobs);
+        de = ln->value;
+        listDelNode(dns_jobs,ln);
+        /* Pending entries are never evicted: de->host is safe to use
+         * without the lock. */
+        pthread_mutex_unlock(&dns_mutex);
+
+        status = anetResolve(NULL,de->host,ip,sizeof(ip)) == ANET_OK ?
+            DNS_OK : DNS_ERR;
+        if (status == DNS_ERR) ip[0] = '\0';
+
+        pthread_mutex_lock(&dns_mutex);
+        strcpy(de->ip,ip);
+        de->status = status;
+        de->expire = dnsMstime() + (status == DNS_OK ? dns_ttl :
+            (dns_ttl < DNS_NEGATIVE_TTL ? dns_ttl : DNS_NEGATIVE_TTL));
+        /* Waiters are pushed on the head: reverse them to call back in
+         * the order of the requests */
+        w = NULL;
+        while (de->waiters) {
+            dnsWaiter *next = de->waiters->next;
+
+            de->waiters->next = w;
+            w = de->waiters;
+            de->waiters = next;
+        }
+        pthread_mutex_unlock(&dns_mutex);
+
+        /* New requests are served by the cache from now on */
+        while (w) {
+            dnsWaiter *next = w->next;
+
+            while (dnsPost(w->eventLoop,w->proc,w->clientData,status,
+                    w->host,ip) == DNS_ERR)
+                sched_yield();
+            zfree(w);
+            w = next;
+        }
+
+        pthread_mutex_lock(&dns_mutex);
+        if (de->waiters) {
+            /* Requests that found the fresh result already expired (a
+             * very short TTL) while it was delivered: resolve again */
+            listAddNodeTail(dns_jobs,de);
+        } else {
+            de->pending = 0;
+        }
+    }
+    pthread_mutex_unlock(&dns_mutex);
+    return NULL;
+}
+
+/* Forget every cached host. Lookups in progress are not affected. */
+void dnsFlushCache(void) {
+    if (!dns_started) return;
+    pthread_mutex_lock(&dns_mutex);
+    dnsEvict(1,0);
+    pthread_mutex_unlock(&dns_mutex);
+}
+
+/* Stop the resolver threads once the lookups already queued are done, and
+ * wait for them to exit. Results not yet delivered stay queued in the
+ * event loops. */
+void dnsKillThreads(void) {
+    int j;
+
+    if (!dns_started) return;
+    pthread_mutex_lock(&dns_mutex);
+    dns_stop = 1;
+    pthread_cond_broadcast(&dns_newjob_cond);
+    pthread_mutex_unlock(&dns_mutex);
+    for (j = 0; j < dns_numthreads; j++)
+        pthread_join(dns_threads[j],NULL);
+    dnsEvict(1,0);
+    listRelease(dns_jobs);
+    zfree(dns_threads);
+    dns_started = 0;
+}
@@ -0,0 +1,58 @@
+/* Asynchronous DNS resolution, see dns.c.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __DNS_H
+#define __DNS_H
+
+#include "ae.h"
+
+#define DNS_OK 0
+#define DNS_ERR -1
+
+#define DNS_THREADS 2 /* resolver threads, if dnsInit() is given 0 */
+#define DNS_TTL 60000 /* milliseconds results are cached, if given 0 */
+#define DNS_NEGATIVE_TTL 5000 /* at most this long for failures */
+#define DNS_CACHE_BUCKETS 1024
+#define DNS_CACHE_MAX 4096 /* hosts cached */
+
+/* Called in the thread of the event loop that asked for the resolution.
+ * 'status' is DNS_OK or DNS_ERR, 'ip' is the textual address of the host
+ * (IPv4 or IPv6), the empty string on error. */
+typedef void dnsResolveProc(aeEventLoop *eventLoop, int status,
+        const char *host, const char *ip, void *clientData);
+
+/* Exported API */
+void dnsInit(int numthreads, long long ttl);
+int dnsResolve(aeEventLoop *eventLoop, const char *host, dnsResolveProc *proc,
+        void *clientData);
+void dnsFlushCache(void);
+void dnsKillThreads(void);
+
+#endif
@@ -145,7 +145,7 @@ void sdsupdatelen(sds s) {
  * @s  : the original string
  * @addlen: the length we want to add
  **/
-static sds sdsMakeRoomFor(sds s, size_t addlen) {
+sds sdsMakeRoomFor(sds s, size_t addlen) {
     /* @sh : point the the struct contains s
      * @newsh : points the new struct
      */
@@ -176,6 +176,18 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
     newsh->free = newlen - len;
     return newsh->buf;
 }
+/**
+ * account incr bytes written by the caller right after the end of s,
+ * in the room made by sdsMakeRoomFor(), and terminate the string again
+ * a negative incr removes bytes from the end of s
+ **/
+void sdsIncrLen(sds s, ssize_t incr) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+
+    sh->len += incr;
+    sh->free -= incr;
+    s[sh->len] = '\0';
+}
 /* concate len elements of t at the end of s */
 sds sdscatlen(sds s, void *t, size_t len) {
     /* @sh -> struct contains s */
@@ -33,6 +33,23 @@
 #include "config.h"
 
 static size_t used_memory = 0;
+/** 多线程使用 zmalloc 时，used_memory 需要用原子操作来更新 **/
+static int zmalloc_thread_safe = 0;
+
+#define increment_used_memory(__n) do { \
+    if (zmalloc_thread_safe) \
+        __sync_add_and_fetch(&used_memory, (__n)); \
+    else \
+        used_memory += (__n); \
+} while(0)
+
+#define decrement_used_memory(__n) do { \
+    if (zmalloc_thread_safe) \
+        __sync_sub_and_fetch(&used_memory, (__n)); \
+    else \
+        used_memory -= (__n); \
+} while(0)
+
 /** 分配 size 大小的空间 **/
 void *zmalloc(size_t size) {
     /** 申请 size + sizeof(size_t) 大小的空间 多申请的空间是用来统计 used_memory 的 **/
@@ -44,7 +61,7 @@ void *zmalloc(size_t size) {
      * 其中 redis_malloc_size 是一个宏定义
      * 在 config.h 里面
      * **/
-    used_memory += redis_malloc_size(ptr);
+    increment_used_memory(redis_malloc_size(ptr));
     return ptr;
 #else
     /**
@@ -55,7 +72,7 @@ void *zmalloc(size_t size) {
     *  这里为什么需要使用一个 size_t 的内存空间记录 size 值呢???
     **/
     *((size_t*)ptr) = size;
-    used_memory += size+sizeof(size_t);
+    increment_used_memory(size+sizeof(size_t));
     return (char*)ptr+sizeof(size_t);
 #endif
 }
@@ -77,8 +94,8 @@ void *zrealloc(void *ptr, size_t size) {
     if (!newptr) return NULL; /** newptr == NULL, then ptr will not be modified **/
 
     /** update used_memory **/
-    used_memory -= oldsize;
-    used_memory += redis_malloc_size(newptr);
+    decrement_used_memory(oldsize);
+    increment_used_memory(redis_malloc_size(newptr));
     return newptr;
 #else
     /** get the real address allocated before **/
@@ -89,8 +106,8 @@ void *zrealloc(void *ptr, size_t size) {
 
     *((size_t*)newptr) = size;
     /** update used_memory **/
-    used_memory -= oldsize;
-    used_memory += size;
+    decrement_used_memory(oldsize);
+    increment_used_memory(size);
     return (char*)newptr+sizeof(size_t);
 #endif
 }
@@ -105,13 +122,13 @@ void zfree(void *ptr) {
     if (ptr == NULL) return;
 #ifdef HAVE_MALLOC_SIZE
     /** update used_memory and free the memory **/
-    used_memory -= redis_malloc_size(ptr);
+    decrement_used_memory(redis_malloc_size(ptr));
     free(ptr);
 #else
     /** update the used_memory and free the memory **/
     realptr = (char*)ptr-sizeof(size_t);
     oldsize = *((size_t*)realptr);
-    used_memory -= oldsize+sizeof(size_t);
+    decrement_used_memory(oldsize+sizeof(size_t));
     free(realptr);
 #endif
 }
@@ -127,5 +144,12 @@ char *zstrdup(const char *s) {
 
 /** return the memory we have allocated **/
 size_t zmalloc_used_memory(void) {
+    if (zmalloc_thread_safe)
+        return __sync_add_and_fetch(&used_memory, 0);
     return used_memory;
 }
+
+/** 在创建其它线程之前调用，之后 used_memory 的更新都是原子的 **/
+void zmalloc_enable_thread_safeness(void) {
+    zmalloc_thread_safe = 1;
+}